@@ -18,9 +18,28 @@ typedef struct {
     int registered;          // 0: 아직 /join 안 함, 1: 등록됨
     char name[32];           // 닉네임
     char room[32];           // 방 이름
+    char inbuf[BUF_SIZE];    // 아직 개행이 안 온 입력 (명령이 여러 read 에 걸쳐 올 수 있음)
+    int inlen;               // inbuf 에 쌓인 길이
+    int discard;             // 1: 너무 긴 줄의 나머지를 다음 개행까지 버리는 중
+    int pos;                 // active[] 안에서의 위치
+    int room_id;             // rooms[] 인덱스 (-1: 방 없음)
+    int room_prev, room_next; // 같은 방 참여자 연결 (clients 인덱스, -1: 끝)
 } Client;
 
+/* 방: 참여자 연결 리스트의 머리. 브로드캐스트는 참여자 수만큼만 돈다 */
+typedef struct {
+    char name[32];
+    int head;                // 첫 참여자 (clients 인덱스, -1: 없음)
+    int count;
+} Room;
+
 static Client clients[FD_SETSIZE];
+static int active[FD_SETSIZE];      // 접속 중인 clients 인덱스 (앞쪽 nactive 개만 유효)
+static int nactive = 0;
+static int free_slots[FD_SETSIZE];  // 비어 있는 clients 인덱스 스택
+static int nfree = 0;
+static Room rooms[FD_SETSIZE];      // 사용 중인 방 (앞쪽 nrooms 개만 유효)
+static int nrooms = 0;
 
 void init_clients() {
     for (int i = 0; i < FD_SETSIZE; i++) {
@@ -28,20 +47,70 @@ void init_clients() {
         clients[i].registered = 0;
         clients[i].name[0] = '\0';
         clients[i].room[0] = '\0';
+        clients[i].inlen = 0;
+        clients[i].discard = 0;
+        clients[i].room_id = -1;
+        free_slots[nfree++] = FD_SETSIZE - 1 - i;   // 0번부터 꺼내 쓰도록
     }
 }
 
 int add_client(int sock) {
-    for (int i = 0; i < FD_SETSIZE; i++) {
-        if (clients[i].sock < 0) {
-            clients[i].sock = sock;
-            clients[i].registered = 0;
-            clients[i].name[0] = '\0';
-            clients[i].room[0] = '\0';
-            return i;
+    if (nfree == 0) return -1; // 꽉 참
+
+    int i = free_slots[--nfree];
+    clients[i].sock = sock;
+    clients[i].registered = 0;
+    clients[i].name[0] = '\0';
+    clients[i].room[0] = '\0';
+    clients[i].inlen = 0;
+    clients[i].discard = 0;
+    clients[i].room_id = -1;
+    clients[i].pos = nactive;
+    active[nactive++] = i;
+    return i;
+}
+
+/* 방 이름으로 찾기 (없으면 생성). 방 수만큼만 비교 */
+int room_get(const char *name) {
+    for (int r = 0; r < nrooms; r++) {
+        if (strcmp(rooms[r].name, name) == 0) return r;
+    }
+    int r = nrooms++;
+    strncpy(rooms[r].name, name, sizeof(rooms[r].name)-1);
+    rooms[r].name[sizeof(rooms[r].name)-1] = '\0';
+    rooms[r].head = -1;
+    rooms[r].count = 0;
+    return r;
+}
+
+void room_add(int r, int idx) {
+    clients[idx].room_id = r;
+    clients[idx].room_prev = -1;
+    clients[idx].room_next = rooms[r].head;
+    if (rooms[r].head >= 0) clients[rooms[r].head].room_prev = idx;
+    rooms[r].head = idx;
+    rooms[r].count++;
+}
+
+/* 방에서 빼고, 빈 방은 마지막 방을 그 자리로 옮겨 목록을 촘촘하게 유지 */
+void room_remove(int idx) {
+    int r = clients[idx].room_id;
+    if (r < 0) return;
+
+    Client *c = &clients[idx];
+    if (c->room_prev >= 0) clients[c->room_prev].room_next = c->room_next;
+    else rooms[r].head = c->room_next;
+    if (c->room_next >= 0) clients[c->room_next].room_prev = c->room_prev;
+    c->room_id = -1;
+
+    if (--rooms[r].count > 0) return;
+    int last = --nrooms;
+    if (r != last) {
+        rooms[r] = rooms[last];
+        for (int m = rooms[r].head; m >= 0; m = clients[m].room_next) {
+            clients[m].room_id = r;
         }
     }
-    return -1; // 꽉 참
 }
 
 void remove_client(int idx, fd_set *allset) {
@@ -52,17 +121,26 @@ void remove_client(int idx, fd_set *allset) {
                clients[idx].room);
         close(clients[idx].sock);
         FD_CLR(clients[idx].sock, allset);
+        room_remove(idx);
+
+        // active[] 에서 빼기: 마지막 항목을 빈자리로 옮김
+        int pos = clients[idx].pos;
+        int moved = active[--nactive];
+        active[pos] = moved;
+        clients[moved].pos = pos;
+        free_slots[nfree++] = idx;
+
         clients[idx].sock = -1;
         clients[idx].registered = 0;
         clients[idx].name[0] = '\0';
         clients[idx].room[0] = '\0';
+        clients[idx].inlen = 0;
+        clients[idx].discard = 0;
     }
 }
 
 /* 같은 방에 있는 클라이언트에게만 메시지 브로드캐스트 */
-void broadcast_message(const char *room,
-                       int from_idx,
-                       const char *msg)
+void broadcast_message(int from_idx, const char *msg)
 {
     char buf[BUF_SIZE];
 
@@ -72,12 +150,9 @@ void broadcast_message(const char *room,
              clients[from_idx].name,
              msg);
 
-    for (int i = 0; i < FD_SETSIZE; i++) {
+    int r = clients[from_idx].room_id;
+    for (int i = rooms[r].head; i >= 0; i = clients[i].room_next) {
         if (i == from_idx) continue;
-        if (clients[i].sock < 0) continue;
-        if (!clients[i].registered) continue;
-        if (strcmp(clients[i].room, room) != 0) continue;
-
         write(clients[i].sock, buf, strlen(buf));
     }
 
@@ -106,7 +181,9 @@ void handle_line(int idx, char *line)
             return;
         }
 
-        // 이미 등록되어 있어도 그냥 덮어쓰기 (간단 버전)
+        // 이미 등록되어 있어도 그냥 덮어쓰기 (간단 버전). 이전 방에서는 빠짐
+        room_remove(idx);
+
         strncpy(clients[idx].name, name, sizeof(clients[idx].name)-1);
         clients[idx].name[sizeof(clients[idx].name)-1] = '\0';
 
@@ -114,6 +191,7 @@ void handle_line(int idx, char *line)
         clients[idx].room[sizeof(clients[idx].room)-1] = '\0';
 
         clients[idx].registered = 1;
+        room_add(room_get(clients[idx].room), idx);
 
         char okmsg[BUF_SIZE];
         snprintf(okmsg, sizeof(okmsg),
@@ -141,7 +219,7 @@ void handle_line(int idx, char *line)
             return;
         }
 
-        broadcast_message(clients[idx].room, idx, msg);
+        broadcast_message(idx, msg);
     }
     else {
         // 알 수 없는 명령어 → 그냥 안내
@@ -150,6 +228,45 @@ void handle_line(int idx, char *line)
     }
 }
 
+/* 읽은 데이터를 클라이언트별 버퍼에 이어 붙이고 완성된 줄마다 handle_line 호출.
+   한 번의 read 에 명령 여러 개가 올 수도, 한 명령이 여러 read 로 나뉘어 올 수도 있다. */
+void handle_input(int idx, fd_set *allset)
+{
+    Client *c = &clients[idx];
+    int n = read(c->sock, c->inbuf + c->inlen, sizeof(c->inbuf) - 1 - c->inlen);
+
+    if (n <= 0) {
+        // 연결 종료
+        remove_client(idx, allset);
+        return;
+    }
+    c->inlen += n;
+
+    char *start = c->inbuf;
+    char *end = c->inbuf + c->inlen;
+    char *nl;
+    while ((nl = memchr(start, '\n', end - start)) != NULL) {
+        *nl = '\0';
+        if (c->discard) c->discard = 0;     // 잘린 긴 줄의 끝: 명령으로 해석하지 않음
+        else handle_line(idx, start);
+        start = nl + 1;
+    }
+
+    // 처리 못 한 나머지(다음 read 에 이어질 부분)를 앞으로 당김
+    c->inlen = end - start;
+    memmove(c->inbuf, start, c->inlen);
+
+    // 개행 없이 버퍼가 가득 찬 경우: 너무 긴 줄은 다음 개행까지 통째로 버림
+    if (c->inlen == (int)sizeof(c->inbuf) - 1) {
+        if (!c->discard) {
+            const char *err = "ERR Line too long\n";
+            write(c->sock, err, strlen(err));
+            c->discard = 1;
+        }
+        c->inlen = 0;
+    }
+}
+
 int main(int argc, char *argv[])
 {
     int listenfd, connfd;
@@ -235,23 +352,15 @@ int main(int argc, char *argv[])
             if (--nready <= 0) continue;
         }
 
-        // 기존 클라이언트 처리
-        for (int i = 0; i < FD_SETSIZE; i++) {
-            if (clients[i].sock < 0) continue;
-            int sock = clients[i].sock;
-
-            if (FD_ISSET(sock, &rset)) {
-                char buf[BUF_SIZE];
-                int n = read(sock, buf, sizeof(buf) - 1);
-
-                if (n <= 0) {
-                    // 연결 종료
-                    remove_client(i, &allset);
-                } else {
-                    buf[n] = '\0';
-                    // 이 예제는 한 번에 한 줄만 온다고 가정 (단순화)
-                    handle_line(i, buf);
-                }
+        // 기존 클라이언트 처리 (접속 중인 것만)
+        for (int k = 0; k < nactive; k++) {
+            int i = active[k];
+
+            if (FD_ISSET(clients[i].sock, &rset)) {
+                handle_input(i, &allset);
+
+                // 연결이 끊겼으면 마지막 항목이 이 자리로 왔으므로 다시 검사
+                if (clients[i].sock < 0) k--;
 
                 if (--nready <= 0) break;
             }
@@ -19,15 +19,109 @@
 static int  registered[FD_SETSIZE];
 static char nicknames[FD_SETSIZE][MAXNAME];
 static char rooms[FD_SETSIZE][MAXROOM];
+static char inbufs[FD_SETSIZE][MAXBUF];   /* 아직 개행이 안 온 입력 */
+static int  inlens[FD_SETSIZE];
+static int  discarding[FD_SETSIZE];       /* 1: 너무 긴 줄의 나머지를 다음 개행까지 버리는 중 */
+
+/* 접속 중인 fd 목록 (앞쪽 nactive 개만 유효) */
+static int  active[FD_SETSIZE];
+static int  nactive = 0;
+static int  active_pos[FD_SETSIZE];       /* fd → active[] 안 위치 */
+
+/* 방별 참여자 연결 리스트: 브로드캐스트는 방 인원만큼만 돈다 */
+static char room_names[FD_SETSIZE][MAXROOM];
+static int  room_head[FD_SETSIZE];        /* 첫 참여자 fd (-1: 없음) */
+static int  room_count[FD_SETSIZE];
+static int  nrooms = 0;                   /* 앞쪽 nrooms 개만 사용 중 */
+static int  room_of[FD_SETSIZE];          /* fd → 방 번호 (-1: 없음) */
+static int  room_prev[FD_SETSIZE], room_next[FD_SETSIZE];
 
 void init_clients() {
     for (int i = 0; i < FD_SETSIZE; i++) {
         registered[i] = 0;
         nicknames[i][0] = '\0';
         rooms[i][0] = '\0';
+        inlens[i] = 0;
+        discarding[i] = 0;
+        room_of[i] = -1;
     }
 }
 
+void add_active(int fd) {
+    active_pos[fd] = nactive;
+    active[nactive++] = fd;
+}
+
+/* 마지막 항목을 빈자리로 옮겨 목록을 촘촘하게 유지 */
+void remove_active(int fd) {
+    int pos = active_pos[fd];
+    int moved = active[--nactive];
+    active[pos] = moved;
+    active_pos[moved] = pos;
+}
+
+/* 방 번호 찾기 (없으면 생성) */
+int room_get(const char *name) {
+    for (int r = 0; r < nrooms; r++) {
+        if (strcmp(room_names[r], name) == 0) return r;
+    }
+    int r = nrooms++;
+    strncpy(room_names[r], name, MAXROOM-1);
+    room_names[r][MAXROOM-1] = '\0';
+    room_head[r] = -1;
+    room_count[r] = 0;
+    return r;
+}
+
+void room_add(int r, int fd) {
+    room_of[fd] = r;
+    room_prev[fd] = -1;
+    room_next[fd] = room_head[r];
+    if (room_head[r] >= 0) room_prev[room_head[r]] = fd;
+    room_head[r] = fd;
+    room_count[r]++;
+}
+
+/* 방에서 빼기. 빈 방은 마지막 방을 그 자리로 옮김 */
+void room_remove(int fd) {
+    int r = room_of[fd];
+    if (r < 0) return;
+
+    if (room_prev[fd] >= 0) room_next[room_prev[fd]] = room_next[fd];
+    else room_head[r] = room_next[fd];
+    if (room_next[fd] >= 0) room_prev[room_next[fd]] = room_prev[fd];
+    room_of[fd] = -1;
+
+    if (--room_count[r] > 0) return;
+    int last = --nrooms;
+    if (r != last) {
+        memcpy(room_names[r], room_names[last], MAXROOM);
+        room_head[r] = room_head[last];
+        room_count[r] = room_count[last];
+        for (int m = room_head[r]; m >= 0; m = room_next[m]) room_of[m] = r;
+    }
+}
+
+/* fd 가 속한 방 전원에게 전송 */
+void send_to_room(int fd, const char *out) {
+    for (int j = room_head[room_of[fd]]; j >= 0; j = room_next[j]) {
+        send(j, out, strlen(out), 0);
+    }
+}
+
+/* 연결 정리 */
+void drop_client(int fd, fd_set *activefds) {
+    close(fd);
+    FD_CLR(fd, activefds);
+    room_remove(fd);
+    remove_active(fd);
+    registered[fd] = 0;
+    nicknames[fd][0] = '\0';
+    rooms[fd][0] = '\0';
+    inlens[fd] = 0;
+    discarding[fd] = 0;
+}
+
 void handle_line(int fd, fd_set *activefds, char *line) {
     char buf[MAXBUF];
 
@@ -47,9 +141,11 @@ void handle_line(int fd, fd_set *activefds, char *line) {
             return;
         }
 
+        room_remove(fd);   /* 다시 /join 하면 이전 방에서 빠짐 */
         strncpy(nicknames[fd], name, MAXNAME-1);
         strncpy(rooms[fd], room, MAXROOM-1);
         registered[fd] = 1;
+        room_add(room_get(room), fd);
 
         snprintf(buf, sizeof(buf),
                  "OK Joined as %s in room %s\n", name, room);
@@ -75,12 +171,7 @@ void handle_line(int fd, fd_set *activefds, char *line) {
                  "[room %s][%s] %s\n",
                  rooms[fd], nicknames[fd], msg);
 
-        for (int j = 0; j < FD_SETSIZE; j++) {
-            if (FD_ISSET(j, activefds) && registered[j] &&
-                strcmp(rooms[j], rooms[fd]) == 0) {
-                send(j, out, strlen(out), 0);
-            }
-        }
+        send_to_room(fd, out);
     }
 
     /* /quit 처리 */
@@ -91,18 +182,9 @@ void handle_line(int fd, fd_set *activefds, char *line) {
                      "NOTICE %s left room %s\n",
                      nicknames[fd], rooms[fd]);
 
-            for (int j = 0; j < FD_SETSIZE; j++) {
-                if (FD_ISSET(j, activefds) && registered[j] &&
-                    strcmp(rooms[j], rooms[fd]) == 0) {
-                    send(j, out, strlen(out), 0);
-                }
-            }
+            send_to_room(fd, out);
         }
-        close(fd);
-        FD_CLR(fd, activefds);
-        registered[fd] = 0;
-        nicknames[fd][0] = '\0';
-        rooms[fd][0] = '\0';
+        drop_client(fd, activefds);
     }
 
     else {
@@ -111,6 +193,46 @@ void handle_line(int fd, fd_set *activefds, char *line) {
     }
 }
 
+/* 받은 데이터를 fd 별 버퍼에 이어 붙이고 완성된 줄마다 handle_line 호출.
+   한 번의 recv 에 명령 여러 개가, 또는 명령 하나가 여러 recv 에 나뉘어 올 수 있다. */
+void handle_input(int fd, fd_set *activefds) {
+    int nbytes = recv(fd, inbufs[fd] + inlens[fd], MAXBUF - 1 - inlens[fd], 0);
+    if (nbytes <= 0) {
+        drop_client(fd, activefds);
+        return;
+    }
+    inlens[fd] += nbytes;
+
+    char *start = inbufs[fd];
+    char *end = inbufs[fd] + inlens[fd];
+    char *nl;
+    while ((nl = memchr(start, '\n', end - start)) != NULL) {
+        *nl = '\0';
+        if (discarding[fd]) {           /* 잘린 긴 줄의 끝: 명령으로 해석하지 않음 */
+            discarding[fd] = 0;
+            start = nl + 1;
+            continue;
+        }
+        handle_line(fd, activefds, start);
+        if (!FD_ISSET(fd, activefds)) return;   /* /quit 으로 연결이 닫힘 */
+        start = nl + 1;
+    }
+
+    /* 남은 조각은 다음 recv 와 이어 붙이도록 앞으로 당김 */
+    inlens[fd] = end - start;
+    memmove(inbufs[fd], start, inlens[fd]);
+
+    /* 개행 없이 버퍼가 가득 참: 너무 긴 줄은 다음 개행까지 통째로 버림 */
+    if (inlens[fd] == MAXBUF - 1) {
+        if (!discarding[fd]) {
+            const char *err = "ERR Line too long.\n";
+            send(fd, err, strlen(err), 0);
+            discarding[fd] = 1;
+        }
+        inlens[fd] = 0;
+    }
+}
+
 int main(void) {
     setlocale(LC_ALL, "");
 
@@ -118,8 +240,7 @@ int main(void) {
     struct sockaddr_in serv_addr, cli_addr;
     socklen_t addrlen;
     fd_set activefds, readfds;
-    int maxfd, i, nbytes;
-    char buf[MAXBUF];
+    int maxfd, i;
 
     init_clients();
 
@@ -147,31 +268,28 @@ int main(void) {
 
         select(maxfd + 1, &readfds, NULL, NULL, NULL);
 
-        for (i = 0; i <= maxfd; i++) {
-            if (!FD_ISSET(i, &readfds)) continue;
-
-            if (i == listenfd) {
-                addrlen = sizeof(cli_addr);
-                newfd = accept(listenfd,
-                               (struct sockaddr *)&cli_addr, &addrlen);
+        if (FD_ISSET(listenfd, &readfds)) {
+            addrlen = sizeof(cli_addr);
+            newfd = accept(listenfd,
+                           (struct sockaddr *)&cli_addr, &addrlen);
 
+            if (newfd >= 0) {
                 FD_SET(newfd, &activefds);
                 if (newfd > maxfd) maxfd = newfd;
+                add_active(newfd);
 
                 printf("SERVER: new client %s, fd=%d\n",
                        inet_ntoa(cli_addr.sin_addr), newfd);
             }
-            else {
-                nbytes = recv(i, buf, sizeof(buf) - 1, 0);
-                if (nbytes <= 0) {
-                    close(i);
-                    FD_CLR(i, &activefds);
-                    registered[i] = 0;
-                } else {
-                    buf[nbytes] = '\0';
-                    handle_line(i, &activefds, buf);
-                }
-            }
+        }
+
+        /* 접속 중인 fd 만 확인. 끊겨서 빠지면 마지막 항목이 그 자리로 오므로 다시 검사 */
+        for (i = 0; i < nactive; i++) {
+            int fd = active[i];
+            if (!FD_ISSET(fd, &readfds)) continue;
+
+            handle_input(fd, &activefds);
+            if (!FD_ISSET(fd, &activefds)) i--;
         }
     }
 
@@ -1,16 +1,72 @@
+#define _GNU_SOURCE
 #include <gtk/gtk.h>
 #include <glib.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
 #include <locale.h>
 
 #define PORT    3490
 #define MAXBUF  4096
 
+#define RECV_CACHE_DIR "recv_cache"   // 받은 파일의 해시별 로컬 캐시
+#define THUMB_CACHE_DIR "thumb_cache" // 받은 이미지의 해시별 미리보기 (PNG)
+#define THUMB_SIZE     160            // 미리보기 최대 가로 / 세로
+#define THUMB_WORKERS  2              // 이미지 디코딩 작업 스레드 수
+#define RELAY_CREDIT   (64 * 1024)    // 파일 중계를 서버에 미리 허락해 두는 양 (/credit)
+#define UPLOAD_NOTE_US (100 * 1000)   // 업로드 스레드가 진행 상황을 UI 에 알리는 간격
+#define CONNECT_TIMEOUT_S 10          // 접속 시도 제한 시간
+#define UPLOAD_REPLY_TIMEOUT_S 30     // /file 에 대한 SEND/SKIP 응답을 기다리는 시간 (넘으면 연결을 끊음)
+
+#define RX_MIN         4096           // 수신 버퍼 시작 크기
+#define RX_MAX         (1024 * 1024)  // 수신 버퍼 최대 크기 (줄 하나도 이보다 길 수 없음)
+#define RX_WAKE_BUDGET (8 * 1024 * 1024) // 한 번 깨어났을 때 읽을 최대 바이트 (UI 가 굶지 않도록)
+#define RX_SHRINK_WAKES 16            // 버퍼의 1/4 도 안 쓰는 수신이 이만큼 이어지면 줄임
+
+#define WRITE_CHUNK     (1024 * 1024) // 받은 파일을 디스크에 쓰는 단위
+#define WRITE_ALIGN     4096          // 쓰기 버퍼 / 길이 / 위치 정렬 (O_DIRECT 조건)
+#define WRITE_QUEUE_MAX (32 * 1024 * 1024) // 아직 못 쓴 양이 이보다 많으면 수신을 잠시 멈춤
+
+#define SCROLLBACK_DEFAULT 5000       // 텍스트 보기에 남기는 줄 수 (--scrollback N)
+#define LIST_HISTORY_MAX   1000000    // 목록 보기에 남기는 줄 수
+#define TRIM_BATCH_PCT     10         // 한도를 이 비율만큼 넘으면 앞에서 한꺼번에 지움
+#define STORE_DIR          "msg_store" // 서버 / 방별 로컬 메시지 기록
+#define STORE_SCREEN_LINES 50         // 접속할 때 기록에서 바로 그리는 줄 수 (한 화면)
+#define MAX_TABS           9          // 입장한 방 + /watch 로 함께 받는 방 (서버의 MAX_WATCH + 1)
+#define TAB_PENDING_MAX    (1024 * 1024) // 안 보는 탭에 쌓아 두는 최대 바이트 (넘으면 오래된 줄부터 버림)
+#define HUD_PROBE_MS       10         // main loop 지연을 재는 타이머 간격
+#define HUD_STALL_US       (50 * 1000) // 타이머가 이보다 늦게 불리면 멈춤으로 셈
+#define HASHLEN     64         // 파일 해시 16진 문자열 길이 (SHA-256, 서버 스풀 키와 동일)
+
+typedef struct RecvFile RecvFile;
+typedef struct WriteChunk WriteChunk;
+
+/* 방 탭: 버퍼와 목록이 탭마다 따로. 보이는 탭만 프레임마다 넣고, 나머지는 줄을 모아 두며
+   안 읽은 수만 세다가 탭을 열 때 한 번에 넣음. 0번 탭은 입장한 방, 나머지는 /watch 한 방 */
+typedef struct {
+    char room[64];
+    GtkWidget *label;
+    GtkTextBuffer *buffer;
+    GtkTextMark *end;            // 버퍼 끝 (자동 스크롤, 계속 재사용)
+    GtkListStore *rows;          // 목록 보기 행
+    int row_count;
+    GString *pending;            // 아직 버퍼에 안 넣은 줄들
+    int unread;
+    int store_fd;                // 로컬 메시지 기록 (-1: 없음)
+    unsigned long long last_seq; // 기록에 쓴 마지막 순번 (0번 탭은 ChatApp 의 last_seq 를 씀)
+} ChatTab;
+
 /* 프로그램 상태와 위젯들을 담는 구조체 (Context) */
 typedef struct {
     /* UI Widgets */
@@ -18,53 +74,821 @@ typedef struct {
     GtkWidget *entry_ip;
     GtkWidget *entry_nick;
     GtkWidget *entry_room;
+    GtkWidget *notebook;         // 탭 머리만 있는 노트북: 탭을 바꾸면 보기에 그 탭의 버퍼를 붙임
     GtkWidget *textview_chat;
     GtkWidget *entry_msg;
     GtkWidget *btn_connect;
     GtkWidget *btn_send;
     GtkWidget *btn_file;
+    GtkWidget *progress_upload;  // 업로드 진행률 / 속도 / 남은 시간 (업로드 중에만 보임)
+
+    /* 채팅창 출력은 프레임마다 한 번에: 줄마다 넣고 스크롤하면 줄 수만큼 레이아웃을 다시 함 */
+    ChatTab tabs[MAX_TABS];
+    int ntabs;
+    int cur_tab;                 // 보이는 탭
+    guint chat_flush_id;         // 다음 프레임에 넣을 tick 콜백 (0: 없음)
+    int scrollback;              // 텍스트 보기 최대 줄 수
+
+    /* 목록 보기: 한 줄 = 한 행, 높이 고정 모드라 보이는 행만 그려서 긴 기록도 스크롤이 가벼움 */
+    GtkWidget *view_stack;       // "text" / "list"
+    GtkWidget *btn_view;
+    GtkWidget *list_chat;
+    GtkWidget *list_scrolled;
 
     /* Network State */
     int sockfd;
     GIOChannel *sock_channel;
     guint io_watch_id;
+    guint out_watch_id;          // send_queue 가 남아 있을 때만 G_IO_OUT 감시
+    GString *send_queue;         // 소켓이 바로 받아 주지 않은 보낼 데이터
+
+    /* 논블로킹 접속: 접속 중에는 Connect 버튼이 Cancel 이 됨 */
+    gboolean connecting;
+    guint connect_watch_id;      // 접속 완료 (G_IO_OUT) 감시
+    guint connect_timeout_id;
+
+    /* 수신 버퍼: [rx_head, rx_tail) 이 아직 해석 안 한 바이트. 한 줄이나 파일 데이터가
+       여러 recv 에 나뉘어 와도 이어서 해석하고, 다 쓰면 앞으로 당김 */
+    char *rx_buf;
+    size_t rx_head, rx_tail, rx_cap;
+    int rx_small;                // 버퍼를 적게 쓴 연속 수신 횟수 (줄이기 판단)
 
     /* File Transfer State */
     gboolean receiving_file;
     long recv_file_remaining;
-    FILE *recv_fp;
+    RecvFile *recv_file;         // 쓰기 스레드에 넘긴 수신 파일 (없으면 데이터는 건너뜀)
+    WriteChunk *recv_chunk;      // 채우는 중인 쓰기 버퍼
     char recv_filename[256];
+    char recv_hash[HASHLEN + 1];          // 수신 중인 파일의 해시 (구버전 서버면 빈 문자열)
+    gboolean recv_relay;         // 실시간 중계로 받는 중 (받은 만큼 /credit 으로 더 허락)
+    long recv_credit;            // 서버에 허락했지만 아직 안 받은 중계 바이트
+
+    /* 업로드 대기 상태 (/file 해시 알림 후 서버의 SEND/SKIP 응답 대기) */
+    gboolean upload_pending;
+    guint upload_timeout_id;     // SEND/SKIP 응답 대기 시간 제한
+    char *upload_path;
+    char upload_name[256];
+    char upload_hash[HASHLEN + 1];
+    long upload_size;
+
+    /* 업로드 데이터는 작업 스레드가 sendfile 로 보내고, UI 는 g_idle_add 로 진행 상황만 받음 */
+    GThread *upload_thread;      // 전송 중인 작업 스레드 (없으면 NULL)
+    gint upload_cancel;          // 1: 작업 스레드 중단 요청 (g_atomic)
+    guint upload_gen;            // 업로드마다 증가: 끊긴 뒤 늦게 도착한 알림 무시
+    gint64 upload_started;
+    GString *send_backlog;       // 업로드 중에 보낼 명령 (파일 데이터 사이에 끼면 안 되므로 끝난 뒤 전송)
+
+    /* 받은 파일은 쓰기 스레드가 디스크에 기록: UI 는 채운 버퍼를 큐에 넘기기만 함 */
+    GThread *writer_thread;      // 처음 파일을 받을 때 띄움
+    WriteChunk *wr_queue;        // 넘긴 조각 스택 (lock-free, 최근 것이 머리)
+    int wr_wake;                 // eventfd: 쓰기 스레드 깨우기
+    gboolean closing;            // 창이 닫힘: 작업 스레드가 남긴 idle 알림은 UI 를 건드리지 않고 버림
+    gint wr_inflight;            // 넘겼지만 아직 안 쓴 바이트 (g_atomic)
+    gint rx_paused;              // 0: 수신 중, 1: 디스크 대기로 멈춤, 2: 재개 예약됨 (g_atomic)
+    gboolean wr_direct;          // --odirect: 페이지 캐시를 거치지 않고 씀
+
+    GThreadPool *thumb_pool;     // 받은 이미지 → 미리보기 (디코딩은 작업 스레드에서)
+
+    /* 성능 측정 (Stats 버튼 / --hud, --trace <파일>): 1초 구간마다 모아서 채팅창 위에 표시하고
+       CSV 로 한 줄씩 기록. 측정 중이 아니면 타이머도 프레임 시계 처리도 없음 */
+    GtkWidget *hud_label;
+    GtkWidget *btn_stats;
+    gboolean stats_on;
+    FILE *trace_fp;
+    guint hud_timer_id;          // 1초마다 표시 / 기록
+    guint probe_timer_id;        // HUD_PROBE_MS 마다 main loop 지연 측정
+    gint64 stats_started, probe_last, frame_start;
+    long st_msgs, st_bytes;      // 받은 줄 / 바이트
+    gint64 st_parse_us;          // rx_parse 누적
+    gint64 st_append_us;         // append_chat_text (탭에 줄 모으기) 누적
+    gint64 st_insert_us;         // 모은 줄을 버퍼 / 목록에 넣기 (chat_flush) 누적
+    long st_stalls;
+    gint64 st_stall_max_us;
+    long st_frames;
+    gint64 st_frame_sum_us, st_frame_max_us;   // 프레임 하나 (update ~ after-paint) 처리 시간
+
+    /* 재접속 상태: 마지막으로 본 방 순번과 서버가 준 토큰 */
+    unsigned long long last_seq;
+    char session_token[17];
+    char session_nick[64];
+    char session_room[64];
+    char session_server[64];
+
+    /* 로컬 메시지 기록: 서버 / 방마다 "<순번> <줄>\n" 을 이어 쓰는 파일 (서버의 방 로그와 같은 형식, 탭마다 하나).
+       접속할 때 끝 한 화면만 mmap 으로 읽어 그리고, 그 뒤 순번부터 서버에 요청 */
+    GQueue ack_texts;            // ACK 를 기다리는 내 메시지 (보낸 순서, 순번을 받으면 기록)
 } ChatApp;
 
-/* 채팅창에 텍스트 추가 (UTF-8 검증 포함) */
-static void append_chat_text(ChatApp *app, const char *msg)
+/* 한도를 TRIM_BATCH_PCT 넘게 넘었을 때만 앞에서 한도까지 지움 (줄마다 지우면 매번 레이아웃) */
+static void chat_trim_text(ChatApp *app, GtkTextBuffer *buffer)
+{
+    int lines = gtk_text_buffer_get_line_count(buffer) - 1;   // 마지막 빈 줄 제외
+    if (app->scrollback <= 0 || lines <= app->scrollback + app->scrollback / 100 * TRIM_BATCH_PCT) return;
+    GtkTextIter start, cut;
+    gtk_text_buffer_get_start_iter(buffer, &start);
+    gtk_text_buffer_get_iter_at_line(buffer, &cut, lines - app->scrollback);
+    gtk_text_buffer_delete(buffer, &start, &cut);
+}
+
+/* 목록 보기에 줄마다 한 행. 보이는 탭이고 맨 아래를 보고 있었으면 계속 따라감 */
+static void chat_append_rows(ChatApp *app, ChatTab *tab, const char *text, size_t len)
+{
+    gboolean visible = (tab == &app->tabs[app->cur_tab]);
+    GtkAdjustment *adj = gtk_scrolled_window_get_vadjustment(GTK_SCROLLED_WINDOW(app->list_scrolled));
+    gboolean follow = visible && gtk_adjustment_get_value(adj) + gtk_adjustment_get_page_size(adj) >= gtk_adjustment_get_upper(adj) - 1;
+
+    const char *p = text, *end = text + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) nl = end;
+        char *line = g_strndup(p, nl - p);
+        GtkTreeIter iter;
+        gtk_list_store_append(tab->rows, &iter);
+        gtk_list_store_set(tab->rows, &iter, 0, line, -1);
+        g_free(line);
+        tab->row_count++;
+        p = nl + 1;
+    }
+
+    if (tab->row_count > LIST_HISTORY_MAX + LIST_HISTORY_MAX / 100 * TRIM_BATCH_PCT) {
+        GtkTreeIter iter;
+        int drop = tab->row_count - LIST_HISTORY_MAX;
+        while (drop-- > 0 && gtk_tree_model_iter_nth_child(GTK_TREE_MODEL(tab->rows), &iter, NULL, 0)) {
+            gtk_list_store_remove(tab->rows, &iter);
+            tab->row_count--;
+        }
+    }
+
+    if (follow && gtk_widget_get_mapped(app->list_chat) && tab->row_count > 0) {
+        GtkTreePath *path = gtk_tree_path_new_from_indices(tab->row_count - 1, -1);
+        gtk_tree_view_scroll_to_cell(GTK_TREE_VIEW(app->list_chat), path, NULL, FALSE, 0, 0);
+        gtk_tree_path_free(path);
+    }
+}
+
+/* 자동 스크롤 (보이는 탭만) */
+static void chat_scroll_end(ChatApp *app, ChatTab *tab)
 {
-    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(app->textview_chat));
+    if (tab != &app->tabs[app->cur_tab]) return;
     GtkTextIter end_iter;
-    gtk_text_buffer_get_end_iter(buffer, &end_iter);
-    
+    gtk_text_buffer_get_end_iter(tab->buffer, &end_iter);
+    gtk_text_buffer_move_mark(tab->buffer, tab->end, &end_iter);
+    gtk_text_view_scroll_to_mark(GTK_TEXT_VIEW(app->textview_chat), tab->end, 0.0, TRUE, 0.0, 1.0);
+}
+
+/* 모아 둔 줄을 한 번에 넣고 끝으로 한 번만 스크롤 */
+static void chat_flush(ChatApp *app, ChatTab *tab)
+{
+    if (tab->pending->len == 0) return;
+    gint64 t0 = g_get_monotonic_time();
+    GtkTextIter end_iter;
+    gtk_text_buffer_get_end_iter(tab->buffer, &end_iter);
+    gtk_text_buffer_insert(tab->buffer, &end_iter, tab->pending->str, tab->pending->len);
+    chat_append_rows(app, tab, tab->pending->str, tab->pending->len - 1);   // 마지막 개행 제외
+    g_string_truncate(tab->pending, 0);
+    chat_trim_text(app, tab->buffer);
+
+    chat_scroll_end(app, tab);
+    app->st_insert_us += g_get_monotonic_time() - t0;
+}
+
+static gboolean chat_flush_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+    app->chat_flush_id = 0;
+    chat_flush(app, &app->tabs[app->cur_tab]);
+    return G_SOURCE_REMOVE;
+}
+
+/* 탭 이름: 안 읽은 줄이 있으면 "방 (N)" */
+static void tab_update_label(ChatTab *tab)
+{
+    char text[96];
+    const char *name = tab->room[0] ? tab->room : "Chat";
+    if (tab->unread > 0) snprintf(text, sizeof(text), "%s (%d)", name, tab->unread);
+    else snprintf(text, sizeof(text), "%s", name);
+    gtk_label_set_text(GTK_LABEL(tab->label), text);
+}
+
+/* 탭에 한 줄 추가 (UTF-8 검증 포함). 보이는 탭은 다음 프레임에 모아서 넣고, 안 보는 탭은
+   열 때까지 모아 두기만 함 (너무 쌓이면 앞쪽을 버림: 어차피 스크롤백 한도에서 잘릴 줄) */
+static void tab_append(ChatApp *app, ChatTab *tab, const char *msg)
+{
+    gint64 t0 = g_get_monotonic_time();
     // [수정] UTF-8 유효성 검사: 깨진 문자열이면 대체 텍스트 출력
     if (g_utf8_validate(msg, -1, NULL)) {
-        gtk_text_buffer_insert(buffer, &end_iter, msg, -1);
+        g_string_append(tab->pending, msg);
     } else {
-        gtk_text_buffer_insert(buffer, &end_iter, "[Binary Data or Invalid UTF-8]", -1);
+        g_string_append(tab->pending, "[Binary Data or Invalid UTF-8]");
     }
-    
-    gtk_text_buffer_insert(buffer, &end_iter, "\n", -1);
-    
-    /* 자동 스크롤 */
-    GtkTextMark *mark = gtk_text_buffer_create_mark(buffer, NULL, &end_iter, FALSE);
-    gtk_text_view_scroll_to_mark(GTK_TEXT_VIEW(app->textview_chat), mark, 0.0, TRUE, 0.0, 1.0);
-    gtk_text_buffer_delete_mark(buffer, mark);
+    g_string_append_c(tab->pending, '\n');
+
+    if (tab == &app->tabs[app->cur_tab]) {
+        if (!app->chat_flush_id) {
+            app->chat_flush_id = gtk_widget_add_tick_callback(app->textview_chat, chat_flush_tick, app, NULL);
+        }
+    } else {
+        tab->unread++;
+        tab_update_label(tab);
+        if (tab->pending->len > TAB_PENDING_MAX) {
+            const char *cut = memchr(tab->pending->str + tab->pending->len - TAB_PENDING_MAX / 2, '\n', TAB_PENDING_MAX / 2);
+            if (cut) g_string_erase(tab->pending, 0, cut + 1 - tab->pending->str);
+        }
+    }
+    app->st_append_us += g_get_monotonic_time() - t0;
+}
+
+/* 채팅창에 텍스트 추가: 입장한 방의 탭 (연결 상태 알림도 여기) */
+static void append_chat_text(ChatApp *app, const char *msg)
+{
+    tab_append(app, &app->tabs[0], msg);
+}
+
+/* 파일 내용의 SHA-256 해시 계산 (서버의 스풀 키와 동일) */
+static gboolean hash_file(const char *path, char out[HASHLEN + 1], long *size)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return FALSE;
+
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    long total = 0;
+    unsigned char buf[MAXBUF];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        g_checksum_update(sum, buf, n);
+        total += n;
+    }
+    fclose(fp);
+
+    snprintf(out, HASHLEN + 1, "%s", g_checksum_get_string(sum));
+    g_checksum_free(sum);
+    if (size) *size = total;
+    return TRUE;
+}
+
+/* 받은 파일을 해시 캐시에 등록 (하드 링크라 추가 디스크 사용 없음) */
+static void cache_store(const char *path, const char *hash)
+{
+    char cache_path[HASHLEN + 32];
+    mkdir(RECV_CACHE_DIR, 0755);
+    snprintf(cache_path, sizeof(cache_path), RECV_CACHE_DIR "/%s", hash);
+    unlink(cache_path);
+    link(path, cache_path);
+}
+
+/* 캐시에 같은 내용이 있으면 recv_<name>으로 복원. 링크 후 내용이 바뀌었을 수 있으니 해시로 재검증 */
+static gboolean cache_restore(const char *hash, long size, const char *dest)
+{
+    char cache_path[HASHLEN + 32], actual[HASHLEN + 1];
+    long actual_size = 0;
+    snprintf(cache_path, sizeof(cache_path), RECV_CACHE_DIR "/%s", hash);
+
+    if (!hash_file(cache_path, actual, &actual_size)) return FALSE;
+    if (actual_size != size || strcmp(actual, hash) != 0) {
+        unlink(cache_path);
+        return FALSE;
+    }
+    if (strcmp(cache_path, dest) != 0) {
+        unlink(dest);
+        if (link(cache_path, dest) < 0) return FALSE;
+    }
+    return TRUE;
+}
+
+/* 미리보기 작업: 작업 스레드가 thumb 를 채워 UI 로 돌려줌 */
+typedef struct {
+    ChatApp *app;
+    char path[256];
+    char hash[HASHLEN + 1];      // 비어 있으면 작업 스레드가 계산
+    GdkPixbuf *thumb;
+} ThumbJob;
+
+/* UI 스레드: 그때까지 온 줄 뒤에 미리보기를 붙임 (파일은 입장한 방에서만 오므로 0번 탭) */
+static gboolean thumb_ready_idle(gpointer data)
+{
+    ThumbJob *job = data;
+    ChatApp *app = job->app;
+    if (app->closing) {
+        g_object_unref(job->thumb);
+        g_free(job);
+        return G_SOURCE_REMOVE;
+    }
+    ChatTab *tab = &app->tabs[0];
+    chat_flush(app, tab);
+
+    GtkTextIter end_iter;
+    gtk_text_buffer_get_end_iter(tab->buffer, &end_iter);
+    gtk_text_buffer_insert_pixbuf(tab->buffer, &end_iter, job->thumb);
+    gtk_text_buffer_insert(tab->buffer, &end_iter, "\n", 1);
+    chat_scroll_end(app, tab);
+
+    g_object_unref(job->thumb);
+    g_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+/* 작업 스레드: 이미지가 아니면 그냥 끝. 해시 캐시에 미리보기가 있으면 그것만 읽고,
+   없으면 원본을 축소하며 디코딩해 캐시에 저장 (다음에 같은 파일은 작은 PNG 하나만 읽음) */
+static void thumb_decode(gpointer data, gpointer user_data)
+{
+    ThumbJob *job = data;
+    char cache_path[HASHLEN + 32], tmp_path[HASHLEN + 64];
+
+    if (!gdk_pixbuf_get_file_info(job->path, NULL, NULL) ||
+        (!job->hash[0] && !hash_file(job->path, job->hash, NULL))) {
+        g_free(job);
+        return;
+    }
+    snprintf(cache_path, sizeof(cache_path), THUMB_CACHE_DIR "/%s.png", job->hash);
+    job->thumb = gdk_pixbuf_new_from_file(cache_path, NULL);
+    if (!job->thumb) {
+        job->thumb = gdk_pixbuf_new_from_file_at_scale(job->path, THUMB_SIZE, THUMB_SIZE, TRUE, NULL);
+        if (job->thumb) {
+            // 같은 이미지를 두 작업이 동시에 만들 수 있으므로 임시 이름에 쓰고 바꿈
+            mkdir(THUMB_CACHE_DIR, 0755);
+            snprintf(tmp_path, sizeof(tmp_path), "%s.%p", cache_path, (void *)job);
+            if (gdk_pixbuf_save(job->thumb, tmp_path, "png", NULL, NULL)) rename(tmp_path, cache_path);
+            else unlink(tmp_path);
+        }
+    }
+    if (!job->thumb) {
+        g_free(job);
+        return;
+    }
+    g_idle_add(thumb_ready_idle, job);
+}
+
+/* 받은 파일의 미리보기 요청 (바로 돌아옴) */
+static void thumb_request(ChatApp *app, const char *path, const char *hash)
+{
+    if (!app->thumb_pool) return;
+    ThumbJob *job = g_new0(ThumbJob, 1);
+    job->app = app;
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    snprintf(job->hash, sizeof(job->hash), "%s", hash);
+    g_thread_pool_push(app->thumb_pool, job, NULL);
+}
+
+/* 받는 파일 하나: 쓰기 스레드가 <path>.part 에 쓰고, 끝나면 fsync 후 <path> 로 이름을 바꿈 */
+struct RecvFile {
+    ChatApp *app;
+    int fd;
+    long size;                   // 헤더가 알린 크기 (미리 할당)
+    long written;
+    gboolean failed;
+    gboolean direct;             // O_DIRECT 로 열림
+    char path[256];
+    char hash[HASHLEN + 1];
+};
+
+enum { WCHUNK_OPEN, WCHUNK_DATA, WCHUNK_CLOSE, WCHUNK_ABORT, WCHUNK_QUIT };
+
+/* UI → 쓰기 스레드 작업. 데이터 버퍼는 WRITE_ALIGN 정렬 */
+struct WriteChunk {
+    WriteChunk *next;
+    RecvFile *file;
+    int kind;
+    size_t len;
+    char *data;
+};
+
+static gboolean socket_io_cb(GIOChannel *source, GIOCondition condition, gpointer data);
+
+/* 쓰기 스레드 → UI: 저장 결과 알림, 해시 캐시 등록 */
+static gboolean recv_file_done_idle(gpointer data)
+{
+    RecvFile *f = data;
+    char msg[512];
+    if (f->failed) {
+        snprintf(msg, sizeof(msg), "** 파일 저장 실패: %s **", f->path);
+    } else {
+        if (f->hash[0]) cache_store(f->path, f->hash);
+        snprintf(msg, sizeof(msg), "** 파일 수신 완료: %s **", f->path);
+    }
+    if (f->app->closing) {
+        g_free(f);
+        return G_SOURCE_REMOVE;
+    }
+    append_chat_text(f->app, msg);
+    if (!f->failed) thumb_request(f->app, f->path, f->hash);
+    g_free(f);
+    return G_SOURCE_REMOVE;
+}
+
+/* 디스크가 따라잡음: 멈췄던 수신 감시를 다시 등록 */
+static gboolean writer_resume_idle(gpointer data)
+{
+    ChatApp *app = data;
+    if (g_atomic_int_compare_and_exchange(&app->rx_paused, 2, 0) && app->sock_channel && !app->io_watch_id) {
+        app->io_watch_id = g_io_add_watch(app->sock_channel,
+                                          G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+                                          socket_io_cb, app);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/* 조각 하나 처리 (쓰기 스레드) */
+static void writer_handle(ChatApp *app, WriteChunk *c)
+{
+    RecvFile *f = c->file;
+    char part[300];
+    snprintf(part, sizeof(part), "%s.part", f->path);
+
+    switch (c->kind) {
+    case WCHUNK_OPEN:
+        f->fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (f->direct ? O_DIRECT : 0), 0644);
+        if (f->fd < 0 && f->direct) {   // tmpfs 처럼 O_DIRECT 를 못 쓰는 곳
+            f->direct = FALSE;
+            f->fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+        if (f->fd < 0) f->failed = TRUE;
+        else if (fallocate(f->fd, 0, 0, f->size) < 0 && errno == ENOSPC) f->failed = TRUE;   // 공간 부족은 미리 실패
+        break;
+    case WCHUNK_DATA:
+        for (size_t off = 0; !f->failed && off < c->len; ) {
+            ssize_t n = pwrite(f->fd, c->data + off, c->len - off, f->written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EINVAL && f->direct) {
+                // 마지막 짧은 조각처럼 정렬이 안 맞으면 O_DIRECT 없이 이어 씀
+                fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_DIRECT);
+                f->direct = FALSE;
+                continue;
+            }
+            if (n <= 0) f->failed = TRUE;
+            else {
+                off += n;
+                f->written += n;
+            }
+        }
+        break;
+    case WCHUNK_CLOSE:
+        if (f->fd >= 0) {
+            if (!f->failed && fsync(f->fd) < 0) f->failed = TRUE;
+            close(f->fd);
+        }
+        // 다 쓰고 디스크에 내린 뒤에만 최종 이름이 생김: 중간에 죽어도 반쯤 쓴 recv_<name> 은 없음
+        if (!f->failed && rename(part, f->path) < 0) f->failed = TRUE;
+        if (f->failed) unlink(part);
+        g_idle_add(recv_file_done_idle, f);
+        break;
+    case WCHUNK_ABORT:
+        if (f->fd >= 0) close(f->fd);
+        unlink(part);
+        g_free(f);
+        break;
+    }
+
+    if (c->data) {
+        g_atomic_int_add(&app->wr_inflight, -(gint)c->len);
+        free(c->data);
+    }
+    g_free(c);
+    if (g_atomic_int_get(&app->wr_inflight) <= WRITE_QUEUE_MAX / 2 &&
+        g_atomic_int_compare_and_exchange(&app->rx_paused, 1, 2)) {
+        g_idle_add(writer_resume_idle, app);
+    }
+}
+
+/* 쓰기 스레드: eventfd 로 깨면 큐를 통째로 가져와 넣은 순서대로 처리 */
+static gpointer writer_thread_main(gpointer data)
+{
+    ChatApp *app = data;
+    for (;;) {
+        uint64_t wakes;
+        if (read(app->wr_wake, &wakes, sizeof(wakes)) < 0 && errno != EINTR) return NULL;
+
+        WriteChunk *list;
+        do {
+            list = g_atomic_pointer_get(&app->wr_queue);
+        } while (list && !g_atomic_pointer_compare_and_exchange(&app->wr_queue, list, NULL));
+
+        WriteChunk *fifo = NULL;
+        while (list) {
+            WriteChunk *next = list->next;
+            list->next = fifo;
+            fifo = list;
+            list = next;
+        }
+        while (fifo) {
+            WriteChunk *c = fifo;
+            fifo = c->next;
+            if (c->kind == WCHUNK_QUIT) {
+                g_free(c);
+                return NULL;
+            }
+            writer_handle(app, c);
+        }
+    }
+}
+
+/* UI → 쓰기 스레드 (생산자는 UI 하나, 소비자는 스택을 통째로 가져가므로 CAS 만으로 충분) */
+static void writer_push(ChatApp *app, RecvFile *f, int kind, WriteChunk *c)
+{
+    if (!c) c = g_new0(WriteChunk, 1);
+    c->file = f;
+    c->kind = kind;
+    if (c->data) g_atomic_int_add(&app->wr_inflight, (gint)c->len);
+
+    WriteChunk *head;
+    do {
+        head = g_atomic_pointer_get(&app->wr_queue);
+        c->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange(&app->wr_queue, head, c));
+
+    uint64_t one = 1;
+    if (write(app->wr_wake, &one, sizeof(one)) < 0) perror("eventfd write");
+}
+
+/* 쓰기 스레드가 남은 작업을 다 쓸 때까지 기다렸다가 종료 (프로그램 종료 시) */
+static void writer_stop(ChatApp *app)
+{
+    if (!app->writer_thread) return;
+    writer_push(app, NULL, WCHUNK_QUIT, NULL);
+    g_thread_join(app->writer_thread);
+    app->writer_thread = NULL;
+    close(app->wr_wake);
+}
+
+/* 수신 파일 시작: 열기 / 미리 할당은 쓰기 스레드가 함 */
+static void recv_file_open(ChatApp *app, const char *path, long size, const char *hash)
+{
+    if (!app->writer_thread) {
+        app->wr_wake = eventfd(0, EFD_CLOEXEC);
+        if (app->wr_wake < 0) {
+            // 쓰기 스레드 없이는 저장할 수 없음: 데이터는 받아서 버리되 조용히 잃지 않도록 알림
+            char msg[512];
+            int err = errno;
+            perror("eventfd");
+            snprintf(msg, sizeof(msg), "** 파일 저장 실패: %s (쓰기 스레드를 시작할 수 없음: %s) **", path, strerror(err));
+            append_chat_text(app, msg);
+            return;
+        }
+        app->writer_thread = g_thread_new("writer", writer_thread_main, app);
+    }
+    RecvFile *f = g_new0(RecvFile, 1);
+    f->app = app;
+    f->fd = -1;
+    f->size = size;
+    f->direct = app->wr_direct;
+    snprintf(f->path, sizeof(f->path), "%s", path);
+    snprintf(f->hash, sizeof(f->hash), "%s", hash);
+    app->recv_file = f;
+    writer_push(app, f, WCHUNK_OPEN, NULL);
+}
+
+/* 수신 파일 끝: 다 받았으면 남은 버퍼와 닫기를, 끊겼으면 버리기를 넘김 */
+static void recv_file_close(ChatApp *app, gboolean complete)
+{
+    if (!app->recv_file) return;
+    if (app->recv_chunk) {
+        if (complete) {
+            writer_push(app, app->recv_file, WCHUNK_DATA, app->recv_chunk);
+        } else {
+            free(app->recv_chunk->data);
+            g_free(app->recv_chunk);
+        }
+        app->recv_chunk = NULL;
+    }
+    writer_push(app, app->recv_file, complete ? WCHUNK_CLOSE : WCHUNK_ABORT, NULL);
+    app->recv_file = NULL;
+}
+
+static void clear_pending_upload(ChatApp *app)
+{
+    g_free(app->upload_path);
+    app->upload_path = NULL;
+    app->upload_pending = FALSE;
+    if (app->upload_timeout_id > 0) {
+        g_source_remove(app->upload_timeout_id);
+        app->upload_timeout_id = 0;
+    }
+}
+
+static void disconnect_from_server(ChatApp *app);
+
+/* SEND/SKIP 이 안 옴: 나중에 SEND 가 오면 서버는 뒤따르는 바이트를 파일로 읽으므로
+   미뤄 둔 명령을 보낼 수 없음. 끊고 다시 접속하게 함 */
+static gboolean upload_timeout_cb(gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+    app->upload_timeout_id = 0;
+    append_chat_text(app, "** 서버가 파일 전송에 응답하지 않습니다 **");
+    disconnect_from_server(app);
+    return G_SOURCE_REMOVE;
+}
+
+/* 밀린 데이터 전송 (G_IO_OUT). 다 보내면 감시 해제 */
+static gboolean socket_out_cb(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+    while (app->send_queue->len > 0) {
+        ssize_t n = send(app->sockfd, app->send_queue->str, app->send_queue->len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return TRUE;
+            app->out_watch_id = 0;
+            append_chat_text(app, "** 전송 실패 **");
+            disconnect_from_server(app);
+            return FALSE;
+        }
+        g_string_erase(app->send_queue, 0, n);
+    }
+    app->out_watch_id = 0;
+    return FALSE;
+}
+
+/* 서버로 명령 전송: 소켓이 받는 만큼 바로 보내고 나머지는 send_queue 에 두었다가 쓸 수 있을 때 보냄.
+   업로드 중이거나 서버의 SEND/SKIP 응답을 기다리는 중이면 파일 데이터 뒤로 미룸 */
+static gboolean chat_send(ChatApp *app, const char *data, size_t len)
+{
+    if (app->upload_thread || app->upload_pending) {
+        g_string_append_len(app->send_backlog, data, len);
+        return TRUE;
+    }
+    if (app->sockfd < 0 || app->connecting) return FALSE;
+
+    if (app->send_queue->len == 0) {
+        ssize_t n = send(app->sockfd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return FALSE;
+            n = 0;
+        }
+        data += n;
+        len -= n;
+        if (len == 0) return TRUE;
+    }
+    g_string_append_len(app->send_queue, data, len);
+    if (!app->out_watch_id) {
+        app->out_watch_id = g_io_add_watch(app->sock_channel, G_IO_OUT, socket_out_cb, app);
+    }
+    return TRUE;
+}
+
+/* 업로드가 끝났거나 필요 없어졌을 때 미뤄 둔 명령 전송 */
+static void send_backlog_flush(ChatApp *app)
+{
+    if (app->send_backlog->len == 0) return;
+    chat_send(app, app->send_backlog->str, app->send_backlog->len);
+    g_string_truncate(app->send_backlog, 0);
+}
+
+/* 작업 스레드 → UI 진행 알림 */
+typedef struct {
+    ChatApp *app;
+    guint gen;
+    long sent;
+    gboolean done;
+    gboolean failed;
+} UploadNote;
+
+static gboolean upload_note_idle(gpointer data);
+
+static void upload_post(ChatApp *app, guint gen, long sent, gboolean done, gboolean failed)
+{
+    UploadNote *note = g_new(UploadNote, 1);
+    note->app = app;
+    note->gen = gen;
+    note->sent = sent;
+    note->done = done;
+    note->failed = failed;
+    g_idle_add(upload_note_idle, note);
+}
+
+/* 업로드 작업 스레드: 파일에서 소켓으로 바로 (sendfile). 소켓은 논블로킹이라 가득 차면
+   poll 로 기다리며, 그 사이 중단 요청을 확인함. 시작 전에 정해진 필드만 읽음 */
+static gpointer upload_thread_main(gpointer data)
+{
+    ChatApp *app = data;
+    guint gen = app->upload_gen;
+    long size = app->upload_size;
+    off_t off = 0;
+    gboolean failed = FALSE;
+    gint64 last_note = 0;
+
+    int fd = open(app->upload_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) failed = TRUE;
+
+    while (!failed && off < size && !g_atomic_int_get(&app->upload_cancel)) {
+        ssize_t n = sendfile(app->sockfd, fd, &off, size - off);
+        if (n > 0) {
+            gint64 now = g_get_monotonic_time();
+            if (now - last_note >= UPLOAD_NOTE_US) {
+                upload_post(app, gen, off, FALSE, FALSE);
+                last_note = now;
+            }
+        } else if (n == 0) {
+            failed = TRUE;   // 해시를 계산한 뒤 파일이 줄어듦
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            struct pollfd pfd = { app->sockfd, POLLOUT, 0 };
+            poll(&pfd, 1, 100);
+        } else if (errno != EINTR) {
+            failed = TRUE;
+        }
+    }
+    if (fd >= 0) close(fd);
+    upload_post(app, gen, off, TRUE, failed || off < size);
+    return NULL;
+}
+
+/* 작업 스레드를 멈추고 기다림 (연결 종료 시). 이미 보낸 알림은 세대가 달라 무시됨 */
+static void upload_stop(ChatApp *app)
+{
+    if (!app->upload_thread) return;
+    g_atomic_int_set(&app->upload_cancel, 1);
+    g_thread_join(app->upload_thread);
+    app->upload_thread = NULL;
+    app->upload_gen++;
+    g_string_truncate(app->send_backlog, 0);
+    gtk_widget_hide(app->progress_upload);
+    gtk_widget_set_sensitive(app->btn_file, TRUE);
+}
+
+/* UI 스레드: 진행률 / 속도 / 남은 시간 표시, 끝나면 스레드 정리 후 미뤄 둔 명령 전송 */
+static gboolean upload_note_idle(gpointer data)
+{
+    UploadNote *note = data;
+    ChatApp *app = note->app;
+    if (note->gen != app->upload_gen || !app->upload_thread) {
+        g_free(note);
+        return G_SOURCE_REMOVE;
+    }
+
+    double secs = (g_get_monotonic_time() - app->upload_started) / (double)G_USEC_PER_SEC;
+    double rate = secs > 0 ? note->sent / secs : 0;
+    char text[320];
+    if (!note->done) {
+        char eta[32] = "?";
+        if (rate > 0) snprintf(eta, sizeof(eta), "%lds", (long)((app->upload_size - note->sent) / rate));
+        snprintf(text, sizeof(text), "%s  %.1f / %.1f MB  %.1f MB/s  남은 시간 %s",
+                 app->upload_name, note->sent / 1048576.0, app->upload_size / 1048576.0,
+                 rate / 1048576.0, eta);
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(app->progress_upload),
+                                      app->upload_size > 0 ? (double)note->sent / app->upload_size : 1.0);
+        gtk_progress_bar_set_text(GTK_PROGRESS_BAR(app->progress_upload), text);
+        g_free(note);
+        return G_SOURCE_REMOVE;
+    }
+
+    g_thread_join(app->upload_thread);
+    app->upload_thread = NULL;
+    gtk_widget_hide(app->progress_upload);
+    gtk_widget_set_sensitive(app->btn_file, TRUE);
+
+    if (note->failed) {
+        // 서버는 남은 바이트를 계속 파일로 기다리므로 연결을 끊는 것 외에 되돌릴 방법이 없음
+        append_chat_text(app, "** 데이터 전송 중 오류 **");
+        g_free(note);
+        clear_pending_upload(app);
+        disconnect_from_server(app);
+        return G_SOURCE_REMOVE;
+    }
+    snprintf(text, sizeof(text), ">> [나] 파일 전송 완료: %s (%ld bytes, %.1f MB/s)",
+             app->upload_name, app->upload_size, rate / 1048576.0);
+    append_chat_text(app, text);
+    clear_pending_upload(app);
+    send_backlog_flush(app);
+    g_free(note);
+    return G_SOURCE_REMOVE;
+}
+
+/* 서버가 SEND로 허가한 업로드 데이터 전송: 작업 스레드를 띄우고 바로 돌아옴 */
+static void send_pending_upload(ChatApp *app)
+{
+    if (app->upload_timeout_id > 0) {       // 응답은 왔음. 전송 시간에는 제한 없음
+        g_source_remove(app->upload_timeout_id);
+        app->upload_timeout_id = 0;
+    }
+    app->upload_gen++;
+    app->upload_started = g_get_monotonic_time();
+    g_atomic_int_set(&app->upload_cancel, 0);
+    app->upload_thread = g_thread_new("upload", upload_thread_main, app);
+
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(app->progress_upload), 0.0);
+    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(app->progress_upload), app->upload_name);
+    gtk_widget_show(app->progress_upload);
+    gtk_widget_set_sensitive(app->btn_file, FALSE);
 }
 
 /* 연결 종료 및 리소스 정리 */
 static void disconnect_from_server(ChatApp *app)
 {
+    upload_stop(app);   // 소켓을 닫기 전에 작업 스레드부터
     if (app->io_watch_id > 0) {
         g_source_remove(app->io_watch_id);
         app->io_watch_id = 0;
     }
+    if (app->out_watch_id > 0) {
+        g_source_remove(app->out_watch_id);
+        app->out_watch_id = 0;
+    }
+    if (app->connect_watch_id > 0) {
+        g_source_remove(app->connect_watch_id);
+        app->connect_watch_id = 0;
+    }
+    if (app->connect_timeout_id > 0) {
+        g_source_remove(app->connect_timeout_id);
+        app->connect_timeout_id = 0;
+    }
     if (app->sock_channel) {
         g_io_channel_shutdown(app->sock_channel, FALSE, NULL);
         g_io_channel_unref(app->sock_channel);
@@ -74,13 +898,18 @@ static void disconnect_from_server(ChatApp *app)
         close(app->sockfd);
         app->sockfd = -1;
     }
-    if (app->recv_fp) {
-        fclose(app->recv_fp);
-        app->recv_fp = NULL;
-    }
+    recv_file_close(app, FALSE);
     app->receiving_file = FALSE;
+    g_atomic_int_set(&app->rx_paused, 0);
+    app->rx_head = app->rx_tail = 0;
+    g_queue_clear_full(&app->ack_texts, g_free);
+    g_string_truncate(app->send_queue, 0);
+    g_string_truncate(app->send_backlog, 0);
+    clear_pending_upload(app);
 
     /* UI 상태 변경 */
+    app->connecting = FALSE;
+    gtk_button_set_label(GTK_BUTTON(app->btn_connect), "Connect");
     gtk_widget_set_sensitive(app->btn_connect, TRUE);
     gtk_widget_set_sensitive(app->btn_send, FALSE);
     gtk_widget_set_sensitive(app->btn_file, FALSE);
@@ -88,83 +917,479 @@ static void disconnect_from_server(ChatApp *app)
     append_chat_text(app, "** Disconnected **");
 }
 
-/* 소켓 데이터 수신 콜백 */
-static gboolean socket_io_cb(GIOChannel *source, GIOCondition condition, gpointer data)
+/* 파일 데이터를 다 받음: 완료 알림은 쓰기 스레드가 fsync 하고 이름을 바꾼 뒤에 (recv_file_done_idle) */
+static void finish_file_receive(ChatApp *app)
 {
-    ChatApp *app = (ChatApp *)data;
+    app->receiving_file = FALSE;
+    recv_file_close(app, TRUE);
+}
 
-    if (condition & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
-        disconnect_from_server(app);
-        return FALSE; // 이벤트 소스 제거
+/* 중계 데이터를 n 바이트 기록함: 허락해 둔 양이 절반 아래로 내려가면 서버에 다시 채워 줌 */
+static void relay_consumed(ChatApp *app, long n)
+{
+    app->recv_credit -= n;
+    if (app->recv_credit < 0) app->recv_credit = 0;
+    if (app->recv_file_remaining > 0 && app->recv_credit <= RELAY_CREDIT / 2) {
+        char req[64];
+        snprintf(req, sizeof(req), "/credit %ld\n", (long)RELAY_CREDIT - app->recv_credit);
+        chat_send(app, req, strlen(req));
+        app->recv_credit = RELAY_CREDIT;
     }
+}
 
-    char buf[MAXBUF];
-    ssize_t n = recv(app->sockfd, buf, sizeof(buf) - 1, 0); // -1 for null safety
+/* 파일 데이터 n 바이트: 정렬된 버퍼에 모아 WRITE_CHUNK 가 차면 쓰기 스레드로 넘김 */
+static void recv_file_data(ChatApp *app, const char *data, long n)
+{
+    app->recv_file_remaining -= n;
+    if (app->recv_relay) relay_consumed(app, n);
 
-    if (n <= 0) {
-        disconnect_from_server(app);
-        return FALSE;
+    while (app->recv_file && n > 0) {
+        if (!app->recv_chunk) {
+            WriteChunk *c = g_new0(WriteChunk, 1);
+            if (posix_memalign((void **)&c->data, WRITE_ALIGN, WRITE_CHUNK) != 0) {
+                g_free(c);
+                append_chat_text(app, "** 파일 버퍼 할당 실패 **");
+                recv_file_close(app, FALSE);
+                break;
+            }
+            app->recv_chunk = c;
+        }
+        WriteChunk *c = app->recv_chunk;
+        size_t take = MIN((size_t)n, WRITE_CHUNK - c->len);
+        memcpy(c->data + c->len, data, take);
+        c->len += take;
+        data += take;
+        n -= take;
+        if (c->len == WRITE_CHUNK) {
+            writer_push(app, app->recv_file, WCHUNK_DATA, c);
+            app->recv_chunk = NULL;
+        }
     }
+    if (app->recv_file_remaining <= 0) finish_file_receive(app);
+}
 
-    /* 1. 파일 데이터 수신 중일 경우 */
-    if (app->receiving_file && app->recv_fp != NULL) {
-        long to_write = (app->recv_file_remaining < n) ? app->recv_file_remaining : n;
-        fwrite(buf, 1, to_write, app->recv_fp);
-        app->recv_file_remaining -= to_write;
+/* 기록 끝에 한 줄 추가 (O_APPEND 라 한 번의 write 가 한 줄) */
+static void store_append(ChatTab *tab, unsigned long long seq, const char *text)
+{
+    if (tab->store_fd < 0) return;
+    char line[MAXBUF + 32];
+    int n = snprintf(line, sizeof(line), "%llu %s\n", seq, text);
+    if (n >= (int)sizeof(line)) {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+    if (write(tab->store_fd, line, n) < 0) perror("store write");
+}
 
-        if (app->recv_file_remaining <= 0) {
-            fclose(app->recv_fp);
-            app->recv_fp = NULL;
-            app->receiving_file = FALSE;
-            
-            char msg[512];
-            snprintf(msg, sizeof(msg), "** 파일 수신 완료: %s **", app->recv_filename);
-            append_chat_text(app, msg);
-            
-            // 파일 쓰고 남은 데이터가 있다면 텍스트로 처리해야 함 (TCP Coalescing 대비)
-            // 여기서는 단순화를 위해 남은 데이터 처리는 생략하나, 실제론 buffer handling이 필요함.
+/* 서버 / 방의 기록을 탭에 열고 마지막 STORE_SCREEN_LINES 줄을 그림. 파일 끝에서 거꾸로 그만큼만
+   훑으므로 기록 길이와 상관없이 일정한 시간. 마지막 순번을 tab->last_seq 로 삼아 그 뒤만 받음 */
+static void store_open(ChatApp *app, ChatTab *tab, const char *server, const char *room)
+{
+    if (tab->store_fd >= 0) close(tab->store_fd);
+    tab->store_fd = -1;
+    tab->last_seq = 0;
+
+    char name[160], path[200];
+    snprintf(name, sizeof(name), "%s_%s", server, room);
+    g_strdelimit(name, "/", '_');
+    mkdir(STORE_DIR, 0755);
+    snprintf(path, sizeof(path), STORE_DIR "/%s.log", name);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("store open");
+        return;
+    }
+    tab->store_fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) return;
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("store mmap");
+        return;
+    }
+
+    // 쓰다 끊긴 마지막 조각은 잘라냄 (다음 기록이 거기에 이어 붙지 않도록)
+    const char *end = map + st.st_size;
+    while (end > map && end[-1] != '\n') end--;
+    if (end < map + st.st_size && ftruncate(fd, end - map) < 0) perror("store truncate");
+
+    const char *start = end;
+    int lines = 0;
+    while (start > map && lines <= STORE_SCREEN_LINES) {
+        start--;
+        if (start == map || start[-1] == '\n') lines++;
+    }
+    if (lines > STORE_SCREEN_LINES) start = memchr(start, '\n', end - start) + 1;
+
+    if (start < end) tab_append(app, tab, "** 저장된 기록 **");
+    while (start < end) {
+        const char *nl = memchr(start, '\n', end - start);
+        char *rest;
+        unsigned long long seq = strtoull(start, &rest, 10);
+        if (rest > start && rest < nl && *rest == ' ') {
+            char *text = g_strndup(rest + 1, nl - rest - 1);
+            tab_append(app, tab, text);
+            g_free(text);
+            if (seq > tab->last_seq) tab->last_seq = seq;
         }
-        return TRUE;
+        start = nl + 1;
     }
+    munmap(map, st.st_size);
+}
 
-    /* 2. 일반 텍스트 및 헤더 처리 */
-    buf[n] = '\0';
-    char *p = buf;
-    
-    // 개행 문자로 구분하여 여러 줄의 메시지 처리
-    while (*p) {
-        char *nl = strchr(p, '\n');
-        if (nl) *nl = '\0';
+/* 탭 초기화 (노트북에 붙이는 것은 부르는 쪽) */
+static void tab_init(ChatTab *tab, const char *room)
+{
+    GtkTextIter end_iter;
+    snprintf(tab->room, sizeof(tab->room), "%s", room);
+    tab->label = gtk_label_new(NULL);
+    tab->buffer = gtk_text_buffer_new(NULL);
+    gtk_text_buffer_get_end_iter(tab->buffer, &end_iter);
+    tab->end = gtk_text_buffer_create_mark(tab->buffer, "chat-end", &end_iter, FALSE);
+    tab->rows = gtk_list_store_new(1, G_TYPE_STRING);
+    tab->row_count = 0;
+    tab->pending = g_string_new(NULL);
+    tab->unread = 0;
+    tab->store_fd = -1;
+    tab->last_seq = 0;
+    tab_update_label(tab);
+}
 
-        if (strncmp(p, "FILE ", 5) == 0) {
-            char sender[64], fname[256];
-            long size = 0;
-            // sscanf 안전하게 사용 (buffer size 제한)
-            if (sscanf(p, "FILE %63s %255s %ld", sender, fname, &size) == 3 && size > 0) {
-                char msg[512];
-                snprintf(msg, sizeof(msg), "** 파일 수신 시작: %s (%ld bytes) from %s **", fname, size, sender);
-                append_chat_text(app, msg);
+/* 지켜보는 방의 탭 (0번은 입장한 방이라 찾지 않음, 없으면 NULL) */
+static ChatTab *tab_find(ChatApp *app, const char *room)
+{
+    for (int i = 1; i < app->ntabs; i++) {
+        if (strcmp(app->tabs[i].room, room) == 0) return &app->tabs[i];
+    }
+    return NULL;
+}
+
+/* 지켜볼 방의 탭을 만들고 저장된 기록을 그림. 페이지는 탭 머리만 쓰므로 빈 상자 */
+static ChatTab *tab_open(ChatApp *app, const char *room)
+{
+    ChatTab *tab = tab_find(app, room);
+    if (tab || app->ntabs == MAX_TABS) return tab;
+    tab = &app->tabs[app->ntabs++];
+    tab_init(tab, room);
+    GtkWidget *page = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_widget_show(page);
+    gtk_notebook_append_page(GTK_NOTEBOOK(app->notebook), page, tab->label);
+    if (app->session_server[0]) store_open(app, tab, app->session_server, room);
+    return tab;
+}
+
+/* 탭 닫기: 먼저 0번 탭으로 옮긴 뒤 (지우는 페이지가 보이는 페이지가 아니게) 뒤 탭들을 당김 */
+static void tab_close(ChatApp *app, ChatTab *tab)
+{
+    int idx = tab - app->tabs;
+    if (idx <= 0 || idx >= app->ntabs) return;
+    gtk_notebook_set_current_page(GTK_NOTEBOOK(app->notebook), 0);
+
+    if (tab->store_fd >= 0) close(tab->store_fd);
+    g_object_unref(tab->buffer);
+    g_object_unref(tab->rows);
+    g_string_free(tab->pending, TRUE);
+    memmove(&app->tabs[idx], &app->tabs[idx + 1], (app->ntabs - idx - 1) * sizeof(ChatTab));
+    app->ntabs--;
+    gtk_notebook_remove_page(GTK_NOTEBOOK(app->notebook), idx);
+}
+
+/* 탭 전환: 보기에 그 탭의 버퍼 / 목록을 붙이고, 모아 둔 줄을 한 번에 넣음 */
+static void on_tab_switched(GtkNotebook *notebook, GtkWidget *page, guint page_num, gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+    if ((int)page_num >= app->ntabs) return;
+    ChatTab *tab = &app->tabs[page_num];
+    app->cur_tab = page_num;
+    gtk_text_view_set_buffer(GTK_TEXT_VIEW(app->textview_chat), tab->buffer);
+    gtk_tree_view_set_model(GTK_TREE_VIEW(app->list_chat), GTK_TREE_MODEL(tab->rows));
+    tab->unread = 0;
+    tab_update_label(tab);
+    chat_flush(app, tab);
+    chat_scroll_end(app, tab);
+}
+
+/* 서버가 보낸 한 줄 (개행 제외) 처리 */
+static void handle_line(ChatApp *app, char *p)
+{
+    app->st_msgs++;
+
+    // 방 메시지 순번 접두어 "@<순번> " 를 떼어내고 마지막 본 순번 갱신
+    if (p[0] == '@') {
+        char *rest;
+        unsigned long long seq = strtoull(p + 1, &rest, 10);
+        if (rest != p + 1 && *rest == ' ') {
+            p = rest + 1;
+            if (seq > app->last_seq) {
+                app->last_seq = seq;
+                store_append(&app->tabs[0], seq, p);
+            }
+        }
+    }
 
-                snprintf(app->recv_filename, sizeof(app->recv_filename), "recv_%s", fname);
-                app->recv_fp = fopen(app->recv_filename, "wb");
-                
-                if (app->recv_fp) {
-                    app->receiving_file = TRUE;
-                    app->recv_file_remaining = size;
-                } else {
-                    append_chat_text(app, "** 파일 생성 실패 **");
+    if (strncmp(p, "ROOM ", 5) == 0) {
+        /* 지켜보는 방의 메시지: ROOM <방> @<순번> <메시지> (탭을 닫은 뒤 늦게 온 것은 버림) */
+        char room[64], *rest;
+        int off = 0;
+        if (sscanf(p, "ROOM %63s @%n", room, &off) == 1 && off > 0) {
+            ChatTab *tab = tab_find(app, room);
+            unsigned long long seq = strtoull(p + off, &rest, 10);
+            if (tab && rest != p + off && *rest == ' ') {
+                if (seq > tab->last_seq) {
+                    tab->last_seq = seq;
+                    store_append(tab, seq, rest + 1);
                 }
+                tab_append(app, tab, rest + 1);
+            }
+        }
+    } else if (strncmp(p, "TOKEN ", 6) == 0) {
+        /* 재접속 토큰: TOKEN <토큰> <현재 방 순번> */
+        char token[32];
+        unsigned long long seq = 0;
+        if (sscanf(p, "TOKEN %31s %llu", token, &seq) == 2) {
+            snprintf(app->session_token, sizeof(app->session_token), "%s", token);
+            if (app->last_seq == 0) app->last_seq = seq; // 처음 입장: 지금부터 받음
+        }
+    } else if (strncmp(p, "ACK ", 4) == 0) {
+        /* 내가 보낸 메시지의 순번 */
+        unsigned long long seq = strtoull(p + 4, NULL, 10);
+        char *text = g_queue_pop_head(&app->ack_texts);
+        if (seq > app->last_seq) {
+            app->last_seq = seq;
+            if (text) store_append(&app->tabs[0], seq, text);
+        }
+        g_free(text);
+    } else if (strncmp(p, "ERR Message not sent", 20) == 0) {
+        /* ACK 대신 온 거절: 보낸 순서상 가장 오래 기다린 내 메시지의 것 (기록에 남기지 않음) */
+        g_free(g_queue_pop_head(&app->ack_texts));
+        append_chat_text(app, p);
+    } else if (strncmp(p, "TRUNCATED ", 10) == 0) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "** 이전 메시지 %s개는 생략되었습니다 **", p + 10);
+        append_chat_text(app, msg);
+    } else if (strcmp(p, "ERR Unknown session") == 0) {
+        /* 서버가 재시작되어 토큰이 없으면 마지막 순번으로 다시 입장 */
+        char joinmsg[MAXBUF];
+        app->session_token[0] = '\0';
+        snprintf(joinmsg, sizeof(joinmsg), "/join %s %s %llu\n/credit 0\n/fileref\n/who\n",
+                 app->session_nick, app->session_room, app->last_seq);
+        app->recv_credit = 0;
+        chat_send(app, joinmsg, strlen(joinmsg));
+    } else if (strncmp(p, "FILE ", 5) == 0) {
+        char sender[64], fname[256], hash[HASHLEN + 2] = "";
+        long size = 0;
+        // sscanf 안전하게 사용 (buffer size 제한), 해시는 서버 버전에 따라 없을 수 있음
+        if (sscanf(p, "FILE %63s %255s %ld %65s", sender, fname, &size, hash) >= 3 && size > 0) {
+            char msg[512];
+            snprintf(msg, sizeof(msg), "** 파일 수신 시작: %s (%ld bytes) from %s **", fname, size, sender);
+            append_chat_text(app, msg);
+
+            snprintf(app->recv_filename, sizeof(app->recv_filename), "recv_%s", fname);
+            snprintf(app->recv_hash, sizeof(app->recv_hash), "%s", strlen(hash) == HASHLEN ? hash : "");
+            recv_file_open(app, app->recv_filename, size, app->recv_hash);
+
+            // 파일을 못 만들어도 데이터는 따라오므로 그만큼은 받아서 버림
+            app->receiving_file = TRUE;
+            app->recv_file_remaining = size;
+
+            // 해시 없는 헤더는 실시간 중계: 받을 수 있는 만큼 먼저 허락
+            app->recv_relay = (hash[0] == '\0');
+            if (app->recv_relay) relay_consumed(app, 0);
+        } else {
+            append_chat_text(app, p); // 파싱 실패 시 그냥 텍스트로 출력
+        }
+    } else if (strncmp(p, "FILEREF ", 8) == 0) {
+        /* 서버 스풀에 저장된 파일 알림: 로컬 캐시에 있으면 다운로드 생략 */
+        char sender[64], fname[256], hash[HASHLEN + 2];
+        long size = 0;
+        if (sscanf(p, "FILEREF %63s %255s %ld %65s", sender, fname, &size, hash) == 4 && strlen(hash) == HASHLEN) {
+            char dest[300], msg[512];
+            snprintf(dest, sizeof(dest), "recv_%s", fname);
+            if (cache_restore(hash, size, dest)) {
+                snprintf(msg, sizeof(msg), "** 파일 수신 완료(캐시): %s (%ld bytes) from %s **", fname, size, sender);
+                append_chat_text(app, msg);
+                thumb_request(app, dest, hash);
             } else {
-                append_chat_text(app, p); // 파싱 실패 시 그냥 텍스트로 출력
+                char req[MAXBUF];
+                snprintf(req, sizeof(req), "/fetch %s %s\n", hash, fname);
+                chat_send(app, req, strlen(req));
             }
         } else {
-            if (strlen(p) > 0) append_chat_text(app, p);
+            append_chat_text(app, p);
         }
+    } else if (strncmp(p, "ERR File not sent", 17) == 0) {
+        /* /file 거절: 데이터를 보내지 않고 미뤄 둔 명령을 보냄 */
+        append_chat_text(app, p);
+        if (app->upload_pending) {
+            clear_pending_upload(app);
+            send_backlog_flush(app);
+        }
+    } else if (strncmp(p, "SEND ", 5) == 0 || strncmp(p, "SKIP ", 5) == 0) {
+        /* 업로드 해시 알림에 대한 서버 응답 */
+        if (app->upload_pending && strcmp(p + 5, app->upload_hash) == 0) {
+            if (p[1] == 'E') {
+                send_pending_upload(app);
+            } else {
+                char msg[512];
+                snprintf(msg, sizeof(msg), ">> [나] 파일 전송 완료(서버에 이미 있음): %s (%ld bytes)",
+                         app->upload_name, app->upload_size);
+                append_chat_text(app, msg);
+                clear_pending_upload(app);
+                send_backlog_flush(app);
+            }
+        }
+    } else if (strncmp(p, "DM ", 3) == 0) {
+        /* 귓속말: DM <보낸사람> <메시지> */
+        char sender[64], msg[MAXBUF];
+        int off = 0;
+        if (sscanf(p, "DM %63s %n", sender, &off) == 1 && off > 0) {
+            snprintf(msg, sizeof(msg), "[%s → 나] %s", sender, p + off);
+            append_chat_text(app, msg);
+        } else {
+            append_chat_text(app, p);
+        }
+    } else if (strncmp(p, "PRESENCE ", 9) == 0) {
+        /* 방 인원 변화: PRESENCE +|- <닉네임> */
+        char sign, nick[64], msg[128];
+        if (sscanf(p, "PRESENCE %c %63s", &sign, nick) == 2) {
+            snprintf(msg, sizeof(msg), "** %s 님이 %s **", nick, sign == '+' ? "입장했습니다" : "퇴장했습니다");
+            append_chat_text(app, msg);
+        }
+    } else if (strncmp(p, "WHO ", 4) == 0) {
+        /* 접속자 명단: WHO <방> <닉네임>... */
+        char room[64], msg[MAXBUF + 64];
+        int off = 0;
+        if (sscanf(p, "WHO %63s%n", room, &off) == 1) {
+            snprintf(msg, sizeof(msg), "** 접속자 (%s):%s **", room, p + off);
+            append_chat_text(app, msg);
+        }
+    } else if (strncmp(p, "SEARCH ", 7) == 0) {
+        /* 검색 결과 머리: SEARCH <건수> <검색어> */
+        int count, off = 0;
+        char msg[MAXBUF + 64];
+        if (sscanf(p, "SEARCH %d %n", &count, &off) == 1) {
+            snprintf(msg, sizeof(msg), "** '%s' 검색 결과 %d건 **", p + off, count);
+            append_chat_text(app, msg);
+        }
+    } else if (strncmp(p, "HIT ", 4) == 0) {
+        /* 검색 결과 한 줄: HIT <순번> <메시지> */
+        unsigned long long seq;
+        int off = 0;
+        char msg[MAXBUF + 64];
+        if (sscanf(p, "HIT %llu %n", &seq, &off) == 1) {
+            snprintf(msg, sizeof(msg), "  #%llu %s", seq, p + off);
+            append_chat_text(app, msg);
+        }
+    } else {
+        if (strlen(p) > 0) append_chat_text(app, p);
+    }
+}
 
-        if (!nl) break;
-        p = nl + 1;
+/* 수신 버퍼 해석: 줄 모드에서는 개행까지 한 줄씩, 파일 모드에서는 남은 크기만큼 바이트로.
+   FILE 헤더 줄이 파일 모드로, 데이터를 다 받으면 다시 줄 모드로 바뀜 */
+static void rx_parse(ChatApp *app)
+{
+    while (app->rx_head < app->rx_tail) {
+        char *start = app->rx_buf + app->rx_head;
+        size_t avail = app->rx_tail - app->rx_head;
+
+        if (app->receiving_file) {
+            long take = (app->recv_file_remaining < (long)avail) ? app->recv_file_remaining : (long)avail;
+            app->rx_head += take;
+            recv_file_data(app, start, take);
+            continue;
+        }
+
+        char *nl = memchr(start, '\n', avail);
+        if (!nl) break;             // 나머지는 다음 recv 와 이어짐
+        *nl = '\0';
+        app->rx_head += nl - start + 1;
+        if (nl > start) handle_line(app, start);
     }
+    if (app->rx_head == app->rx_tail) app->rx_head = app->rx_tail = 0;
+}
 
+/* 읽을 자리 확보: 앞쪽 빈 곳을 당기고, 그래도 가득이면 키움. 최대 크기인데 개행이 없으면 버림 */
+static void rx_reserve(ChatApp *app)
+{
+    if (app->rx_tail < app->rx_cap) return;
+    if (app->rx_head > 0) {
+        memmove(app->rx_buf, app->rx_buf + app->rx_head, app->rx_tail - app->rx_head);
+        app->rx_tail -= app->rx_head;
+        app->rx_head = 0;
+        if (app->rx_tail < app->rx_cap) return;
+    }
+    if (app->rx_cap < RX_MAX) {
+        app->rx_cap = app->rx_cap ? app->rx_cap * 2 : RX_MIN;
+        app->rx_buf = g_realloc(app->rx_buf, app->rx_cap);
+        return;
+    }
+    append_chat_text(app, "** 너무 긴 줄을 건너뜀 **");
+    app->rx_head = app->rx_tail = 0;
+}
+
+/* 소켓 데이터 수신 콜백: EAGAIN 까지 (한 번에 RX_WAKE_BUDGET 까지) 읽으며 바로 해석.
+   읽기가 버퍼를 가득 채우면 버퍼를 키워 큰 수신을 적은 호출로 받고, 계속 적게 쓰면 줄임 */
+static gboolean socket_io_cb(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+
+    if (condition & (G_IO_ERR | G_IO_NVAL)) {
+        disconnect_from_server(app);
+        return FALSE; // 이벤트 소스 제거
+    }
+
+    size_t total = 0;
+    while (total < RX_WAKE_BUDGET) {
+        rx_reserve(app);
+        size_t want = app->rx_cap - app->rx_tail;
+        ssize_t n = recv(app->sockfd, app->rx_buf + app->rx_tail, want, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            disconnect_from_server(app);
+            return FALSE;
+        }
+        if (n == 0) {               // 서버가 닫음 (G_IO_HUP 포함): 받은 것까지 처리하고 종료
+            rx_parse(app);
+            disconnect_from_server(app);
+            return FALSE;
+        }
+        app->rx_tail += n;
+        total += n;
+        app->st_bytes += n;
+        gint64 t0 = g_get_monotonic_time();
+        rx_parse(app);
+        app->st_parse_us += g_get_monotonic_time() - t0;
+
+        if (g_atomic_int_get(&app->wr_inflight) > WRITE_QUEUE_MAX) {
+            // 디스크가 못 따라옴: 읽기를 멈춰 서버 쪽에서 막히게 하고, 쓰기 스레드가 절반까지
+            // 비우면 다시 감시 (멈춤 표시 후 다시 확인해야 재개 알림을 놓치지 않음)
+            g_atomic_int_set(&app->rx_paused, 1);
+            if (g_atomic_int_get(&app->wr_inflight) > WRITE_QUEUE_MAX / 2 ||
+                !g_atomic_int_compare_and_exchange(&app->rx_paused, 1, 0)) {
+                app->io_watch_id = 0;
+                return FALSE;
+            }
+        }
+
+        if ((size_t)n == want && app->rx_cap < RX_MAX && app->rx_head == 0 && app->rx_tail == 0) {
+            app->rx_cap *= 2;       // 한 번에 다 찼음: 다음부터 더 크게 읽음
+            app->rx_buf = g_realloc(app->rx_buf, app->rx_cap);
+        }
+    }
+
+    if (total < app->rx_cap / 4 && app->rx_cap > RX_MIN && app->rx_tail == 0) {
+        if (++app->rx_small >= RX_SHRINK_WAKES) {
+            app->rx_cap /= 2;
+            app->rx_buf = g_realloc(app->rx_buf, app->rx_cap);
+            app->rx_small = 0;
+        }
+    } else {
+        app->rx_small = 0;
+    }
     return TRUE;
 }
 
@@ -172,15 +1397,33 @@ static gboolean socket_io_cb(GIOChannel *source, GIOCondition condition, gpointe
 static void on_send_clicked(GtkWidget *widget, gpointer data)
 {
     ChatApp *app = (ChatApp *)data;
-    if (app->sockfd < 0) return;
+    if (app->sockfd < 0 || app->connecting) return;
 
     const char *text = gtk_entry_get_text(GTK_ENTRY(app->entry_msg));
     if (!text || strlen(text) == 0) return;
 
-    char buf[MAXBUF];
-    snprintf(buf, sizeof(buf), "/msg %s\n", text);
+    // '/'로 시작하면 명령어(/dm, /who 등) 그대로 전송, 아니면 보고 있는 탭의 방 메시지
+    // (지켜보는 방은 /post 로 보내고 서버가 돌려주는 ROOM 줄로 표시되므로 따로 찍지 않음)
+    gboolean is_command = (text[0] == '/');
+    ChatTab *tab = &app->tabs[app->cur_tab];
+    char buf[MAXBUF], room[64];
+    if (is_command) snprintf(buf, sizeof(buf), "%s\n", text);
+    else if (app->cur_tab > 0) snprintf(buf, sizeof(buf), "/post %s %s\n", tab->room, text);
+    else snprintf(buf, sizeof(buf), "/msg %s\n", text);
 
-    if (send(app->sockfd, buf, strlen(buf), 0) < 0) {
+    // /watch <방> 은 탭을 열고, /unwatch <방> 은 닫음 (탭이 꽉 찼으면 보내지 않음)
+    if (sscanf(text, "/watch %63s", room) == 1) {
+        ChatTab *watched = strcmp(room, app->tabs[0].room) == 0 ? &app->tabs[0] : tab_open(app, room);
+        if (!watched) {
+            append_chat_text(app, "** 탭을 더 열 수 없습니다 **");
+            return;
+        }
+        gtk_notebook_set_current_page(GTK_NOTEBOOK(app->notebook), watched - app->tabs);
+    } else if (sscanf(text, "/unwatch %63s", room) == 1 && tab_find(app, room)) {
+        tab_close(app, tab_find(app, room));
+    }
+
+    if (!chat_send(app, buf, strlen(buf))) {
         append_chat_text(app, "** 전송 실패 **");
         disconnect_from_server(app);
         return;
@@ -188,8 +1431,16 @@ static void on_send_clicked(GtkWidget *widget, gpointer data)
 
     // [추가] 내 화면에 내가 쓴 글 표시
     char my_msg[MAXBUF];
-    snprintf(my_msg, sizeof(my_msg), "[나] %s", text);
-    append_chat_text(app, my_msg);
+    char dm_target[64];
+    int dm_off = 0;
+    if (is_command && sscanf(text, "/dm %63s %n", dm_target, &dm_off) == 1 && dm_off > 0) {
+        snprintf(my_msg, sizeof(my_msg), "[나 → %s] %s", dm_target, text + dm_off);
+        append_chat_text(app, my_msg);
+    } else if (!is_command && app->cur_tab == 0) {
+        snprintf(my_msg, sizeof(my_msg), "[나] %s", text);
+        append_chat_text(app, my_msg);
+        g_queue_push_tail(&app->ack_texts, g_strdup(my_msg));
+    }
 
     gtk_entry_set_text(GTK_ENTRY(app->entry_msg), "");
 }
@@ -198,7 +1449,12 @@ static void on_send_clicked(GtkWidget *widget, gpointer data)
 static void on_file_clicked(GtkWidget *widget, gpointer data)
 {
     ChatApp *app = (ChatApp *)data;
-    if (app->sockfd < 0) return;
+    if (app->sockfd < 0 || app->upload_thread || app->upload_pending) return;   // 보내는 중에는 다음 파일을 받지 않음
+    if (app->receiving_file && app->recv_relay) {
+        // 업로드 중에는 /credit 이 파일 데이터 뒤로 밀려 받던 중계가 멈추므로 다 받은 뒤에 보냄
+        append_chat_text(app, "** 파일을 받는 중입니다. 다 받은 뒤에 보내세요 **");
+        return;
+    }
 
     GtkWidget *dialog = gtk_file_chooser_dialog_new(
         "파일 선택", GTK_WINDOW(app->window),
@@ -209,62 +1465,133 @@ static void on_file_clicked(GtkWidget *widget, gpointer data)
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         char *filepath = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
         if (filepath) {
-            FILE *fp = fopen(filepath, "rb");
-            if (!fp) {
+            char hash[HASHLEN + 1];
+            long size = 0;
+            if (!hash_file(filepath, hash, &size)) {
                 append_chat_text(app, "** 파일을 열 수 없습니다 **");
                 g_free(filepath);
                 gtk_widget_destroy(dialog);
                 return;
             }
 
-            fseek(fp, 0, SEEK_END);
-            long size = ftell(fp);
-            fseek(fp, 0, SEEK_SET);
-
+            // 내용 해시를 먼저 알리고, 서버가 SEND라고 답할 때만 실제 데이터를 보냄
+            // (명령은 공백으로 나뉘므로 이름의 공백은 '_' 로 바꿔 알림)
             char *basename = g_path_get_basename(filepath);
+            g_strdelimit(basename, " \t\r\n\v\f", '_');
             char header[MAXBUF];
-            snprintf(header, sizeof(header), "/file %s %ld\n", basename, size);
+            snprintf(header, sizeof(header), "/file %s %ld %s\n", basename, size, hash);
 
-            if (send(app->sockfd, header, strlen(header), 0) < 0) {
+            if (!chat_send(app, header, strlen(header))) {
                 append_chat_text(app, "** 헤더 전송 실패 **");
-                fclose(fp);
                 g_free(basename);
                 g_free(filepath);
                 gtk_widget_destroy(dialog);
                 return;
             }
 
-            /* 주의: 큰 파일 전송 시 UI가 멈출 수 있음. 
-               실제 상용 코드에서는 별도 스레드나 g_idle_add를 사용해야 함. */
-            char buf[MAXBUF];
-            size_t nread;
-            while ((nread = fread(buf, 1, sizeof(buf), fp)) > 0) {
-                if (send(app->sockfd, buf, nread, 0) < 0) {
-                    append_chat_text(app, "** 데이터 전송 중 오류 **");
-                    break;
-                }
-            }
-
-            // ========================================================
-            // [추가] 내 화면에 전송 완료 메시지 표시
-            // ========================================================
-            char msg[512];
-            snprintf(msg, sizeof(msg), ">> [나] 파일 전송 완료: %s (%ld bytes)", basename, size);
-            append_chat_text(app, msg);
-            // ========================================================
-
-            fclose(fp);
+            clear_pending_upload(app);
+            app->upload_pending = TRUE;
+            app->upload_path = filepath;
+            app->upload_size = size;
+            snprintf(app->upload_name, sizeof(app->upload_name), "%s", basename);
+            snprintf(app->upload_hash, sizeof(app->upload_hash), "%s", hash);
+            app->upload_timeout_id = g_timeout_add_seconds(UPLOAD_REPLY_TIMEOUT_S, upload_timeout_cb, app);
             g_free(basename);
-            g_free(filepath);
         }
     }
     gtk_widget_destroy(dialog);
 }
 
-/* 서버 연결 */
+/* 접속 시도 정리 (실패 / 시간 초과 / 취소) */
+static void connect_abort(ChatApp *app, const char *msg)
+{
+    if (app->connect_watch_id > 0) {
+        g_source_remove(app->connect_watch_id);
+        app->connect_watch_id = 0;
+    }
+    if (app->connect_timeout_id > 0) {
+        g_source_remove(app->connect_timeout_id);
+        app->connect_timeout_id = 0;
+    }
+    if (app->sock_channel) {
+        g_io_channel_unref(app->sock_channel);
+        app->sock_channel = NULL;
+    }
+    if (app->sockfd >= 0) {
+        close(app->sockfd);
+        app->sockfd = -1;
+    }
+    app->connecting = FALSE;
+    gtk_button_set_label(GTK_BUTTON(app->btn_connect), "Connect");
+    append_chat_text(app, msg);
+}
+
+/* 접속됨: 입장 명령을 보내고 수신 시작 */
+static void connect_finish(ChatApp *app)
+{
+    if (app->connect_timeout_id > 0) {
+        g_source_remove(app->connect_timeout_id);
+        app->connect_timeout_id = 0;
+    }
+    app->connecting = FALSE;
+    gtk_button_set_label(GTK_BUTTON(app->btn_connect), "Connect");
+
+    char joinmsg[MAXBUF];
+    if (app->session_token[0]) {
+        snprintf(joinmsg, sizeof(joinmsg), "/resume %s %llu\n/credit 0\n/fileref\n/who\n", app->session_token, app->last_seq);
+    } else {
+        snprintf(joinmsg, sizeof(joinmsg), "/join %s %s %llu\n/credit 0\n/fileref\n/who\n",
+                 app->session_nick, app->session_room, app->last_seq);
+    }
+    app->recv_credit = 0;
+    chat_send(app, joinmsg, strlen(joinmsg));
+
+    // 열려 있는 탭의 방은 새 연결에서도 계속 받음
+    for (int i = 1; i < app->ntabs; i++) {
+        snprintf(joinmsg, sizeof(joinmsg), "/watch %s\n", app->tabs[i].room);
+        chat_send(app, joinmsg, strlen(joinmsg));
+    }
+
+    append_chat_text(app, "** 서버 접속 완료 **");
+
+    app->io_watch_id = g_io_add_watch(app->sock_channel, 
+                                      G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+                                      socket_io_cb, app);
+
+    gtk_widget_set_sensitive(app->btn_connect, FALSE);
+    gtk_widget_set_sensitive(app->btn_send, TRUE);
+    gtk_widget_set_sensitive(app->btn_file, TRUE);
+}
+
+/* 논블로킹 connect 결과: 쓸 수 있게 되면 SO_ERROR 로 성공 여부 확인 */
+static gboolean connect_ready_cb(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    app->connect_watch_id = 0;
+    if (getsockopt(app->sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    if (err) connect_abort(app, "** 접속 실패 **");
+    else connect_finish(app);
+    return FALSE;
+}
+
+static gboolean connect_timeout_cb(gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+    app->connect_timeout_id = 0;
+    connect_abort(app, "** 접속 시간 초과 **");
+    return FALSE;
+}
+
+/* 서버 연결 (접속 중이면 취소) */
 static void on_connect_clicked(GtkWidget *widget, gpointer data)
 {
     ChatApp *app = (ChatApp *)data;
+    if (app->connecting) {
+        connect_abort(app, "** 접속 취소 **");
+        return;
+    }
 
     const char *ip   = gtk_entry_get_text(GTK_ENTRY(app->entry_ip));
     const char *nick = gtk_entry_get_text(GTK_ENTRY(app->entry_nick));
@@ -292,41 +1619,176 @@ static void on_connect_clicked(GtkWidget *widget, gpointer data)
         return;
     }
 
-    if (connect(app->sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        append_chat_text(app, "** 접속 실패 **");
-        close(app->sockfd);
-        app->sockfd = -1;
-        return;
+    // 같은 서버 / 닉네임 / 방으로 다시 접속하면 토큰으로 재개해 놓친 메시지만 받음
+    // (서버는 입력한 문자열이 아니라 해석한 주소로 비교: 표기만 다른 같은 서버도 같은 세션)
+    char server[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &serv_addr.sin_addr, server, sizeof(server));
+    gboolean same_session = strcmp(app->session_nick, nick) == 0 && strcmp(app->session_room, room) == 0 &&
+                            strcmp(app->session_server, server) == 0;
+    if (!same_session) {
+        app->session_token[0] = '\0';
+        snprintf(app->session_nick, sizeof(app->session_nick), "%s", nick);
+        snprintf(app->session_room, sizeof(app->session_room), "%s", room);
+        snprintf(app->session_server, sizeof(app->session_server), "%s", server);
+        while (app->ntabs > 1) tab_close(app, &app->tabs[app->ntabs - 1]);   // 지켜보던 방은 이전 세션의 것
+        snprintf(app->tabs[0].room, sizeof(app->tabs[0].room), "%s", room);
+        tab_update_label(&app->tabs[0]);
+        store_open(app, &app->tabs[0], server, room);   // 저장된 마지막 화면을 먼저 그리고 그 뒤 순번부터 받음
+        app->last_seq = app->tabs[0].last_seq;
     }
 
-    // Join 메시지
-    char joinmsg[MAXBUF];
-    snprintf(joinmsg, sizeof(joinmsg), "/join %s %s\n", nick, room);
-    send(app->sockfd, joinmsg, strlen(joinmsg), 0);
-
-    append_chat_text(app, "** 서버 접속 완료 **");
-
-    // GIOChannel 설정 (비동기 수신)
+    // GIOChannel 설정 (비동기 수신). 접속 전에 논블로킹으로 바꿔 connect 가 UI 를 막지 않게 함
     app->sock_channel = g_io_channel_unix_new(app->sockfd);
     g_io_channel_set_encoding(app->sock_channel, NULL, NULL); // Binary safe
     g_io_channel_set_flags(app->sock_channel, G_IO_FLAG_NONBLOCK, NULL);
 
-    app->io_watch_id = g_io_add_watch(app->sock_channel, 
-                                      G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-                                      socket_io_cb, app);
+    if (connect(app->sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == 0) {
+        connect_finish(app);
+    } else if (errno == EINPROGRESS) {
+        app->connecting = TRUE;
+        app->connect_watch_id = g_io_add_watch(app->sock_channel, G_IO_OUT | G_IO_ERR | G_IO_HUP,
+                                               connect_ready_cb, app);
+        app->connect_timeout_id = g_timeout_add_seconds(CONNECT_TIMEOUT_S, connect_timeout_cb, app);
+        gtk_button_set_label(GTK_BUTTON(app->btn_connect), "Cancel");
+        append_chat_text(app, "** 접속 중... **");
+    } else {
+        connect_abort(app, "** 접속 실패 **");
+    }
+}
 
-    gtk_widget_set_sensitive(app->btn_connect, FALSE);
-    gtk_widget_set_sensitive(app->btn_send, TRUE);
-    gtk_widget_set_sensitive(app->btn_file, TRUE);
+/* 구간 측정값 초기화 */
+static void stats_reset(ChatApp *app)
+{
+    app->st_msgs = app->st_bytes = 0;
+    app->st_parse_us = app->st_append_us = app->st_insert_us = 0;
+    app->st_stalls = 0;
+    app->st_stall_max_us = 0;
+    app->st_frames = 0;
+    app->st_frame_sum_us = app->st_frame_max_us = 0;
+}
+
+/* 1초마다: 표시를 바꾸고 CSV 에 한 줄 쓴 뒤 다음 구간 시작 */
+static gboolean hud_tick(gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+    gint64 frame_avg = app->st_frames > 0 ? app->st_frame_sum_us / app->st_frames : 0;
+
+    if (gtk_widget_get_visible(app->hud_label)) {
+        char text[512];
+        snprintf(text, sizeof(text),
+                 "recv  %ld msg/s  %.1f KB/s\n"
+                 "parse %.1f ms  append %.1f ms  insert %.1f ms\n"
+                 "stall %ld (max %.1f ms)\n"
+                 "frame %ld/s  avg %.1f ms  max %.1f ms",
+                 app->st_msgs, app->st_bytes / 1024.0,
+                 app->st_parse_us / 1000.0, app->st_append_us / 1000.0, app->st_insert_us / 1000.0,
+                 app->st_stalls, app->st_stall_max_us / 1000.0,
+                 app->st_frames, frame_avg / 1000.0, app->st_frame_max_us / 1000.0);
+        gtk_label_set_text(GTK_LABEL(app->hud_label), text);
+    }
+    if (app->trace_fp) {
+        fprintf(app->trace_fp, "%lld,%ld,%ld,%lld,%lld,%lld,%ld,%lld,%ld,%lld,%lld\n",
+                (long long)((g_get_monotonic_time() - app->stats_started) / 1000),
+                app->st_msgs, app->st_bytes,
+                (long long)app->st_parse_us, (long long)app->st_append_us, (long long)app->st_insert_us,
+                app->st_stalls, (long long)app->st_stall_max_us,
+                app->st_frames, (long long)frame_avg, (long long)app->st_frame_max_us);
+        fflush(app->trace_fp);
+    }
+    stats_reset(app);
+    return G_SOURCE_CONTINUE;
+}
+
+/* main loop 지연: 타이머가 예정보다 늦게 불린 만큼이 그동안 UI 가 멈춰 있던 시간 */
+static gboolean stall_probe(gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+    gint64 now = g_get_monotonic_time();
+    gint64 late = now - app->probe_last - HUD_PROBE_MS * 1000;
+    app->probe_last = now;
+    if (late >= HUD_STALL_US) app->st_stalls++;
+    if (late > app->st_stall_max_us) app->st_stall_max_us = late;
+    return G_SOURCE_CONTINUE;
+}
+
+/* 프레임 시간: 프레임 시계의 update 부터 after-paint 까지 (그릴 것이 있을 때만 프레임이 돎) */
+static void on_frame_update(GdkFrameClock *clock, gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+    if (app->stats_on) app->frame_start = g_get_monotonic_time();
+}
+
+static void on_frame_after_paint(GdkFrameClock *clock, gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+    if (!app->stats_on || app->frame_start == 0) return;
+    gint64 us = g_get_monotonic_time() - app->frame_start;
+    app->frame_start = 0;
+    app->st_frames++;
+    app->st_frame_sum_us += us;
+    if (us > app->st_frame_max_us) app->st_frame_max_us = us;
+}
+
+/* 측정 시작 / 끝: 표시나 기록 중 하나라도 켜져 있으면 측정 */
+static void stats_update(ChatApp *app)
+{
+    gboolean want = gtk_widget_get_visible(app->hud_label) || app->trace_fp != NULL;
+    if (want == app->stats_on) return;
+    app->stats_on = want;
+    if (want) {
+        stats_reset(app);
+        app->stats_started = app->probe_last = g_get_monotonic_time();
+        app->hud_timer_id = g_timeout_add(1000, hud_tick, app);
+        app->probe_timer_id = g_timeout_add(HUD_PROBE_MS, stall_probe, app);
+    } else {
+        g_source_remove(app->hud_timer_id);
+        g_source_remove(app->probe_timer_id);
+        app->hud_timer_id = app->probe_timer_id = 0;
+    }
+}
+
+/* 성능 표시 켜기 / 끄기 */
+static void on_stats_toggled(GtkWidget *widget, gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+    gboolean on = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
+    gtk_label_set_text(GTK_LABEL(app->hud_label), "측정 중...");
+    gtk_widget_set_visible(app->hud_label, on);
+    stats_update(app);
+}
+
+/* 텍스트 보기 ↔ 목록 보기 */
+static void on_view_toggled(GtkWidget *widget, gpointer data)
+{
+    ChatApp *app = (ChatApp *)data;
+    gboolean list = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget));
+    gtk_stack_set_visible_child_name(GTK_STACK(app->view_stack), list ? "list" : "text");
+    ChatTab *tab = &app->tabs[app->cur_tab];
+    if (list && tab->row_count > 0) {
+        GtkTreePath *path = gtk_tree_path_new_from_indices(tab->row_count - 1, -1);
+        gtk_tree_view_scroll_to_cell(GTK_TREE_VIEW(app->list_chat), path, NULL, FALSE, 0, 0);
+        gtk_tree_path_free(path);
+    }
 }
 
 /* 윈도우 닫기 이벤트 */
 static void on_destroy(GtkWidget *widget, gpointer data)
 {
     ChatApp *app = (ChatApp *)data;
+    app->closing = TRUE;
     disconnect_from_server(app);
-    free(app); // 구조체 메모리 해제
-    gtk_main_quit();
+    if (app->stats_on) {
+        g_source_remove(app->hud_timer_id);
+        g_source_remove(app->probe_timer_id);
+    }
+    if (app->trace_fp) fclose(app->trace_fp);
+    writer_stop(app);   // 받던 파일을 다 쓰고 나서 종료
+    g_thread_pool_free(app->thumb_pool, TRUE, TRUE);   // 대기 중인 디코딩은 버리고 진행 중인 것만 기다림
+    app->thumb_pool = NULL;
+    for (int i = 0; i < app->ntabs; i++) {
+        if (app->tabs[i].store_fd >= 0) close(app->tabs[i].store_fd);
+    }
+    gtk_main_quit();    // 구조체는 작업 스레드가 남긴 idle 알림이 더 돌 수 없는 main loop 종료 뒤에 해제
 }
 
 int main(int argc, char *argv[])
@@ -338,6 +1800,28 @@ int main(int argc, char *argv[])
     ChatApp *app = (ChatApp *)malloc(sizeof(ChatApp));
     memset(app, 0, sizeof(ChatApp));
     app->sockfd = -1;
+    g_queue_init(&app->ack_texts);
+    app->send_backlog = g_string_new(NULL);
+    app->send_queue = g_string_new(NULL);
+    app->rx_cap = RX_MIN;
+    app->rx_buf = g_malloc(app->rx_cap);
+    app->scrollback = SCROLLBACK_DEFAULT;
+    app->thumb_pool = g_thread_pool_new(thumb_decode, app, THUMB_WORKERS, FALSE, NULL);
+
+    // 실행 옵션: --scrollback N (텍스트 보기에 남길 줄 수, 0: 제한 없음), --odirect (받은 파일을 O_DIRECT 로 씀),
+    // --hud (성능 표시를 켠 채 시작), --trace <파일> (1초마다 측정값을 CSV 로 기록)
+    gboolean hud = FALSE;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scrollback") == 0 && i + 1 < argc) app->scrollback = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--odirect") == 0) app->wr_direct = TRUE;
+        else if (strcmp(argv[i], "--hud") == 0) hud = TRUE;
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            app->trace_fp = fopen(argv[++i], "w");
+            if (!app->trace_fp) perror("trace");
+            else fprintf(app->trace_fp, "time_ms,msgs,bytes,parse_us,append_us,insert_us,"
+                                        "stalls,stall_max_us,frames,frame_avg_us,frame_max_us\n");
+        }
+    }
 
     app->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(app->window), "GTK Chat Client Refactored");
@@ -369,16 +1853,55 @@ int main(int argc, char *argv[])
     gtk_box_pack_start(GTK_BOX(hbox_top), app->btn_connect, FALSE, FALSE, 0);
     g_signal_connect(app->btn_connect, "clicked", G_CALLBACK(on_connect_clicked), app);
 
-    // 채팅창 (스크롤 포함)
+    // 방 탭 (0번: 입장한 방). 탭을 바꾸면 아래 보기에 그 탭의 버퍼 / 목록을 붙임
+    app->notebook = gtk_notebook_new();
+    gtk_notebook_set_scrollable(GTK_NOTEBOOK(app->notebook), TRUE);
+    gtk_box_pack_start(GTK_BOX(vbox), app->notebook, FALSE, FALSE, 0);
+    tab_init(&app->tabs[0], "");
+    app->ntabs = 1;
+    gtk_notebook_append_page(GTK_NOTEBOOK(app->notebook), gtk_box_new(GTK_ORIENTATION_VERTICAL, 0), app->tabs[0].label);
+
+    // 채팅창 (스크롤 포함): 텍스트 보기와 목록 보기 중 하나만 보임. 성능 표시는 그 위 오른쪽 위에
+    GtkWidget *overlay = gtk_overlay_new();
+    gtk_box_pack_start(GTK_BOX(vbox), overlay, TRUE, TRUE, 5);
+    app->view_stack = gtk_stack_new();
+    gtk_container_add(GTK_CONTAINER(overlay), app->view_stack);
+
+    app->hud_label = gtk_label_new(NULL);
+    gtk_style_context_add_class(gtk_widget_get_style_context(app->hud_label), "osd");
+    gtk_widget_set_halign(app->hud_label, GTK_ALIGN_END);
+    gtk_widget_set_valign(app->hud_label, GTK_ALIGN_START);
+    gtk_widget_set_margin_top(app->hud_label, 4);
+    gtk_widget_set_margin_end(app->hud_label, 4);
+    gtk_widget_set_no_show_all(app->hud_label, TRUE);
+    gtk_overlay_add_overlay(GTK_OVERLAY(overlay), app->hud_label);
+
     GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
-    gtk_box_pack_start(GTK_BOX(vbox), scrolled, TRUE, TRUE, 5);
-    
-    app->textview_chat = gtk_text_view_new();
+    gtk_stack_add_named(GTK_STACK(app->view_stack), scrolled, "text");
+
+    app->textview_chat = gtk_text_view_new_with_buffer(app->tabs[0].buffer);
     gtk_text_view_set_editable(GTK_TEXT_VIEW(app->textview_chat), FALSE);
     gtk_text_view_set_cursor_visible(GTK_TEXT_VIEW(app->textview_chat), FALSE);
     gtk_text_view_set_wrap_mode(GTK_TEXT_VIEW(app->textview_chat), GTK_WRAP_WORD_CHAR);
     gtk_container_add(GTK_CONTAINER(scrolled), app->textview_chat);
 
+    app->list_chat = gtk_tree_view_new_with_model(GTK_TREE_MODEL(app->tabs[0].rows));
+    gtk_tree_view_set_headers_visible(GTK_TREE_VIEW(app->list_chat), FALSE);
+    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(app->list_chat), -1, NULL,
+                                                gtk_cell_renderer_text_new(), "text", 0, NULL);
+    gtk_tree_view_column_set_sizing(gtk_tree_view_get_column(GTK_TREE_VIEW(app->list_chat), 0),
+                                    GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(app->list_chat), TRUE);   // 행 높이를 재지 않음
+    app->list_scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_container_add(GTK_CONTAINER(app->list_scrolled), app->list_chat);
+    gtk_stack_add_named(GTK_STACK(app->view_stack), app->list_scrolled, "list");
+
+    // 업로드 진행 표시 (업로드 중에만)
+    app->progress_upload = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(app->progress_upload), TRUE);
+    gtk_widget_set_no_show_all(app->progress_upload, TRUE);
+    gtk_box_pack_start(GTK_BOX(vbox), app->progress_upload, FALSE, FALSE, 0);
+
     // 하단 메시지 전송 영역
     GtkWidget *hbox_bottom = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
     gtk_box_pack_start(GTK_BOX(vbox), hbox_bottom, FALSE, FALSE, 0);
@@ -397,8 +1920,26 @@ int main(int argc, char *argv[])
     gtk_box_pack_start(GTK_BOX(hbox_bottom), app->btn_file, FALSE, FALSE, 0);
     g_signal_connect(app->btn_file, "clicked", G_CALLBACK(on_file_clicked), app);
 
+    app->btn_view = gtk_toggle_button_new_with_label("List");
+    gtk_box_pack_start(GTK_BOX(hbox_bottom), app->btn_view, FALSE, FALSE, 0);
+    g_signal_connect(app->btn_view, "toggled", G_CALLBACK(on_view_toggled), app);
+
+    app->btn_stats = gtk_toggle_button_new_with_label("Stats");
+    gtk_box_pack_start(GTK_BOX(hbox_bottom), app->btn_stats, FALSE, FALSE, 0);
+    g_signal_connect(app->btn_stats, "toggled", G_CALLBACK(on_stats_toggled), app);
+
+    g_signal_connect(app->notebook, "switch-page", G_CALLBACK(on_tab_switched), app);
+
     gtk_widget_show_all(app->window);
+
+    GdkFrameClock *clock = gtk_widget_get_frame_clock(app->window);
+    g_signal_connect(clock, "update", G_CALLBACK(on_frame_update), app);
+    g_signal_connect(clock, "after-paint", G_CALLBACK(on_frame_after_paint), app);
+    if (hud) gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(app->btn_stats), TRUE);
+    else stats_update(app);   // --trace 만 주면 표시 없이 기록
+
     gtk_main();
+    free(app); // 구조체 메모리 해제
 
     return 0;
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,13 +9,95 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/select.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
 #include <locale.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <elf.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>            // systemtap USDT: 있으면 bpftrace/perf 로 붙일 수 있는 정적 probe
+#define HAVE_SDT 1
+#endif
+#endif
+
+#include "event_log.h"
 
 #define PORT        3490
+#define PROF_DEFAULT  "chat_server.folded" // 샘플링 결과 (CHAT_PROF 로 변경)
+#define PROF_HZ       99                   // 초당 샘플 수 (다른 주기 작업과 맞물리지 않게 100 이 아닌 값)
+#define PROF_SAMPLES  32768                // 한 번 켰을 때 모으는 최대 샘플 수
+#define PROF_DEPTH    48
+#define MAX_LISTENERS 4         // TCP + UNIX 경로 + abstract 소켓 (+ 여유)
 #define MAX_CLIENTS 100
 #define MAXBUF      4096
 #define MAXNAME     32
 #define MAXROOM     32
+#define NICK_BUCKETS 256        // 닉네임 해시 인덱스 버킷 수 (2의 거듭제곱)
+#define MAX_ROOMS    64         // 순번/기록을 관리하는 방 수
+#define ROOM_WORKERS_DEFAULT 2  // 방 actor 를 돌리는 스레드 수 (--room-workers)
+#define MAX_ROOM_WORKERS     16
+#define ROOM_HISTORY 256        // 방마다 메모리에 두는 최근 메시지 수
+#define RESUME_MAX   5000       // 재접속 시 한 번에 보내는 최대 메시지 수
+#define MAX_SESSIONS 256        // 재접속 토큰 보관 수
+#define MAX_WATCH    8          // 한 연결이 입장한 방 외에 /watch 로 더 받는 방 수
+#define HISTORY_DIR  "history"  // 방 기록 로그 (<방이름 16진>.log)
+
+#define INDEX_DIR          "index"  // 검색 색인 세그먼트 (seg-<세대>.idx)
+#define INDEX_MAGIC        "CHIDX01"
+#define TERM_MAX           32       // 색인 단어 최대 길이 (NUL 포함)
+#define ACTIVE_BUCKETS     4096     // 메모리 세그먼트 해시 버킷 수
+#define SEG_FLUSH_POSTINGS 65536    // 메모리 세그먼트가 이만큼 쌓이면 디스크 세그먼트로 기록
+#define SEG_MERGE_FANIN    4        // 디스크 세그먼트가 이 수를 넘으면 백그라운드 병합
+#define MAX_SEGMENTS       64
+#define SEARCH_MAX_TERMS   8
+#define SEARCH_MAX_HITS    20
+
+#define SPOOL_DIR   "spool"     // 내용 주소 기반(content-addressed) 파일 저장소
+#define HASHLEN     64          // 파일 해시 16진 문자열 길이 (SHA-256)
+#define FNV_OFFSET  1469598103934665603ULL      // 닉네임/방 이름 해시 (FNV-1a 64bit)
+#define FNV_PRIME   1099511628211ULL
+
+#define POOL_MAX_WORKERS  16     // 작업 스레드 최대 수 (기본값은 CPU 수)
+#define POOL_DEQUE_SIZE   256    // 작업 스레드별 deque 크기 (2의 거듭제곱)
+
+#define RELAY_WINDOW_DEFAULT  (256 * 1024) // 업로더가 가장 느린 수신자보다 앞설 수 있는 바이트 (--relay-window)
+#define RELAY_LAG_MS_DEFAULT  5000         // 이 시간 동안 한 바이트도 못 보낸 수신자는 떼어냄 (--relay-lag-ms, 0: 안 뗌)
+#define RELAY_TICK_MS         100          // 밀린 출력이 있을 때 방 스레드가 깨어나는 간격
+
+#define MEM_BUDGET_MB_DEFAULT 256          // 방 출력 대기열 + 미룬 메시지 합계 한도 (--mem-budget-mb, 0: 제한 없음)
+#define MEM_PAUSE_PCT         75           // 예산의 이 비율을 넘으면 중계 파일 데이터 읽기부터 멈춤
+#define MEM_SHED_MIN          (64 * 1024)  // 이보다 적게 쌓인 연결은 예산을 넘어도 끊지 않음
+#define MEM_STATS_TOP         10           // /stats mem 에 보여 줄 연결 수 (많이 쌓인 순)
+
+#define UPGRADE_SOCK    "/tmp/chat_server.upgrade" // 무중단 업그레이드용 UNIX 소켓 (CHAT_UPGRADE_SOCK로 변경)
+#define HANDOFF_MAGIC   0x43485539                 // "CHU9": 핸드오프 레코드 형식 버전
+#define HANDOFF_OUT_MAX 4096                       // 핸드오프 레코드 하나에 싣는 못 보낸 출력
+#define UPGRADE_TIMEOUT_SEC 5                      // 핸드오프 중 상대 응답을 기다리는 최대 시간 (넘으면 기존 서버가 계속 서비스)
+
+/* 접속 폭주 대응 기본값 (실행 옵션으로 변경 가능) */
+#define DEFAULT_BACKLOG       1024  // listen() 대기열 (커널 somaxconn 까지)
+#define DEFAULT_ACCEPT_BUDGET 64    // select 한 번 깨어날 때 accept 할 최대 연결 수
+#define DEFAULT_MAX_RSS_MB    0     // 이 이상 메모리를 쓰면 새 연결 거절 (0: 검사 안 함)
+#define RETRY_AFTER_BASE      2     // BUSY 응답의 재시도 대기 (초)
+#define RETRY_AFTER_JITTER    4     // 재접속이 한꺼번에 몰리지 않도록 더하는 무작위 초
 
 /* 클라이언트 상태 관리 구조체 */
 typedef struct {
@@ -22,6 +105,14 @@ typedef struct {
     char nickname[MAXNAME];     // 닉네임
     char room[MAXROOM];         // 현재 방 이름
     int registered;             // 0: 접속직후, 1: /join 완료
+    int nick_next;              // 닉네임 인덱스의 같은 버킷 다음 클라이언트 (-1: 끝)
+    int want_seq;               // 1: 방 메시지 앞에 "@<순번> "을 붙여 받음 (재접속 지원 클라이언트)
+    int credit_rx;              // 1: 파일 중계를 /credit 으로 허락한 만큼만 받는 수신자
+    int fileref_rx;             // 1: 해시 업로드를 FILEREF 로 받는 수신자 (/fileref). 아니면 실시간 중계로 받음
+    long credit_carry;          // 핸드오프로 넘겨받은 남은 크레딧 (다시 입장할 때 방에 전달)
+    int relay_rx;               // 핸드오프로 넘겨받은: 방에서 진행 중인 중계를 받던 수신자 (다시 입장할 때 방에 전달)
+    struct OutChunk *carry_out; // 핸드오프로 넘겨받은 못 보낸 출력 (다시 입장할 때 방에 전달)
+    struct OutChunk *carry_held; //                    중계가 끝난 뒤 보낼 출력
 
     /* TCP 스트림 처리를 위한 버퍼 */
     char cmd_buf[MAXBUF];       // 명령어를 쌓아두는 버퍼
@@ -29,84 +120,3405 @@ typedef struct {
 
     /* 파일 전송 상태 */
     long file_remain;           // 남은 파일 전송량 (>0 이면 파일 모드)
+    long file_size;             // 알린 전체 파일 크기
+    char file_name[256];        // 알린 파일 이름
+    int file_relay;             // 1: 구버전 /file (실시간 중계), 0: 스풀 후 FILEREF 알림
+    int spool_fd;               // 스풀 임시 파일 (-1이면 없음)
+    char spool_part[64];        // 스풀 임시 파일 경로
+    char file_claimed[HASHLEN + 1]; // 클라이언트가 알린 해시 (없으면 빈 문자열)
+    long relay_unacked;         // 방 actor 에 넘겼지만 가장 느린 수신자에게 아직 안 나간 중계 바이트
+    int handover_pending;       // 방을 옮기는 중: 앞 방 actor 가 남은 출력을 아직 안 돌려줌
+    char handover_from[MAXROOM]; // 옮기기 전 방 (남은 중계를 받는 동안 크레딧은 그 방으로)
+
+    char watch[MAX_WATCH][MAXROOM]; // /watch 로 함께 받는 방 (입장한 방 제외)
+    int nwatch;
+
+    /* 메모리 사용량: 방 스레드가 이 연결 몫으로 쌓아 둔 출력. 슬롯을 비워도 0으로 덮지 않음
+       (방에서 빠질 때 방 스레드가 스스로 빼므로, 그 전에는 슬롯을 다시 쓰지 않음) */
+    atomic_long mem_queued;
+    int mem_paused;             // 메모리 예산 때문에 중계 파일 데이터 읽기를 멈춤
+    int mem_shed;               // 메모리 예산 때문에 끊는 중 (EOF 를 기다림)
+
+    uint64_t serial;            // 슬롯을 쓸 때마다 바뀌는 번호 (작업 완료 시 같은 연결인지 확인)
+    uint64_t msg_id;            // 지금 처리 중인 명령의 추적 번호 (tracepoint 에서 방 전송까지 이어짐)
 } ClientContext;
 
-/* 서버 상태 관리 구조체 */
+/* 참여자에게 아직 못 보낸 출력 조각 */
+typedef struct OutChunk {
+    struct OutChunk *next;
+    size_t len, off;            // [off, len) 이 남은 부분
+    int relay;                  // 1: 파일 중계 데이터 (크레딧 수신자는 허락받은 만큼만)
+    int file_fd;                // >= 0 이면 data 대신 이 파일의 [off, len) 을 보냄 (/fetch)
+    char data[];
+} OutChunk;
+
+/* 방 참여자 (방 actor 소유) */
+typedef struct RoomMember {
+    int fd;                     // actor 전용으로 dup() 한 소켓
+    uint64_t serial;            // 클라이언트 연결 번호 (ClientContext.serial)
+    int want_seq;
+    char nickname[MAXNAME];
+    struct RoomMember *next;
+
+    /* 전송은 블록하지 않음: 소켓이 못 받은 것은 순서대로 쌓아 두고 나중에 보냄 */
+    OutChunk *out_head, *out_tail;
+    size_t out_bytes;           // 쌓인 양
+    long long out_progress;     // 마지막으로 조금이라도 보낸 시각 (ms, 쌓이기 시작한 시각 포함)
+    int credit_mode;            // 1: /credit 수신자
+    long credit;                // 더 보내도 되는 중계 바이트
+    int dead;                   // 떼어냄 (이벤트 루프의 LEAVE 를 기다림)
+    int parked;                 // 앞 방의 남은 출력(HANDOVER)을 받기 전: 쌓기만 하고 보내지 않음
+    int fileref;                // 1: 해시 업로드는 FILEREF 로 받음 (0: 구버전처럼 실시간 중계로)
+    int in_relay;               // 진행 중인 중계를 받는 중: 다른 출력은 held 에 두었다가 중계가 끝나면 보냄
+    OutChunk *held_head, *held_tail;
+    int leaving;                // 방을 옮겨 나갔지만 받던 중계가 끝날 때까지 남아 있음 (중계 외 출력은 버림)
+    int leave_idx;              // 나갈 때 남은 출력을 돌려줄 클라이언트 슬롯
+    atomic_long *room_mem;      // 대기열 메모리를 더할 곳: 방 (Room.mem_queued)
+    atomic_long *conn_mem;      //                       연결 (ClientContext.mem_queued)
+} RoomMember;
+
+/* 방을 지켜보는 (다른 방에 입장한) 연결 (방 actor 소유) */
+typedef struct RoomWatcher {
+    uint64_t serial;
+    int idx;                    // 이벤트 루프의 클라이언트 슬롯
+    struct RoomWatcher *next;
+} RoomWatcher;
+
+/* 방 상태: 메시지 순번과 최근 기록, 참여자. 주인 방 스레드만 접근 */
+typedef struct {
+    char name[MAXROOM];
+    int loaded;                 // 기록 파일을 열었는지 (주인 스레드가 첫 메시지에서 엶)
+    RoomMember *members;
+    RoomWatcher *watchers;      // 순번 붙은 메시지를 "ROOM <방> " 을 붙여 돌려 보낼 연결
+    uint64_t seq;               // 마지막으로 부여한 순번 (1부터 시작)
+    char *hist[ROOM_HISTORY];   // 최근 메시지 (순번 % ROOM_HISTORY 위치, 개행 포함)
+    uint64_t hist_from;         // 이 프로세스가 메모리에 기록하기 시작한 순번 (이전 것은 로그에만 있음)
+    FILE *log;                  // 전체 기록 로그 ("<순번> <메시지>" 한 줄씩)
+    FILE *idx;                  // 순번별 로그 위치 (순번-1 번째 8바이트 = 그 줄의 오프셋)
+
+    /* 진행 중인 파일 중계: 남은 바이트와 업로더에게 아직 전달 확인을 안 돌려준 바이트.
+       중계를 받는 참여자의 다른 출력은 참여자별로 미루고 (RoomMember.held), 방 전체로 미루는 것은
+       다른 업로드와 그 연결이 뒤이어 보낸 메시지뿐 (held_head) */
+    uint64_t relay_serial;
+    int relay_idx;
+    long relay_remain;
+    long relay_pending;
+    struct RoomMsg *held_head, *held_tail;
+    int closed;                 // CLOSE 를 처리함: 주인 스레드가 이번 차례를 끝으로 놓아 줌
+
+    /* 메모리 사용량 (주인 스레드가 바꾸고 /stats mem 이 읽음) */
+    atomic_long mem_queued;     // 참여자 출력 대기열
+    atomic_long mem_held;       // 미뤄 둔 메시지
+    atomic_long mem_hist;       // 최근 기록
+} Room;
+
+/* 재접속 토큰 → 닉네임/방 */
+typedef struct {
+    uint64_t token;             // 0이면 빈 슬롯
+    char nickname[MAXNAME];
+    char room[MAXROOM];
+    time_t last_used;
+} Session;
+
+struct ServerContext;
+
+/* 작업 스레드 풀에 맡기는 일 (구체적인 작업 구조체의 첫 멤버로 넣어 사용) */
+typedef struct Task {
+    void (*run)(struct Task *);                         // 작업 스레드에서 실행
+    void (*done)(struct ServerContext *, struct Task *); // 이벤트 루프에서 실행, 작업 해제 책임
+    struct Task *next;                                  // 완료 스택 연결
+} Task;
+
+/* 작업 스레드별 deque: 주인은 뒤(가장 최근에 넣은 것)에서, 다른 스레드는 앞(가장 오래된 것)에서 훔쳐 감 */
+typedef struct {
+    pthread_mutex_t lock;
+    Task *slots[POOL_DEQUE_SIZE];
+    unsigned top, bottom;       // [top, bottom) 이 들어 있는 작업
+} WorkDeque;
+
+struct WorkerPool;
+
+typedef struct {
+    pthread_t tid;
+    int id;
+    struct WorkerPool *pool;
+    WorkDeque dq;
+} Worker;
+
+typedef struct WorkerPool {
+    int nworkers;
+    Worker workers[POOL_MAX_WORKERS];
+    unsigned next;              // 제출할 deque 순번 (라운드로빈, 이벤트 루프 전용)
+    int queued;                 // deque 들에 들어 있는 작업 수 (idle_lock 보호)
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;   // 할 일이 없는 작업 스레드가 대기
+    _Atomic(Task *) done_head;  // 완료 스택 (작업 스레드 여럿 → 이벤트 루프, 잠금 없음)
+    int efd;                    // 완료 알림 eventfd (select 대상)
+    int inflight;               // 제출했지만 done 이 아직 안 불린 작업 수 (이벤트 루프 전용)
+} WorkerPool;
+
+/* 검색 색인: 단어 → (방, 순번) 포스팅 목록 */
+typedef struct {
+    uint32_t room;              // 방 이름 해시 (재시작해도 같은 값)
+    uint64_t seq;
+} Posting;
+
+/* 아직 디스크에 안 내린 메모리 세그먼트의 단어 */
+typedef struct ActiveTerm {
+    char term[TERM_MAX];
+    Posting *post;
+    int n, cap;
+    struct ActiveTerm *next;
+} ActiveTerm;
+
+/* 디스크 세그먼트 파일: SegHeader | 포스팅 영역 | SegTerm 디렉터리(단어 정렬) */
+typedef struct {
+    char magic[8];
+    uint32_t nterms;
+    uint32_t reserved;
+    uint64_t dir_offset;
+} SegHeader;
+
+typedef struct {
+    char term[TERM_MAX];
+    uint64_t offset;            // 인코딩된 포스팅 시작 위치
+    uint32_t bytes;             // 인코딩된 길이
+    uint32_t count;             // 포스팅 수
+} SegTerm;
+
+/* mmap 된 읽기 전용 세그먼트 */
+typedef struct {
+    int gen;
+    char path[64];
+    unsigned char *map;
+    size_t size;
+    uint32_t nterms;
+    const SegTerm *terms;
+} Segment;
+
+/* 메모리 세그먼트 (단어 해시 테이블) */
+typedef struct TermTable {
+    ActiveTerm *buckets[ACTIVE_BUCKETS];
+    long postings;
+    struct TermTable *next;     // 디스크 기록을 기다리는 목록 연결
+} TermTable;
+
+/* 색인 상태는 이벤트 루프만 바꾸고, 작업 스레드는 얼린 메모리 세그먼트와 mmap 만 읽음 */
+typedef struct {
+    TermTable *active;          // 새 포스팅이 들어가는 메모리 세그먼트
+    TermTable *frozen;          // 작업 스레드가 디스크로 기록 중인 메모리 세그먼트들
+    Segment *segs[MAX_SEGMENTS];
+    int nsegs;
+    struct IndexTask *waiting;  // 목록이 가득 차 병합이 자리를 만들기를 기다리는 기록 완료 작업 (먼저 온 순)
+    int next_gen;
+    int merging;                // 병합 작업 진행 중
+    WorkerPool *pool;
+} SearchIndex;
+
+/* 방 actor 에게 보내는 메시지 */
+typedef enum { RMSG_JOIN, RMSG_LEAVE, RMSG_POST, RMSG_RAW, RMSG_RELAY, RMSG_CREDIT, RMSG_FETCH, RMSG_SYNC,
+               RMSG_WATCH, RMSG_UNWATCH, RMSG_DELIVER, RMSG_HANDOVER, RMSG_CLOSE, RMSG_FILEREF } RoomMsgType;
+
+/* POST/RAW 를 받을 참여자: 모두, 해시 업로드를 모르는 (구버전) 참여자만, FILEREF 수신자만 */
+typedef enum { AUD_ALL = 0, AUD_LEGACY, AUD_FILEREF } RoomAudience;
+
+typedef struct RoomMsg {
+    struct RoomMsg *next;       // 우편함 연결
+    RoomMsgType type;
+    uint64_t serial;            // 보낸 (또는 나가는) 클라이언트 연결 번호
+    int fd;                     // JOIN: actor 에게 넘기는 dup() 소켓, DELIVER/RAW: data 뒤에 이어 보낼 파일
+    int want_seq;               // JOIN
+    int credit_mode;            // JOIN (credit: 처음부터 가진 크레딧)
+    int in_relay;               // JOIN: 핸드오프 전에 이 방의 진행 중인 중계를 받던 참여자
+    int fileref;                // JOIN: 해시 업로드를 FILEREF 로 받는 참여자
+    RoomAudience audience;      // POST/RAW: 받을 참여자
+    int idx;                    // RAW/RELAY: 보낸 클라이언트 슬롯 (전달 확인을 돌려줄 곳), WATCH: 지켜보는 슬롯,
+                                // LEAVE: 남은 출력을 돌려줄 슬롯
+    long relay_size;            // RAW: 이 헤더 뒤에 따라올 중계 바이트 (파일 헤더), DELIVER/RAW(fd): 파일 크기
+    long credit;                // CREDIT: 수신자가 더 허락한 바이트
+    int quiet;                  // JOIN/LEAVE: 입장/퇴장 알림 생략 (핸드오프)
+    int handover;               // JOIN: 앞 방의 남은 출력을 받을 때까지 보내지 않음,
+                                // LEAVE: 남은 출력을 버리지 않고 이벤트 루프를 거쳐 다음 방에 넘김
+    struct OutChunk *chunks;    // HANDOVER: 앞 방에서 (또는 핸드오프 전 프로세스가) 못 보낸 출력
+    struct OutChunk *held;      // HANDOVER: 핸드오프 전 프로세스가 중계 뒤로 미뤄 둔 출력
+    atomic_long *conn_mem;      // JOIN: 출력 대기열 메모리를 더할 연결 카운터
+    char nickname[MAXNAME];     // JOIN
+    uint64_t token;             // JOIN: 0이 아니면 TOKEN 알림 후 last_seq 이후 재전송
+    uint64_t last_seq;
+    int text_off;               // POST: 이 위치부터 검색 색인 (-1: 색인 안 함)
+    uint64_t msg_id;            // POST: 보낸 명령의 추적 번호
+    uint64_t *seqs;             // FETCH: 가져올 순번들
+    int nseqs;
+    size_t len;
+    char data[];                // POST/RAW/RELAY/DELIVER: 보낼 내용, JOIN: 입장 응답, FETCH: 머리줄
+} RoomMsg;
+
+typedef struct RoomActor {
+    Room room;                          // 주인 스레드만 접근 (name 은 만든 뒤 불변)
+    _Atomic(RoomMsg *) mailbox;         // MPSC 우편함 (스택, 주인이 통째로 가져가 뒤집음)
+    atomic_int scheduled;               // 주인 스레드 실행 대기열에 올라가 있는지
+    struct RoomActor *next_ready;       // 실행 대기열 연결
+    int worker;                         // 주인 방 스레드 (방 이름 해시)
+    int stalled;                        // 밀린 출력이 있어 주인 스레드가 쓰기 가능을 기다리는 중
+    int users;                          // 입장한 연결 + 지켜보는 연결 (이벤트 루프 전용, 0이 되면 닫음)
+    atomic_int refs;                    // 디렉터리 + 실행 대기열 + 진행 중인 actor_post (0이 되면 해제)
+} RoomActor;
+
+struct ActorRuntime;
+
 typedef struct {
-    int listenfd;
+    pthread_t tid;
+    int efd;                            // 깨우기용 eventfd
+    _Atomic(RoomActor *) ready;         // 처리할 메시지가 있는 방들 (MPSC 스택)
+    struct ActorRuntime *rt;
+    RoomActor *stalled[MAX_ROOMS];      // 밀린 출력이 있는 방 (주인 스레드 전용)
+    int nstalled;
+} RoomWorker;
+
+typedef struct ActorRuntime {
+    int nworkers;
+    RoomWorker workers[MAX_ROOM_WORKERS];
+    RoomActor *rooms[MAX_ROOMS];        // 방 디렉터리 (이벤트 루프 전용)
+    WorkerPool *pool;                   // 색인 요청을 이벤트 루프로 돌려보내는 완료 큐
+    atomic_int sync_pending;            // actors_sync 가 기다리는 방 수
+    atomic_int frozen;                  // 핸드오프 중: 밀린 출력을 보내지 않음 (이벤트 루프가 대기열을 읽어 넘김)
+    int relay_lag_ms;                   // 출력이 이만큼 멈춘 참여자는 떼어냄 (0: 안 뗌)
+} ActorRuntime;
+
+/* 서버 상태 관리 구조체 */
+typedef struct ServerContext {
+    int listenfds[MAX_LISTENERS];       // TCP / UNIX 경로 / abstract 리슨 소켓 (같은 클라이언트 표와 명령 처리를 공유)
+    int nlisteners;
+    int upgradefd;                      // 새 바이너리의 핸드오프 요청을 받는 UNIX 소켓
     ClientContext clients[MAX_CLIENTS]; // 클라이언트 배열
     fd_set all_fds;                     // 전체 관찰 대상 fd 셋
     int max_fd;                         // 현재 가장 큰 fd 번호
+    int nclients;                       // 현재 접속 중인 클라이언트 수
+    int nick_head[NICK_BUCKETS];        // 닉네임 → 클라이언트 인덱스 (체이닝, -1: 비어 있음)
+    ActorRuntime actors;                // 방 actor (방별 순번, 기록, 참여자)
+    Session sessions[MAX_SESSIONS];     // 재접속 토큰
+    SearchIndex index;                  // 방 기록 검색 색인
+    WorkerPool pool;                    // CPU/디스크를 오래 쓰는 작업용 스레드 풀
+
+    /* 접속 수락 / 입장 제어 설정 */
+    int backlog;                        // listen() 대기열 길이
+    int accept_budget;                  // 한 번에 accept 할 최대 연결 수
+    int max_clients;                    // 이 수 이상이면 새 연결 거절 (<= MAX_CLIENTS)
+    long max_rss_kb;                    // 이 이상 메모리 사용 시 새 연결 거절 (0: 검사 안 함)
+
+    /* 파일 중계 흐름 제어 */
+    long relay_window;                  // 업로더별 전달 확인 안 된 중계 바이트 한도 (넘으면 읽기 중단)
+
+    /* 메모리 예산 */
+    long mem_budget;                    // 바이트 (0: 제한 없음)
+    int mem_paused;                     // 예산 때문에 읽기를 멈춘 업로더 수
+    int mem_last_level;                 // 마지막으로 기록한 단계 (바뀔 때만 이벤트 로그)
+
+    uint64_t next_msg_id;               // 명령마다 붙이는 추적 번호
 } ServerContext;
 
 /* 전역 서버 컨텍스트 (main과 signal 핸들러 등에서 접근 가능하도록 할 수 있으나, 여기선 main 루프 내에서 처리) */
 
+/* ---------------------------------------------------------------------------
+ * 비동기 이벤트 로그 (빌드: gcc -o chat_server chat_server.c -pthread)
+ *
+ * 이벤트 루프는 printf 대신 고정 크기 EventRecord를 자기 스레드 전용 링에 넣기만 한다.
+ * 링은 생산자 1 / 소비자 1 이라 원자적 head/tail 만으로 잠금 없이 동작하고,
+ * 가득 차면 기다리지 않고 버린 뒤 개수만 센다. 백그라운드 writer 스레드가 모든 링을
+ * 모아 한 번의 write()로 파일에 기록한다. 해석은 evlog_dump 로 한다.
+ * ------------------------------------------------------------------------- */
+#define EVLOG_RING_SIZE  4096   // 2의 거듭제곱
+#define EVLOG_BATCH      256    // writer가 한 번에 쓰는 최대 레코드 수
+#define EVLOG_IDLE_NS    10000000L // 링이 비었을 때 writer 대기 (10ms)
+
+typedef struct EventRing {
+    EventRecord slots[EVLOG_RING_SIZE];
+    _Atomic uint32_t head;          // 생산자가 다음에 쓸 위치
+    _Atomic uint32_t tail;          // writer가 다음에 읽을 위치
+    _Atomic uint64_t dropped;       // 링이 가득 차 버린 레코드 수
+    uint16_t id;
+    struct EventRing *next;
+} EventRing;
+
+static _Atomic(EventRing *) evlog_rings = NULL;   // 등록된 링 목록 (앞에 추가만 함)
+static _Atomic uint16_t evlog_ring_count = 0;
+static __thread EventRing *evlog_my_ring = NULL;
+static _Atomic int evlog_running = 0;
+static int evlog_fd = -1;
+static pthread_t evlog_thread;
+
+static EventRing *evlog_ring_for_thread(void) {
+    if (evlog_my_ring) return evlog_my_ring;
+
+    EventRing *r = calloc(1, sizeof(EventRing));
+    if (!r) return NULL;
+    r->id = atomic_fetch_add(&evlog_ring_count, 1);
+
+    EventRing *old = atomic_load(&evlog_rings);
+    do {
+        r->next = old;
+    } while (!atomic_compare_exchange_weak(&evlog_rings, &old, r));
+
+    evlog_my_ring = r;
+    return r;
+}
+
+/* 이벤트 기록: 절대 블록하지 않음 (링이 가득 차면 버림) */
+void evlog(uint16_t type, int fd, int64_t val, const char *a, const char *b) {
+    if (!atomic_load_explicit(&evlog_running, memory_order_relaxed)) return;
+    EventRing *r = evlog_ring_for_thread();
+    if (!r) return;
+
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail >= EVLOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    EventRecord *rec = &r->slots[head & (EVLOG_RING_SIZE - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->type = type;
+    rec->ring = r->id;
+    rec->fd = fd;
+    rec->val = val;
+    strncpy(rec->a, a ? a : "", EVLOG_STRLEN);
+    strncpy(rec->b, b ? b : "", EVLOG_STRLEN);
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/* 모든 링에서 모은 레코드를 한 번에 기록. 기록한 레코드 수 반환 */
+static int evlog_drain(void) {
+    EventRecord batch[EVLOG_BATCH];
+    int total = 0;
+
+    for (EventRing *r = atomic_load(&evlog_rings); r; r = r->next) {
+        for (;;) {
+            int n = 0;
+            uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+            uint64_t dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+            if (dropped) {
+                memset(&batch[n], 0, sizeof(EventRecord));
+                batch[n].type = EV_DROPPED;
+                batch[n].ring = r->id;
+                batch[n].fd = -1;
+                batch[n].val = (int64_t)dropped;
+                n++;
+            }
+            while (tail != head && n < EVLOG_BATCH) {
+                batch[n++] = r->slots[tail & (EVLOG_RING_SIZE - 1)];
+                tail++;
+            }
+            atomic_store_explicit(&r->tail, tail, memory_order_release);
+            if (n == 0) break;
+
+            if (write(evlog_fd, batch, n * sizeof(EventRecord)) < 0) perror("evlog write");
+            total += n;
+            if (tail == head) break;
+        }
+    }
+    return total;
+}
+
+static void *evlog_writer(void *arg) {
+    (void)arg;
+    while (atomic_load(&evlog_running)) {
+        if (evlog_drain() == 0) {
+            struct timespec idle = { 0, EVLOG_IDLE_NS };
+            nanosleep(&idle, NULL);
+        }
+    }
+    evlog_drain();
+    return NULL;
+}
+
+/* 로그 파일 열고 writer 스레드 시작. 실패하면 로그 없이 계속 동작 */
+void evlog_start(const char *path) {
+    evlog_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (evlog_fd < 0) { perror("evlog open"); return; }
+
+    struct stat st;
+    if (fstat(evlog_fd, &st) == 0 && st.st_size == 0) {
+        EventLogHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, EVLOG_MAGIC, sizeof(hdr.magic));
+        hdr.record_size = sizeof(EventRecord);
+        if (write(evlog_fd, &hdr, sizeof(hdr)) < 0) perror("evlog header");
+    }
+
+    atomic_store(&evlog_running, 1);
+    if (pthread_create(&evlog_thread, NULL, evlog_writer, NULL) != 0) {
+        atomic_store(&evlog_running, 0);
+        close(evlog_fd);
+        evlog_fd = -1;
+    }
+}
+
+/* 남은 레코드를 모두 기록하고 종료 */
+void evlog_stop(void) {
+    if (!atomic_load(&evlog_running)) return;
+    atomic_store(&evlog_running, 0);
+    pthread_join(evlog_thread, NULL);
+    close(evlog_fd);
+    evlog_fd = -1;
+}
+
+/* ---------------------------------------------------------------------------
+ * 내장 샘플링 프로파일러와 tracepoint (재시작 없이 켜고 끔: kill -USR2 <pid>)
+ *
+ * 켜면 ITIMER_PROF 로 CPU 를 쓰는 스레드에 초당 PROF_HZ 번 SIGPROF 가 오고, 핸들러는
+ * backtrace() 로 주소만 미리 잡아 둔 배열에 넣는다 (할당/잠금 없음). 끄면 이벤트 루프가
+ * 실행 파일의 심볼 테이블(static 함수 포함)로 이름을 찾아 "루트;...;말단 횟수" 형식의
+ * folded stack 을 PROF_DEFAULT 에 쓴다 (flamegraph.pl, speedscope 에 그대로 넣을 수 있음).
+ *
+ * TRACE(probe, ...) 는 recv → 명령 해석 → 방 fan-out → 참여자 전송 지점에 있다.
+ * <sys/sdt.h> 가 있으면 USDT probe (provider chat_server) 로 컴파일되어 외부 도구가
+ * 언제든 붙을 수 있고, 프로파일러가 켜져 있는 동안에는 명령 추적 번호와 함께 이벤트 로그에도
+ * EV_TRACE 로 남는다 (evlog_dump 로 단계별 시각 비교).
+ * ------------------------------------------------------------------------- */
+typedef struct {
+    atomic_int ready;
+    int depth;
+    void *pc[PROF_DEPTH];
+} ProfSample;
+
+static ProfSample *prof_samples;
+static atomic_uint prof_next;
+static atomic_int prof_on;
+static volatile sig_atomic_t prof_toggle_req;
+
+static void prof_sigprof(int sig) {
+    (void)sig;
+    if (!atomic_load_explicit(&prof_on, memory_order_relaxed)) return;
+    unsigned i = atomic_fetch_add(&prof_next, 1);
+    if (i >= PROF_SAMPLES) return;
+    int saved = errno;
+    ProfSample *s = &prof_samples[i];
+    s->depth = backtrace(s->pc, PROF_DEPTH);
+    atomic_store(&s->ready, 1);
+    errno = saved;
+}
+
+static void prof_sigusr2(int sig) {
+    (void)sig;
+    prof_toggle_req = 1;
+}
+
+/* 실행 파일의 함수 심볼 (주소 순) */
+typedef struct {
+    uintptr_t start, end;
+    const char *name;
+} ProfSym;
+
+static int prof_sym_cmp(const void *a, const void *b) {
+    uintptr_t x = ((const ProfSym *)a)->start, y = ((const ProfSym *)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+static ProfSym *prof_load_syms(int *nsyms, void **map, size_t *map_size, int *pie) {
+    *nsyms = 0;
+    *map = NULL;
+    int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    unsigned char *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return NULL;
+    *map = m;
+    *map_size = st.st_size;
+
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)m;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64) return NULL;
+    *pie = (eh->e_type == ET_DYN);
+    const Elf64_Shdr *sh = (const Elf64_Shdr *)(m + eh->e_shoff);
+
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_SYMTAB) continue;   // strip 된 실행 파일이면 없음
+        const Elf64_Sym *sym = (const Elf64_Sym *)(m + sh[i].sh_offset);
+        const char *strtab = (const char *)(m + sh[sh[i].sh_link].sh_offset);
+        size_t n = sh[i].sh_size / sizeof(Elf64_Sym);
+        ProfSym *syms = malloc(n * sizeof(ProfSym));
+        if (!syms) return NULL;
+        for (size_t k = 0; k < n; k++) {
+            if (ELF64_ST_TYPE(sym[k].st_info) != STT_FUNC || sym[k].st_value == 0) continue;
+            syms[*nsyms].start = sym[k].st_value;
+            syms[*nsyms].end = sym[k].st_value + sym[k].st_size;
+            syms[*nsyms].name = strtab + sym[k].st_name;
+            (*nsyms)++;
+        }
+        qsort(syms, *nsyms, sizeof(ProfSym), prof_sym_cmp);
+        return syms;
+    }
+    return NULL;
+}
+
+static const char *prof_sym_find(const ProfSym *syms, int n, uintptr_t addr) {
+    int lo = 0, hi = n - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (syms[mid].start <= addr) { found = mid; lo = mid + 1; }
+        else hi = mid - 1;
+    }
+    if (found < 0 || (syms[found].end > syms[found].start && addr >= syms[found].end)) return NULL;
+    return syms[found].name;
+}
+
+static int prof_str_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+void prof_start(void) {
+    if (!prof_samples) prof_samples = calloc(PROF_SAMPLES, sizeof(ProfSample));
+    if (!prof_samples) { perror("profiler"); return; }
+    for (int i = 0; i < PROF_SAMPLES; i++) atomic_store(&prof_samples[i].ready, 0);
+    atomic_store(&prof_next, 0);
+
+    void *warm[2];
+    backtrace(warm, 2);     // 첫 호출은 libgcc 를 읽어 들이므로 시그널 핸들러 밖에서 미리
+
+    atomic_store(&prof_on, 1);
+    struct itimerval it = { { 0, 1000000 / PROF_HZ }, { 0, 1000000 / PROF_HZ } };
+    setitimer(ITIMER_PROF, &it, NULL);
+    printf("SERVER: profiler on (%d Hz)\n", PROF_HZ);
+}
+
+/* 멈추고 folded stack 으로 기록 */
+void prof_stop(void) {
+    struct itimerval off = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_PROF, &off, NULL);
+    atomic_store(&prof_on, 0);
+
+    unsigned total = atomic_load(&prof_next);
+    unsigned n = total < PROF_SAMPLES ? total : PROF_SAMPLES;
+    int nsyms = 0, pie = 0;
+    void *map = NULL;
+    size_t map_size = 0;
+    ProfSym *syms = prof_load_syms(&nsyms, &map, &map_size, &pie);
+    Dl_info self;
+    void *exe_base = dladdr((void *)prof_start, &self) ? self.dli_fbase : NULL;
+
+    char **stacks = calloc(n ? n : 1, sizeof(char *));
+    int nstacks = 0;
+    for (unsigned i = 0; stacks && i < n; i++) {
+        ProfSample *s = &prof_samples[i];
+        if (!atomic_load(&s->ready)) continue;
+
+        // 0: 핸들러, 1: 시그널 복귀 코드 → 2 부터가 실행 중이던 곳. 루트부터 이어 붙임
+        char line[PROF_DEPTH * 48];
+        int len = 0;
+        for (int f = s->depth - 1; f >= 2 && len < (int)sizeof(line) - 64; f--) {
+            uintptr_t pc = (uintptr_t)s->pc[f] - (f > 2);   // 호출 지점 (복귀 주소 바로 앞)
+            Dl_info info;
+            const char *name = NULL;
+            if (dladdr((void *)pc, &info)) {
+                if (info.dli_fbase == exe_base && syms)
+                    name = prof_sym_find(syms, nsyms, pc - (pie ? (uintptr_t)exe_base : 0));
+                if (!name) name = info.dli_sname;
+            }
+            len += snprintf(line + len, sizeof(line) - len, "%s%s", len ? ";" : "", name ? name : "[unknown]");
+        }
+        if (len > 0 && (stacks[nstacks] = strdup(line)) != NULL) nstacks++;
+    }
+
+    const char *path = getenv("CHAT_PROF");
+    if (!path) path = PROF_DEFAULT;
+    FILE *fp = fopen(path, "w");
+    if (fp && stacks) {
+        qsort(stacks, nstacks, sizeof(char *), prof_str_cmp);
+        for (int i = 0; i < nstacks; ) {
+            int j = i;
+            while (j < nstacks && strcmp(stacks[i], stacks[j]) == 0) j++;
+            fprintf(fp, "%s %d\n", stacks[i], j - i);
+            i = j;
+        }
+    }
+    if (fp) fclose(fp);
+    else perror("profiler output");
+    printf("SERVER: profiler off, %d samples (%u dropped) -> %s\n",
+           nstacks, total > n ? total - n : 0, path);
+
+    for (int i = 0; i < nstacks; i++) free(stacks[i]);
+    free(stacks);
+    free(syms);
+    if (map) munmap(map, map_size);
+}
+
+/* 시그널 핸들러는 요청만 남기고, 실제 전환은 이벤트 루프에서 */
+/* SIGINT/SIGTERM: 이벤트 루프가 pselect 에서 깨어나 정리 후 종료 */
+static volatile sig_atomic_t shutdown_req;
+static void on_shutdown_signal(int sig) { (void)sig; shutdown_req = 1; }
+
+void prof_init(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = prof_sigprof;
+    sigaction(SIGPROF, &sa, NULL);
+    sa.sa_handler = prof_sigusr2;
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+void prof_poll(void) {
+    if (!prof_toggle_req) return;
+    prof_toggle_req = 0;
+    if (atomic_load(&prof_on)) prof_stop();
+    else prof_start();
+}
+
+/* tracepoint: USDT probe 는 항상 (붙은 도구가 없으면 nop 하나), 이벤트 로그는 프로파일러가 켜져 있을 때만 */
+static void trace_emit(const char *probe, int fd, uint64_t id, long arg) {
+    char b[24];
+    snprintf(b, sizeof(b), "%ld", arg);
+    evlog(EV_TRACE, fd, (int64_t)id, probe, b);
+}
+
+#ifdef HAVE_SDT
+#define TRACE_USDT(probe, id, arg) DTRACE_PROBE2(chat_server, probe, id, arg)
+#else
+#define TRACE_USDT(probe, id, arg) ((void)0)
+#endif
+
+#define TRACE(probe, fd, id, arg) do { \
+        TRACE_USDT(probe, id, arg); \
+        if (atomic_load_explicit(&prof_on, memory_order_relaxed)) trace_emit(#probe, fd, id, arg); \
+    } while (0)
+
+/* ---------------------------------------------------------------------------
+ * 작업 스레드 풀
+ *
+ * 업로드 해시 검증, 검색 색인 기록/병합처럼 오래 걸리는 일은 이벤트 루프가 Task 로
+ * 만들어 pool_submit 하고 바로 다음 이벤트로 넘어간다. 작업 스레드는 자기 deque 를
+ * 먼저 비우고, 비면 다른 스레드 deque 에서 훔쳐 온다. 끝난 작업은 잠금 없는
+ * 완료 스택에 넣고 eventfd 로 이벤트 루프를 깨우며, done (응답 전송, 목록 교체)은
+ * 항상 이벤트 루프 스레드에서 실행되므로 서버 상태에는 잠금이 필요 없다.
+ * ------------------------------------------------------------------------- */
+static int deque_push(WorkDeque *dq, Task *t) {
+    pthread_mutex_lock(&dq->lock);
+    int ok = dq->bottom - dq->top < POOL_DEQUE_SIZE;
+    if (ok) dq->slots[dq->bottom++ & (POOL_DEQUE_SIZE - 1)] = t;
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+/* 주인: 마지막에 넣은 것부터 (LIFO) */
+static Task *deque_take(WorkDeque *dq) {
+    Task *t = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->top != dq->bottom) t = dq->slots[--dq->bottom & (POOL_DEQUE_SIZE - 1)];
+    pthread_mutex_unlock(&dq->lock);
+    return t;
+}
+
+/* 다른 스레드: 주인과 반대쪽 끝, 가장 오래 기다린 것부터 */
+static Task *deque_steal(WorkDeque *dq) {
+    Task *t = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->top != dq->bottom) t = dq->slots[dq->top++ & (POOL_DEQUE_SIZE - 1)];
+    pthread_mutex_unlock(&dq->lock);
+    return t;
+}
+
+/* 끝난 작업을 완료 스택에 넣고 이벤트 루프를 깨움 */
+static void pool_finish(WorkerPool *pool, Task *t) {
+    Task *head = atomic_load(&pool->done_head);
+    do {
+        t->next = head;
+    } while (!atomic_compare_exchange_weak(&pool->done_head, &head, t));
+
+    uint64_t one = 1;
+    if (write(pool->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("eventfd write");
+}
+
+static void *pool_worker(void *arg) {
+    Worker *self = arg;
+    WorkerPool *pool = self->pool;
+
+    for (;;) {
+        // 일이 없으면 조건 변수에서 잠듦. 깨어나면 작업 하나를 먼저 예약(queued--)하므로
+        // deque 들에는 예약한 스레드 수 이상의 작업이 항상 남아 있어 빈손으로 돌지 않음
+        pthread_mutex_lock(&pool->idle_lock);
+        while (pool->queued == 0) pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        Task *t = NULL;
+        for (int i = 0; !t; i = (i + 1) % pool->nworkers) {
+            WorkDeque *dq = &pool->workers[(self->id + i) % pool->nworkers].dq;
+            t = i == 0 ? deque_take(dq) : deque_steal(dq);
+        }
+
+        t->run(t);
+        pool_finish(pool, t);
+    }
+    return NULL;
+}
+
+/* 작업 스레드 시작 (nworkers <= 0 이면 CPU 수) */
+int pool_start(WorkerPool *pool, int nworkers) {
+    if (nworkers <= 0) nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers <= 0) nworkers = 1;
+    if (nworkers > POOL_MAX_WORKERS) nworkers = POOL_MAX_WORKERS;
+
+    pool->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->efd < 0) { perror("eventfd"); return -1; }
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    atomic_store(&pool->done_head, NULL);
+
+    pool->nworkers = 0;
+    for (int i = 0; i < nworkers; i++) {
+        Worker *w = &pool->workers[i];
+        w->id = i;
+        w->pool = pool;
+        pthread_mutex_init(&w->dq.lock, NULL);
+        if (pthread_create(&w->tid, NULL, pool_worker, w) != 0) {
+            perror("pthread_create worker");
+            break;
+        }
+        pool->nworkers++;
+    }
+    return pool->nworkers > 0 ? 0 : -1;
+}
+
+/* 작업 스레드가 아닌 스레드(방 actor)가 이벤트 루프에서 done 만 실행시킬 때 */
+void pool_post(WorkerPool *pool, Task *t) {
+    t->run = NULL;
+    pool_finish(pool, t);
+}
+
+/* 작업 제출 (이벤트 루프 전용). deque 가 모두 가득 차면 이 자리에서 실행 */
+void pool_submit(WorkerPool *pool, Task *t) {
+    pool->inflight++;
+    for (int i = 0; i < pool->nworkers; i++) {
+        Worker *w = &pool->workers[pool->next++ % pool->nworkers];
+        if (!deque_push(&w->dq, t)) continue;
+
+        pthread_mutex_lock(&pool->idle_lock);
+        pool->queued++;
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+        return;
+    }
+    t->run(t);
+    pool_finish(pool, t);
+}
+
+/* eventfd 가 깨우면: 완료된 작업들의 done 을 끝난 순서대로 실행 */
+void pool_complete(struct ServerContext *server) {
+    WorkerPool *pool = &server->pool;
+    uint64_t count;
+    if (read(pool->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("eventfd read");
+
+    Task *list = atomic_exchange(&pool->done_head, NULL);
+    Task *ordered = NULL;
+    while (list) {
+        Task *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while (ordered) {
+        Task *next = ordered->next;
+        if (ordered->run) pool->inflight--;
+        if (ordered->done) ordered->done(server, ordered);
+        else free(ordered);
+        ordered = next;
+    }
+}
+
+/* 진행 중인 작업이 모두 끝나고 done 까지 처리될 때까지 대기 (핸드오프 직전) */
+void pool_wait_idle(struct ServerContext *server) {
+    WorkerPool *pool = &server->pool;
+    while (pool->inflight > 0) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(pool->efd, &fds);
+        if (select(pool->efd + 1, &fds, NULL, NULL, NULL) < 0 && errno != EINTR) {
+            perror("select pool");
+            return;
+        }
+        pool_complete(server);
+    }
+}
+
 /* 클라이언트 슬롯 초기화 */
 void init_client(ClientContext *c) {
     c->fd = -1;
     memset(c->nickname, 0, MAXNAME);
     memset(c->room, 0, MAXROOM);
     c->registered = 0;
+    c->nick_next = -1;
+    c->want_seq = 0;
+    c->credit_rx = 0;
+    c->fileref_rx = 0;
+    c->credit_carry = 0;
+    c->relay_rx = 0;
+    c->carry_out = c->carry_held = NULL;
+    memset(c->handover_from, 0, MAXROOM);
     memset(c->cmd_buf, 0, MAXBUF);
     c->cmd_len = 0;
     c->file_remain = 0;
+    c->file_size = 0;
+    memset(c->file_name, 0, sizeof(c->file_name));
+    c->file_relay = 0;
+    c->spool_fd = -1;
+    memset(c->spool_part, 0, sizeof(c->spool_part));
+    memset(c->file_claimed, 0, sizeof(c->file_claimed));
+    c->relay_unacked = 0;
+    c->mem_paused = 0;
+    c->mem_shed = 0;
+    memset(c->watch, 0, sizeof(c->watch));
+    c->nwatch = 0;
+
+    static uint64_t next_serial = 1;
+    c->serial = next_serial++;
 }
 
-/* 연결 종료 및 정리 */
-void disconnect_client(ServerContext *server, int idx) {
-    int fd = server->clients[idx].fd;
-    if (fd >= 0) {
-        close(fd);
-        FD_CLR(fd, &server->all_fds);
-        printf("SERVER: Client fd=%d disconnected\n", fd);
+/* FNV-1a 64bit 해시 갱신 (닉네임 버킷, 방 키: 충돌해도 이름을 다시 비교하는 곳에만) */
+uint64_t fnv_update(uint64_t h, const unsigned char *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
     }
-    init_client(&server->clients[idx]);
+    return h;
 }
 
-/* 같은 방의 다른 클라이언트에게 메시지 전송 (브로드캐스트) */
-void broadcast_to_room(ServerContext *server, int sender_idx, const char *data, int len) {
-    ClientContext *sender = &server->clients[sender_idx];
-    
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        ClientContext *target = &server->clients[i];
-        
-        if (target->fd == -1) continue; // 빈 슬롯
-        if (!target->registered) continue; // 입장 전
-        if (strcmp(target->room, sender->room) != 0) continue; // 다른 방
-        if (i == sender_idx) continue;
-        // 자기 자신 및 다른 사람에게 전송 (send 실패 시 로그만)
-        if (send(target->fd, data, len, 0) == -1) {
-            perror("send broadcast");
+/* SHA-256: 업로드 파일 내용 해시. 스풀 파일 이름이자 중복 제거 키이므로 다른 내용으로 같은 해시를
+   만들 수 없어야 함 (FNV 처럼 충돌을 만들 수 있으면 남의 파일 대신 받게 할 수 있음) */
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;               // 지금까지 넣은 바이트
+    unsigned char buf[64];
+    size_t nbuf;
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(Sha256 *s, const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+    uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+void sha256_init(Sha256 *s) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(s->h, iv, sizeof(iv));
+    s->len = 0;
+    s->nbuf = 0;
+}
+
+/* 파일 데이터가 지나가는 대로 누적 */
+void sha256_update(Sha256 *s, const unsigned char *p, size_t n) {
+    s->len += n;
+    if (s->nbuf > 0) {
+        size_t take = 64 - s->nbuf < n ? 64 - s->nbuf : n;
+        memcpy(s->buf + s->nbuf, p, take);
+        s->nbuf += take;
+        p += take;
+        n -= take;
+        if (s->nbuf < 64) return;
+        sha256_block(s, s->buf);
+        s->nbuf = 0;
+    }
+    for (; n >= 64; p += 64, n -= 64) sha256_block(s, p);
+    memcpy(s->buf, p, n);
+    s->nbuf = n;
+}
+
+/* 마무리하고 소문자 16진 문자열로 (out 은 HASHLEN + 1) */
+void sha256_hex(Sha256 *s, char *out) {
+    uint64_t bits = s->len * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t npad = (s->nbuf < 56 ? 56 : 120) - s->nbuf;
+    for (int i = 0; i < 8; i++) pad[npad + i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256_update(s, pad, npad + 8);
+    for (int i = 0; i < 8; i++) snprintf(out + 8 * i, 9, "%08x", s->h[i]);
+}
+
+/* 해시 문자열 형식 검사 (64자리 소문자 16진수) */
+int valid_hash(const char *hex) {
+    if (strlen(hex) != HASHLEN) return 0;
+    for (int i = 0; i < HASHLEN; i++) {
+        if (!((hex[i] >= '0' && hex[i] <= '9') || (hex[i] >= 'a' && hex[i] <= 'f'))) return 0;
+    }
+    return 1;
+}
+
+/* 스풀에 해당 해시/크기의 파일이 있는지 확인 */
+int spool_has(const char *hex, long size) {
+    char path[HASHLEN + 16];
+    struct stat st;
+    snprintf(path, sizeof(path), SPOOL_DIR "/%s", hex);
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == size;
+}
+
+/* 진행 중인 스풀 임시 파일 폐기 (연결 종료, 해시 불일치 등) */
+void spool_abort(ClientContext *c) {
+    if (c->spool_fd >= 0) {
+        close(c->spool_fd);
+        unlink(c->spool_part);
+        c->spool_fd = -1;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * 닉네임 인덱스: 닉네임으로 클라이언트를 O(1)에 찾기 위한 해시 테이블.
+ * /join 에서 등록하고 disconnect_client() 에서 제거한다.
+ * ------------------------------------------------------------------------- */
+unsigned nick_bucket(const char *name) {
+    return (unsigned)fnv_update(FNV_OFFSET, (const unsigned char *)name, strlen(name)) & (NICK_BUCKETS - 1);
+}
+
+void nick_index_init(ServerContext *server) {
+    for (int i = 0; i < NICK_BUCKETS; i++) server->nick_head[i] = -1;
+}
+
+/* 닉네임으로 등록된 클라이언트 인덱스 (-1: 없음) */
+int nick_lookup(ServerContext *server, const char *name) {
+    for (int i = server->nick_head[nick_bucket(name)]; i != -1; i = server->clients[i].nick_next) {
+        if (strcmp(server->clients[i].nickname, name) == 0) return i;
+    }
+    return -1;
+}
+
+void nick_index_add(ServerContext *server, int idx) {
+    unsigned b = nick_bucket(server->clients[idx].nickname);
+    server->clients[idx].nick_next = server->nick_head[b];
+    server->nick_head[b] = idx;
+}
+
+void nick_index_remove(ServerContext *server, int idx) {
+    int *link = &server->nick_head[nick_bucket(server->clients[idx].nickname)];
+    while (*link != -1) {
+        if (*link == idx) {
+            *link = server->clients[idx].nick_next;
+            server->clients[idx].nick_next = -1;
+            return;
         }
+        link = &server->clients[*link].nick_next;
     }
 }
 
-/* 명령어 처리 로직 (/join, /msg, /file) */
-void process_command(ServerContext *server, int idx, char *line) {
-    ClientContext *cli = &server->clients[idx];
-    int fd = cli->fd;
-    char response[MAXBUF];
+/* ---------------------------------------------------------------------------
+ * 재접속 토큰: 닉네임/방을 기억해 두었다가 /resume 으로 복원 (이벤트 루프 전용)
+ * ------------------------------------------------------------------------- */
+
+/* 재접속 토큰 발급 (가장 오래 안 쓴 슬롯 재사용) */
+uint64_t session_create(ServerContext *server, const char *nickname, const char *room) {
+    Session *slot = &server->sessions[0];
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        Session *s = &server->sessions[i];
+        if (s->token && strcmp(s->nickname, nickname) == 0 && strcmp(s->room, room) == 0) {
+            slot = s;
+            break;
+        }
+        if (s->last_used < slot->last_used) slot = s;
+    }
+    if (!slot->token || strcmp(slot->nickname, nickname) != 0 || strcmp(slot->room, room) != 0) {
+        uint64_t token = 0;
+        while (token == 0) {
+            if (getrandom(&token, sizeof(token), 0) != sizeof(token)) token = ((uint64_t)rand() << 32) ^ rand();
+        }
+        memset(slot, 0, sizeof(*slot));
+        slot->token = token;
+        strncpy(slot->nickname, nickname, MAXNAME - 1);
+        strncpy(slot->room, room, MAXROOM - 1);
+    }
+    slot->last_used = time(NULL);
+    return slot->token;
+}
+
+Session *session_find(ServerContext *server, uint64_t token) {
+    if (token == 0) return NULL;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (server->sessions[i].token == token) return &server->sessions[i];
+    }
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * 방 기록 검색 (/search)
+ *
+ * /msg 가 지나갈 때마다 단어별로 (방, 순번) 포스팅을 메모리 세그먼트에 쌓는다.
+ * 일정량이 되면 단어 순으로 정렬해 가변 길이 정수(varint)로 압축한 디스크
+ * 세그먼트로 내리고 mmap 해서 조회한다. 세그먼트가 많아지면 백그라운드 스레드가
+ * 하나로 병합한다. 조회는 단어마다 이진 탐색 + 포스팅 교집합이다.
+ * ------------------------------------------------------------------------- */
+
+/* 메시지를 색인 단어로 분리 (ASCII는 소문자로, UTF-8 한글 등은 그대로 단어 문자) */
+int tokenize(const char *text, char terms[][TERM_MAX], int max) {
+    int n = 0;
+    const unsigned char *p = (const unsigned char *)text;
+    while (*p && n < max) {
+        while (*p && !(isalnum(*p) || *p >= 0x80)) p++;
+        char word[TERM_MAX];
+        int len = 0;
+        while (*p && (isalnum(*p) || *p >= 0x80)) {
+            if (len < TERM_MAX - 1) word[len++] = tolower(*p);
+            p++;
+        }
+        word[len] = '\0';
+        if (len < 2) continue;
+
+        int dup = 0;
+        for (int i = 0; i < n && !dup; i++) dup = strcmp(terms[i], word) == 0;
+        if (!dup) strcpy(terms[n++], word);
+    }
+    return n;
+}
+
+uint32_t room_key(const char *room) {
+    return (uint32_t)fnv_update(FNV_OFFSET, (const unsigned char *)room, strlen(room));
+}
+
+static int varint_put(unsigned char *out, uint64_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        out[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (unsigned char)v;
+    return n;
+}
+
+static uint64_t varint_get(const unsigned char **p, const unsigned char *end) {
+    uint64_t v = 0;
+    int shift = 0;
+    while (*p < end && shift < 64) {
+        unsigned char b = *(*p)++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+        shift += 7;
+    }
+    return v;
+}
+
+static int posting_cmp(const void *a, const void *b) {
+    const Posting *x = a, *y = b;
+    if (x->room != y->room) return x->room < y->room ? -1 : 1;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* 방별로 묶어 인코딩: [varint 방][varint 개수][varint 순번 차이...] 반복. 입력은 정렬되어 있어야 함 */
+static size_t postings_encode(const Posting *post, int n, unsigned char *out) {
+    size_t len = 0;
+    for (int i = 0; i < n;) {
+        int j = i;
+        while (j < n && post[j].room == post[i].room) j++;
+        len += varint_put(out + len, post[i].room);
+        len += varint_put(out + len, j - i);
+        uint64_t prev = 0;
+        for (int k = i; k < j; k++) {
+            len += varint_put(out + len, post[k].seq - prev);
+            prev = post[k].seq;
+        }
+        i = j;
+    }
+    return len;
+}
+
+/* 인코딩된 포스팅 중 room 인 것의 순번만 꺼냄 (room 이 0이면 전부) */
+static int postings_decode(const unsigned char *p, size_t bytes, uint32_t room, Posting *out, int max) {
+    const unsigned char *end = p + bytes;
+    int n = 0;
+    while (p < end && n < max) {
+        uint32_t r = (uint32_t)varint_get(&p, end);
+        uint64_t count = varint_get(&p, end);
+        uint64_t seq = 0;
+        for (uint64_t k = 0; k < count && p < end; k++) {
+            seq += varint_get(&p, end);
+            if ((room == 0 || r == room) && n < max) {
+                out[n].room = r;
+                out[n].seq = seq;
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+/* 세그먼트 작성기: 단어 순서대로 add 하고 finish 에서 디렉터리/헤더 기록 */
+typedef struct {
+    FILE *fp;
+    SegTerm *dir;
+    uint32_t n, cap;
+    uint64_t offset;
+    unsigned char *enc;
+    size_t enc_cap;
+} SegWriter;
+
+static int seg_writer_open(SegWriter *w, const char *path) {
+    memset(w, 0, sizeof(*w));
+    w->fp = fopen(path, "wb");
+    if (!w->fp) return -1;
+    SegHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    fwrite(&hdr, sizeof(hdr), 1, w->fp);
+    w->offset = sizeof(hdr);
+    return 0;
+}
+
+static int seg_writer_add(SegWriter *w, const char *term, const Posting *post, int n) {
+    size_t need = (size_t)n * 20 + 16;   // 포스팅 하나당 최대 varint 2~3개
+    if (need > w->enc_cap) {
+        unsigned char *e = realloc(w->enc, need);
+        if (!e) return -1;
+        w->enc = e;
+        w->enc_cap = need;
+    }
+    if (w->n == w->cap) {
+        uint32_t ncap = w->cap ? w->cap * 2 : 1024;
+        SegTerm *d = realloc(w->dir, ncap * sizeof(SegTerm));
+        if (!d) return -1;
+        w->dir = d;
+        w->cap = ncap;
+    }
+
+    size_t len = postings_encode(post, n, w->enc);
+    SegTerm *t = &w->dir[w->n++];
+    memset(t, 0, sizeof(*t));
+    strncpy(t->term, term, TERM_MAX - 1);
+    t->offset = w->offset;
+    t->bytes = len;
+    t->count = n;
+    fwrite(w->enc, 1, len, w->fp);
+    w->offset += len;
+    return 0;
+}
+
+static int seg_writer_finish(SegWriter *w) {
+    SegHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.nterms = w->n;
+    hdr.dir_offset = w->offset;
+
+    int ok = fwrite(w->dir, sizeof(SegTerm), w->n, w->fp) == w->n;
+    ok = ok && fseek(w->fp, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, w->fp) == 1;
+    ok = (fclose(w->fp) == 0) && ok;
+    free(w->dir);
+    free(w->enc);
+    return ok ? 0 : -1;
+}
+
+/* 세그먼트 파일을 mmap 으로 열기 */
+static Segment *segment_open(const char *path, int gen) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(SegHeader)) { close(fd); return NULL; }
+
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const SegHeader *hdr = (const SegHeader *)map;
+    if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->dir_offset + (uint64_t)hdr->nterms * sizeof(SegTerm) > (uint64_t)st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    Segment *seg = calloc(1, sizeof(Segment));
+    if (!seg) { munmap(map, st.st_size); return NULL; }
+    seg->gen = gen;
+    snprintf(seg->path, sizeof(seg->path), "%s", path);
+    seg->map = map;
+    seg->size = st.st_size;
+    seg->nterms = hdr->nterms;
+    seg->terms = (const SegTerm *)(map + hdr->dir_offset);
+    return seg;
+}
+
+static void segment_close(Segment *seg, int remove_file) {
+    munmap(seg->map, seg->size);
+    if (remove_file) unlink(seg->path);
+    free(seg);
+}
+
+/* 단어 이진 탐색 */
+static const SegTerm *segment_find(const Segment *seg, const char *term) {
+    int lo = 0, hi = (int)seg->nterms - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = strncmp(seg->terms[mid].term, term, TERM_MAX);
+        if (c == 0) return &seg->terms[mid];
+        if (c < 0) lo = mid + 1; else hi = mid - 1;
+    }
+    return NULL;
+}
+
+void index_init(SearchIndex *ix, WorkerPool *pool) {
+    memset(ix, 0, sizeof(*ix));
+    ix->pool = pool;
+    ix->active = calloc(1, sizeof(TermTable));
+    mkdir(INDEX_DIR, 0755);
+
+    // 이전 실행에서 남긴 세그먼트 불러오기 (기록/병합 중 죽어 남은 임시 파일은 삭제)
+    DIR *dir = opendir(INDEX_DIR);
+    if (!dir) return;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        char path[300];
+        int gen;
+        char tail[8];
+        snprintf(path, sizeof(path), INDEX_DIR "/%s", de->d_name);
+        if (strstr(de->d_name, ".tmp")) {
+            unlink(path);
+        } else if (sscanf(de->d_name, "seg-%d.id%1s", &gen, tail) == 2 && ix->nsegs < MAX_SEGMENTS) {
+            Segment *seg = segment_open(path, gen);
+            if (seg) ix->segs[ix->nsegs++] = seg;
+            if (gen >= ix->next_gen) ix->next_gen = gen + 1;
+        }
+    }
+    closedir(dir);
+}
+
+static void term_table_free(TermTable *table) {
+    for (int b = 0; b < ACTIVE_BUCKETS; b++) {
+        ActiveTerm *t = table->buckets[b];
+        while (t) {
+            ActiveTerm *next = t->next;
+            free(t->post);
+            free(t);
+            t = next;
+        }
+    }
+    free(table);
+}
+
+static int active_term_cmp(const void *a, const void *b) {
+    return strcmp((*(ActiveTerm *const *)a)->term, (*(ActiveTerm *const *)b)->term);
+}
+
+/* 색인 작업 (작업 스레드에서 실행, 결과는 done 에서 목록에 반영) */
+typedef struct IndexTask {
+    Task base;
+    TermTable *table;           // 기록할 메모리 세그먼트 (작업 중에는 읽기만 함)
+    Segment *in[MAX_SEGMENTS];  // 병합할 디스크 세그먼트
+    int k;
+    int gen;                    // 만들 세그먼트 세대
+    Segment *out;               // 만들어진 세그먼트 (실패하면 NULL)
+    struct IndexTask *next;     // SearchIndex.waiting 연결
+} IndexTask;
+
+static void index_maybe_merge(SearchIndex *ix);
+
+/* 작업 스레드: 얼린 메모리 세그먼트를 단어 순으로 정렬/압축해 디스크 세그먼트로 기록 */
+static void index_flush_run(Task *task) {
+    IndexTask *it = (IndexTask *)task;
+    TermTable *table = it->table;
+
+    int nterms = 0;
+    for (int b = 0; b < ACTIVE_BUCKETS; b++)
+        for (ActiveTerm *t = table->buckets[b]; t; t = t->next) nterms++;
+    ActiveTerm **sorted = malloc(sizeof(ActiveTerm *) * (nterms + 1));
+    if (!sorted) return;
+    int k = 0;
+    for (int b = 0; b < ACTIVE_BUCKETS; b++)
+        for (ActiveTerm *t = table->buckets[b]; t; t = t->next) sorted[k++] = t;
+    qsort(sorted, nterms, sizeof(ActiveTerm *), active_term_cmp);
+
+    char path[64], tmp[72];
+    snprintf(path, sizeof(path), INDEX_DIR "/seg-%d.idx", it->gen);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    // 이벤트 루프가 같은 포스팅을 검색에 쓰고 있으므로 복사본을 정렬
+    Posting *buf = NULL;
+    int buf_cap = 0;
+    SegWriter w;
+    int ok = seg_writer_open(&w, tmp) == 0;
+    for (int i = 0; ok && i < nterms; i++) {
+        if (sorted[i]->n > buf_cap) {
+            Posting *nb = realloc(buf, sorted[i]->n * sizeof(Posting));
+            if (!nb) { ok = 0; break; }
+            buf = nb;
+            buf_cap = sorted[i]->n;
+        }
+        memcpy(buf, sorted[i]->post, sorted[i]->n * sizeof(Posting));
+        qsort(buf, sorted[i]->n, sizeof(Posting), posting_cmp);
+        ok = seg_writer_add(&w, sorted[i]->term, buf, sorted[i]->n) == 0;
+    }
+    if (w.fp) ok = seg_writer_finish(&w) == 0 && ok;
+    free(buf);
+    free(sorted);
+
+    it->out = (ok && rename(tmp, path) == 0) ? segment_open(path, it->gen) : NULL;
+    if (!it->out) {
+        perror("index flush");
+        unlink(tmp);
+    }
+}
+
+/* 기록이 끝난 디스크 세그먼트를 목록에 넣고 같은 내용의 메모리 세그먼트를 버림 */
+static void index_install(SearchIndex *ix, IndexTask *it) {
+    ix->segs[ix->nsegs++] = it->out;
+    TermTable **link = &ix->frozen;
+    while (*link && *link != it->table) link = &(*link)->next;
+    if (*link) *link = it->table->next;
+    term_table_free(it->table);
+    free(it);
+}
+
+/* 이벤트 루프: 기록이 끝난 메모리 세그먼트를 디스크 세그먼트로 교체. 목록이 가득 차 있으면
+   병합이 자리를 만들 때까지 미뤄 둠 (그동안 검색은 메모리 세그먼트에서) */
+static void index_flush_done(ServerContext *server, Task *task) {
+    IndexTask *it = (IndexTask *)task;
+    SearchIndex *ix = &server->index;
+
+    if (!it->out) {
+        free(it);                   // 기록 실패: 메모리 세그먼트에 남겨 검색은 계속 됨
+    } else if (ix->nsegs < MAX_SEGMENTS && !ix->waiting) {
+        index_install(ix, it);
+    } else {
+        IndexTask **link = &ix->waiting;
+        while (*link) link = &(*link)->next;
+        it->next = NULL;
+        *link = it;
+    }
+    index_maybe_merge(ix);
+}
+
+/* 메모리 세그먼트를 얼리고 디스크 기록을 작업 스레드에 맡김 (검색은 완료 전까지 메모리에서) */
+void index_flush(SearchIndex *ix) {
+    if (!ix->active || ix->active->postings == 0) return;
+    TermTable *fresh = calloc(1, sizeof(TermTable));
+    IndexTask *it = calloc(1, sizeof(IndexTask));
+    if (!fresh || !it) { free(fresh); free(it); return; }
+
+    it->base.run = index_flush_run;
+    it->base.done = index_flush_done;
+    it->table = ix->active;
+    it->gen = ix->next_gen++;
+
+    ix->active->next = ix->frozen;
+    ix->frozen = ix->active;
+    ix->active = fresh;
+    pool_submit(ix->pool, &it->base);
+}
+
+/* 작업 스레드: 제출 시점의 세그먼트들을 단어 순 k-way 병합으로 하나로 합침 */
+static void index_merge_run(Task *task) {
+    IndexTask *it = (IndexTask *)task;
+    Segment **in = it->in;
+    int k = it->k;
+
+    char path[64], tmp[72];
+    snprintf(path, sizeof(path), INDEX_DIR "/seg-%d.idx", it->gen);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    uint32_t pos[MAX_SEGMENTS] = { 0 };
+    Posting *buf = NULL;
+    size_t buf_cap = 0;
+    SegWriter w;
+    int ok = seg_writer_open(&w, tmp) == 0;
+
+    while (ok) {
+        // 모든 세그먼트의 현재 단어 중 가장 작은 것
+        const char *min = NULL;
+        for (int i = 0; i < k; i++) {
+            if (pos[i] >= in[i]->nterms) continue;
+            const char *t = in[i]->terms[pos[i]].term;
+            if (!min || strncmp(t, min, TERM_MAX) < 0) min = t;
+        }
+        if (!min) break;
+
+        char term[TERM_MAX];
+        snprintf(term, sizeof(term), "%.*s", TERM_MAX - 1, min);
+        size_t total = 0;
+        for (int i = 0; i < k; i++) {
+            if (pos[i] < in[i]->nterms && strncmp(in[i]->terms[pos[i]].term, term, TERM_MAX) == 0)
+                total += in[i]->terms[pos[i]].count;
+        }
+        if (total > buf_cap) {
+            Posting *nb = realloc(buf, total * sizeof(Posting));
+            if (!nb) { ok = 0; break; }
+            buf = nb;
+            buf_cap = total;
+        }
+
+        int n = 0;
+        for (int i = 0; i < k; i++) {
+            if (pos[i] >= in[i]->nterms) continue;
+            const SegTerm *t = &in[i]->terms[pos[i]];
+            if (strncmp(t->term, term, TERM_MAX) != 0) continue;
+            n += postings_decode(in[i]->map + t->offset, t->bytes, 0, buf + n, total - n);
+            pos[i]++;
+        }
+        qsort(buf, n, sizeof(Posting), posting_cmp);
+        ok = seg_writer_add(&w, term, buf, n) == 0;
+    }
+    if (w.fp) ok = seg_writer_finish(&w) == 0 && ok;
+    free(buf);
+
+    it->out = (ok && rename(tmp, path) == 0) ? segment_open(path, it->gen) : NULL;
+    if (!it->out) unlink(tmp);
+}
+
+/* 이벤트 루프: 병합한 세그먼트들을 새 세그먼트로 교체 (병합 중 추가된 세그먼트는 유지) */
+static void index_merge_done(ServerContext *server, Task *task) {
+    IndexTask *it = (IndexTask *)task;
+    SearchIndex *ix = &server->index;
+
+    if (it->out) {
+        ix->segs[0] = it->out;
+        memmove(&ix->segs[1], &ix->segs[it->k], sizeof(Segment *) * (ix->nsegs - it->k));
+        ix->nsegs = ix->nsegs - it->k + 1;
+        for (int i = 0; i < it->k; i++) segment_close(it->in[i], 1);
+
+        // 자리가 났으니 미뤄 둔 세그먼트부터 넣음 (남으면 다음 병합 뒤에)
+        while (ix->waiting && ix->nsegs < MAX_SEGMENTS) {
+            IndexTask *w = ix->waiting;
+            ix->waiting = w->next;
+            index_install(ix, w);
+        }
+    }
+    ix->merging = 0;
+    free(it);
+    index_maybe_merge(ix);
+}
+
+/* 세그먼트가 많으면 병합을 작업 스레드에 맡김 (한 번에 하나만) */
+static void index_maybe_merge(SearchIndex *ix) {
+    if (ix->merging || ix->nsegs <= SEG_MERGE_FANIN) return;
+    IndexTask *it = calloc(1, sizeof(IndexTask));
+    if (!it) return;
+
+    it->base.run = index_merge_run;
+    it->base.done = index_merge_done;
+    it->k = ix->nsegs;
+    memcpy(it->in, ix->segs, sizeof(Segment *) * it->k);
+    it->gen = ix->next_gen++;
+    ix->merging = 1;
+    pool_submit(ix->pool, &it->base);
+}
+
+/* 방 메시지 하나를 색인에 추가 */
+void index_add(SearchIndex *ix, const char *room, uint64_t seq, const char *text) {
+    char terms[64][TERM_MAX];
+    int n = tokenize(text, terms, 64);
+    uint32_t key = room_key(room);
+    if (!ix->active) return;
+
+    for (int i = 0; i < n; i++) {
+        unsigned b = nick_bucket(terms[i]) & (ACTIVE_BUCKETS - 1);
+        ActiveTerm *t = ix->active->buckets[b];
+        while (t && strcmp(t->term, terms[i]) != 0) t = t->next;
+        if (!t) {
+            t = calloc(1, sizeof(ActiveTerm));
+            if (!t) return;
+            strcpy(t->term, terms[i]);
+            t->next = ix->active->buckets[b];
+            ix->active->buckets[b] = t;
+        }
+        if (t->n == t->cap) {
+            int ncap = t->cap ? t->cap * 2 : 4;
+            Posting *np = realloc(t->post, ncap * sizeof(Posting));
+            if (!np) return;
+            t->post = np;
+            t->cap = ncap;
+        }
+        t->post[t->n].room = key;
+        t->post[t->n].seq = seq;
+        t->n++;
+        ix->active->postings++;
+    }
+
+    if (ix->active->postings >= SEG_FLUSH_POSTINGS) index_flush(ix);
+}
+
+static int seq_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int seqs_reserve(uint64_t **seqs, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t ncap = need * 2;
+    uint64_t *ns = realloc(*seqs, sizeof(uint64_t) * ncap);
+    if (!ns) return -1;
+    *seqs = ns;
+    *cap = ncap;
+    return 0;
+}
+
+/* 메모리 세그먼트 하나에서 room 의 순번 모으기 */
+static void table_lookup(TermTable *table, const char *term, uint32_t room, uint64_t **seqs, size_t *n, size_t *cap) {
+    unsigned b = nick_bucket(term) & (ACTIVE_BUCKETS - 1);
+    for (ActiveTerm *t = table->buckets[b]; t; t = t->next) {
+        if (strcmp(t->term, term) != 0) continue;
+        if (seqs_reserve(seqs, cap, *n + t->n) < 0) return;
+        for (int i = 0; i < t->n; i++) {
+            if (t->post[i].room == room) (*seqs)[(*n)++] = t->post[i].seq;
+        }
+        return;
+    }
+}
+
+/* 한 단어가 나온 방 메시지 순번들 (정렬, 중복 제거). 개수 반환, *out 은 호출자가 free */
+static int index_lookup(SearchIndex *ix, const char *term, uint32_t room, uint64_t **out) {
+    size_t cap = 0, n = 0;
+    uint64_t *seqs = NULL;
+
+    // 메모리 세그먼트 (쓰는 중인 것 + 디스크 기록을 기다리는 것)
+    if (ix->active) table_lookup(ix->active, term, room, &seqs, &n, &cap);
+    for (TermTable *t = ix->frozen; t; t = t->next) table_lookup(t, term, room, &seqs, &n, &cap);
+
+    // 디스크 세그먼트 (목록은 이벤트 루프에서만 바뀌므로 잠금 없음)
+    for (int i = 0; i < ix->nsegs; i++) {
+        const SegTerm *t = segment_find(ix->segs[i], term);
+        if (!t) continue;
+        Posting *tmp = malloc(sizeof(Posting) * t->count);
+        if (!tmp) continue;
+        int m = postings_decode(ix->segs[i]->map + t->offset, t->bytes, room, tmp, t->count);
+        if (seqs_reserve(&seqs, &cap, n + m) == 0) {
+            for (int j = 0; j < m; j++) seqs[n++] = tmp[j].seq;
+        }
+        free(tmp);
+    }
+
+    if (n > 1) {
+        qsort(seqs, n, sizeof(uint64_t), seq_cmp);
+        size_t u = 1;
+        for (size_t i = 1; i < n; i++) if (seqs[i] != seqs[u - 1]) seqs[u++] = seqs[i];
+        n = u;
+    }
+    *out = seqs;
+    return (int)n;
+}
+
+/* 방 스레드가 순번을 붙인 메시지를 이벤트 루프에 색인 요청 (pool_post 로 전달) */
+typedef struct {
+    Task base;
+    uint64_t seq;
+    char room[MAXROOM];
+    char text[];
+} IndexNote;
+
+static void index_note_done(ServerContext *server, Task *task) {
+    IndexNote *note = (IndexNote *)task;
+    index_add(&server->index, note->room, note->seq, note->text);
+    free(note);
+}
+
+/* 방 스레드가 중계 데이터를 가장 느린 수신자까지 보냈다는 확인 (pool_post 로 전달) */
+typedef struct {
+    Task base;
+    int idx;
+    uint64_t serial;
+    long bytes;
+} RelayAck;
+
+/* 지켜보는 방의 메시지 (pool_post 로 전달). 이벤트 루프가 받는 연결이 입장한 방 actor 에 넘겨
+   보내게 함: 한 소켓에 쓰는 스레드를 그 actor 하나로 두어야 줄이나 파일 데이터 사이에 섞이지 않음 */
+typedef struct {
+    Task base;
+    int idx;
+    uint64_t serial;
+    size_t len;
+    char data[];
+} WatchNote;
+
+static void watch_note_done(ServerContext *server, Task *task);
+
+/* 방을 옮긴 연결의 앞 방에서 못 보낸 출력 (pool_post 로 전달). 이벤트 루프가 새 방 actor 에 넘김 */
+typedef struct {
+    Task base;
+    int idx;
+    uint64_t serial;
+    OutChunk *chunks;
+} HandoverNote;
+
+static void handover_done(ServerContext *server, Task *task);
+
+/* 창 아래로 내려가면 업로더 소켓을 다시 읽기 시작 */
+static void relay_ack_done(ServerContext *server, Task *task) {
+    RelayAck *ack = (RelayAck *)task;
+    ClientContext *cli = &server->clients[ack->idx];
+    if (cli->fd >= 0 && cli->serial == ack->serial) {
+        cli->relay_unacked -= ack->bytes;
+        if (cli->relay_unacked < 0) cli->relay_unacked = 0;
+        if (cli->relay_unacked < server->relay_window && !cli->mem_paused) FD_SET(cli->fd, &server->all_fds);
+    }
+    free(ack);
+}
+
+/* ---------------------------------------------------------------------------
+ * 메모리 사용량과 예산
+ *
+ * 연결이 늘어날수록 커지는 버퍼는 모두 방 스레드에 있다: 참여자별 출력 대기열(OutChunk),
+ * 파일 중계 중 미뤄 둔 방 메시지, 방별 최근 기록. 방 스레드는 할당/해제할 때마다 전체,
+ * 방, (출력 대기열이면) 연결 카운터를 함께 바꾸고, 이벤트 루프는 읽기만 한다.
+ * 출력 대기열과 미룬 메시지의 합계가 예산의 MEM_PAUSE_PCT 를 넘으면 중계 파일 데이터 읽기부터
+ * 멈추고 (1단계), 예산을 넘으면 가장 많이 쌓인 연결부터 끊는다 (2단계, mem_enforce).
+ * 최근 기록은 방마다 ROOM_HISTORY 줄로 이미 한정되고 연결을 끊어도 줄지 않으므로 /stats mem 에
+ * 보여 주기만 하고 예산에는 넣지 않는다 (넣으면 기록만으로 예산을 넘었을 때 애먼 연결을 끊음).
+ * ------------------------------------------------------------------------- */
+static atomic_long mem_queued;  // 참여자 출력 대기열
+static atomic_long mem_held;    // 미뤄 둔 방 메시지
+static atomic_long mem_hist;    // 방별 최근 기록
+
+static void mem_add(atomic_long *local, atomic_long *total, long delta) {
+    atomic_fetch_add_explicit(local, delta, memory_order_relaxed);
+    atomic_fetch_add_explicit(total, delta, memory_order_relaxed);
+}
+
+/* 예산에 넣는 사용량 (줄이거나 끊어서 되돌릴 수 있는 것만) */
+static long mem_total(void) {
+    return atomic_load_explicit(&mem_queued, memory_order_relaxed) +
+           atomic_load_explicit(&mem_held, memory_order_relaxed);
+}
+
+/* 0: 여유, 1: 파일 데이터 읽기 중단, 2: 느린 연결 끊기 */
+static int mem_level(const ServerContext *server) {
+    if (server->mem_budget <= 0) return 0;
+    long used = mem_total();
+    if (used >= server->mem_budget) return 2;
+    if (used >= server->mem_budget / 100 * MEM_PAUSE_PCT) return 1;
+    return 0;
+}
+
+static const char *mem_level_name(int level) {
+    return level == 2 ? "shed" : level == 1 ? "pause" : "ok";
+}
+
+/* ---------------------------------------------------------------------------
+ * 방 actor
+ *
+ * 방마다 순번, 최근 기록, 로그 파일, 참여자 목록(Room)을 가진 actor 가 하나 있고,
+ * 방 이름 해시로 정해진 방 스레드 하나만 그 상태를 만진다. 이벤트 루프는 명령을
+ * 해석한 뒤 RoomMsg 를 방의 MPSC 우편함에 넣기만 하고, 전송(fan-out), 순번 부여,
+ * 기록, 재접속 재전송, 검색 결과 조회는 모두 주인 스레드가 한다. 방 상태는 공유하지
+ * 않으므로 잠금이 없다. 참여자 소켓은 dup() 한 것을 actor 가 따로 가진다.
+ *
+ * 방 순번과 재접속 (resume)
+ * 방으로 가는 메시지(/msg, FILEREF)마다 방별로 1씩 증가하는 순번을 붙이고,
+ * 최근 ROOM_HISTORY 개는 메모리에, 전체는 history/ 로그에 남긴다.
+ * 재접속한 클라이언트가 마지막으로 본 순번을 알려주면 그 이후 메시지만
+ * 모아서 한 번에 보낸다.
+ * ------------------------------------------------------------------------- */
+
+static long long mono_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* 참여자 소켓에 블록하지 않고 보냄. 크레딧 수신자에게 중계 데이터는 허락받은 만큼만.
+   보낸 바이트 수 (더 못 보내면 0, 끊긴 소켓이면 -1) */
+static ssize_t member_write(RoomMember *m, const char *data, size_t len, int relay) {
+    if (relay && m->credit_mode && (long)len > m->credit) len = m->credit;
+    if (len == 0) return 0;
+    for (;;) {
+        ssize_t n = send(m->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n >= 0) {
+            if (relay && m->credit_mode) m->credit -= n;
+            return n;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno != EPIPE && errno != ECONNRESET) perror("send room");
+        return -1;
+    }
+}
+
+/* 대기열에서 조각이 차지하는 메모리 (파일 조각은 내용을 들고 있지 않음) */
+static long chunk_cost(const OutChunk *c) {
+    return sizeof(OutChunk) + (c->file_fd >= 0 ? 0 : c->len);
+}
+
+static void chunk_free(OutChunk *c) {
+    if (c->file_fd >= 0) close(c->file_fd);
+    free(c);
+}
+
+/* 참여자 출력 대기열 메모리: 방과 연결 양쪽에 더함 */
+static void member_charge(RoomMember *m, long delta) {
+    mem_add(m->room_mem, &mem_queued, delta);
+    if (m->conn_mem) atomic_fetch_add_explicit(m->conn_mem, delta, memory_order_relaxed);
+}
+
+/* 대기열을 떼어 냄 (메모리도 함께 뺌). 떼어 낸 목록 반환 */
+static OutChunk *member_take_output(RoomMember *m) {
+    OutChunk *head = m->out_head;
+    for (OutChunk *c = head; c; c = c->next) member_charge(m, -chunk_cost(c));
+    m->out_head = m->out_tail = NULL;
+    m->out_bytes = 0;
+    return head;
+}
+
+/* 대기열과 중계 뒤로 미룬 출력을 모두 버림 */
+static void member_drop_output(RoomMember *m) {
+    OutChunk *c = member_take_output(m);
+    while (c) {
+        OutChunk *next = c->next;
+        chunk_free(c);
+        c = next;
+    }
+    while (m->held_head) {
+        c = m->held_head;
+        m->held_head = c->next;
+        member_charge(m, -chunk_cost(c));
+        chunk_free(c);
+    }
+    m->held_tail = NULL;
+}
+
+/* 조각 하나를 대기열 끝에 */
+static void member_enqueue(RoomMember *m, OutChunk *c) {
+    c->next = NULL;
+    member_charge(m, chunk_cost(c));
+    if (m->out_tail) m->out_tail->next = c;
+    else m->out_head = c;
+    m->out_tail = c;
+    m->out_bytes += c->len - c->off;
+}
+
+/* 중계를 받는 동안 온 다른 출력: 중계가 끝날 때까지 따로 둠 */
+static void member_hold(RoomMember *m, OutChunk *c) {
+    c->next = NULL;
+    member_charge(m, chunk_cost(c));
+    if (m->held_tail) m->held_tail->next = c;
+    else m->held_head = c;
+    m->held_tail = c;
+}
+
+/* 받던 중계가 끝남: 미뤄 둔 출력을 대기열 뒤로 */
+static void member_relay_done(RoomMember *m) {
+    m->in_relay = 0;
+    if (!m->held_head) return;
+    if (!m->out_head) m->out_progress = mono_ms();
+    while (m->held_head) {
+        OutChunk *c = m->held_head;
+        m->held_head = c->next;
+        member_charge(m, -chunk_cost(c));
+        member_enqueue(m, c);
+    }
+    m->held_tail = NULL;
+}
+
+/* 파일 조각 보내기: 읽은 만큼 블록하지 않고 보내고, 못 보낸 부분은 다음에 다시 읽음 */
+static ssize_t member_write_file(RoomMember *m, OutChunk *c) {
+    char buf[65536];
+    size_t want = c->len - c->off < sizeof(buf) ? c->len - c->off : sizeof(buf);
+    ssize_t r = pread(c->file_fd, buf, want, c->off);
+    if (r <= 0) {
+        if (r < 0) perror("fetch read");
+        return -1;
+    }
+    return member_write(m, buf, r, 0);
+}
+
+/* 참여자에게 전송: 앞에 쌓인 것이 없으면 바로 보내고, 못 보낸 나머지는 순서대로 쌓음.
+   중계를 받는 중이면 중계가 아닌 출력은 중계가 끝날 때까지 미룸 (나가는 중이면 버림) */
+static void member_send(RoomMember *m, const char *data, size_t len, int relay) {
+    if (len == 0 || m->dead || (m->leaving && !relay)) return;
+    int hold = m->in_relay && !relay;
+    if (!hold && !m->out_head && !m->parked) {
+        ssize_t n = member_write(m, data, len, relay);
+        if (n < 0) { m->dead = 1; return; }   // 끊김: 이벤트 루프가 EOF 를 보고 LEAVE 를 보냄
+        data += n;
+        len -= n;
+        if (len == 0) return;
+        m->out_progress = mono_ms();
+    }
+
+    OutChunk *c = malloc(sizeof(OutChunk) + len);
+    if (!c) { perror("room output"); return; }
+    c->len = len;
+    c->off = 0;
+    c->relay = relay;
+    c->file_fd = -1;
+    memcpy(c->data, data, len);
+    if (hold) member_hold(m, c);
+    else member_enqueue(m, c);
+}
+
+/* 파일 내용을 대기열에 (fd 는 대기열이 가짐). 실제 전송은 member_flush 에서 */
+static void member_send_file(RoomMember *m, int fd, size_t size) {
+    OutChunk *c = (!m->dead && !m->leaving && size > 0) ? malloc(sizeof(OutChunk)) : NULL;
+    if (!c) { close(fd); return; }
+    c->len = size;
+    c->off = 0;
+    c->relay = 0;
+    c->file_fd = fd;
+    if (m->in_relay) {
+        member_hold(m, c);
+        return;
+    }
+    if (!m->out_head) m->out_progress = mono_ms();
+    member_enqueue(m, c);
+}
+
+/* 쌓인 출력을 소켓이 받는 만큼 보냄 */
+static void member_flush(RoomMember *m, long long now) {
+    while (m->out_head && !m->parked) {
+        OutChunk *c = m->out_head;
+        ssize_t n = c->file_fd >= 0 ? member_write_file(m, c)
+                                    : member_write(m, c->data + c->off, c->len - c->off, c->relay);
+        if (n < 0) {
+            m->dead = 1;
+            member_drop_output(m);
+            return;
+        }
+        if (n == 0) return;
+        c->off += n;
+        m->out_bytes -= n;
+        m->out_progress = now;
+        if (c->off < c->len) continue;
+        m->out_head = c->next;
+        if (!m->out_head) m->out_tail = NULL;
+        member_charge(m, -chunk_cost(c));
+        chunk_free(c);
+    }
+}
+
+/* 너무 오래 못 받은 참여자 떼어내기: 파일 스트림 중간이라 이어 보낼 방법이 없으므로 연결을 끊음.
+   (클라이언트는 /resume 으로 다시 들어올 수 있고, 참여자 정리는 이벤트 루프의 LEAVE 에서) */
+static void member_detach(Room *room, RoomMember *m) {
+    if (m->dead) return;
+    evlog(EV_SLOW_DETACH, m->fd, (int64_t)m->out_bytes, m->nickname, room->name);
+    shutdown(m->fd, SHUT_RDWR);
+    member_drop_output(m);
+    m->dead = 1;
+}
+
+/* 업로더 확인 대기분 중 keep 바이트만 남기고 이벤트 루프로 돌려줌 */
+static void relay_ack(ActorRuntime *rt, Room *room, long keep) {
+    RelayAck *ack = calloc(1, sizeof(RelayAck));
+    if (!ack) return;
+    ack->base.done = relay_ack_done;
+    ack->idx = room->relay_idx;
+    ack->serial = room->relay_serial;
+    ack->bytes = room->relay_pending - keep;
+    room->relay_pending = keep;
+    pool_post(rt->pool, &ack->base);
+}
+
+/* 가장 느린 (떼어내지 않은) 수신자에게 쌓인 양만 남기고 나머지를 업로더에게 확인 */
+static void relay_release(ActorRuntime *rt, Room *room) {
+    if (room->relay_pending == 0) return;
+    long behind = 0;
+    for (RoomMember *m = room->members; m; m = m->next) {
+        if (!m->dead && m->serial != room->relay_serial && (long)m->out_bytes > behind) behind = m->out_bytes;
+    }
+    if (behind < room->relay_pending) relay_ack(rt, room, behind);
+}
+
+/* 밀린 출력 보내기 + 멈춘 참여자 떼어내기 + 업로더 확인. 아직 밀린 참여자가 있으면 1 */
+static int room_flush(ActorRuntime *rt, Room *room) {
+    long long now = mono_ms();
+    int stalled = 0;
+    for (RoomMember *m = room->members; m; m = m->next) {
+        if (!m->out_head || m->parked) continue;   // 넘겨받을 출력을 기다리는 참여자는 HANDOVER 로 깨어남
+        member_flush(m, now);
+        if (m->out_head && m->out_head->relay && m->credit_mode && m->credit <= 0) {
+            // 크레딧을 기다리는 중: 수신자가 멈춰 둔 것이므로 (자기 업로드가 끝나야 /credit 을 보내는 GUI 등)
+            // 느린 것으로 치지 않음
+            m->out_progress = now;
+        } else if (m->out_head && rt->relay_lag_ms > 0 && now - m->out_progress > rt->relay_lag_ms) {
+            member_detach(room, m);
+        }
+        if (m->out_head) stalled = 1;
+    }
+    relay_release(rt, room);
+    return stalled;
+}
+
+/* 방 이름을 파일 이름으로 안전하게 쓰기 위해 16진수로 변환 */
+void room_file_path(const char *name, const char *ext, char *path, size_t size) {
+    int len = snprintf(path, size, HISTORY_DIR "/");
+    for (const unsigned char *p = (const unsigned char *)name; *p && len + 3 < (int)size; p++) {
+        len += snprintf(path + len, size - len, "%02x", *p);
+    }
+    snprintf(path + len, size - len, "%s", ext);
+}
+
+/* 오프셋 색인 열기. 로그와 개수가 맞지 않으면(이전 버전 로그, 비정상 종료) 로그를 훑어 다시 만듦 */
+FILE *room_open_offsets(Room *room, const char *path) {
+    FILE *idx = fopen(path, "a+");
+    if (!idx || !room->log) return idx;
+
+    fseek(idx, 0, SEEK_END);
+    if ((uint64_t)ftell(idx) == room->seq * sizeof(uint64_t)) return idx;
+
+    fclose(idx);
+    idx = fopen(path, "w+");
+    if (!idx) return NULL;
+
+    char line[MAXBUF + 32];
+    fseek(room->log, 0, SEEK_SET);
+    for (;;) {
+        uint64_t off = ftell(room->log);
+        if (!fgets(line, sizeof(line), room->log)) break;
+        fwrite(&off, sizeof(off), 1, idx);
+    }
+    fseek(room->log, 0, SEEK_END);
+    fflush(idx);
+    return idx;
+}
+
+/* 로그 읽기 위치를 해당 순번의 줄로 이동 (색인이 없으면 처음부터) */
+void room_seek_seq(Room *room, uint64_t seq) {
+    uint64_t off = 0;
+    fflush(room->log);
+    if (room->idx && seq > 0) {
+        fflush(room->idx);
+        if (fseek(room->idx, (seq - 1) * sizeof(uint64_t), SEEK_SET) < 0 ||
+            fread(&off, sizeof(off), 1, room->idx) != 1) {
+            off = 0;
+        }
+        fseek(room->idx, 0, SEEK_END);
+    }
+    fseek(room->log, off, SEEK_SET);
+}
+
+/* 메모리에 남아 있는 가장 오래된 순번 */
+uint64_t room_mem_from(Room *room) {
+    uint64_t mem_from = room->seq > ROOM_HISTORY ? room->seq - ROOM_HISTORY + 1 : 1;
+    return mem_from < room->hist_from ? room->hist_from : mem_from;
+}
+
+/* 순번으로 메시지 한 줄 가져오기 (메모리 → 로그 순). 개행 포함, 없으면 0 */
+int room_fetch(Room *room, uint64_t seq, char *out, size_t size) {
+    if (seq == 0 || seq > room->seq) return 0;
+    if (seq >= room_mem_from(room)) {
+        const char *h = room->hist[seq % ROOM_HISTORY];
+        if (!h) return 0;
+        snprintf(out, size, "%s", h);
+        return 1;
+    }
+    if (!room->log) return 0;
+
+    char line[MAXBUF + 32];
+    int found = 0;
+    room_seek_seq(room, seq);
+    while (fgets(line, sizeof(line), room->log)) {
+        char *end;
+        uint64_t s = strtoull(line, &end, 10);
+        if (s < seq || *end != ' ') continue;
+        if (s == seq) {
+            snprintf(out, size, "%s", end + 1);
+            found = 1;
+        }
+        break;
+    }
+    fseek(room->log, 0, SEEK_END);
+    return found;
+}
+
+/* 기존 로그의 마지막 줄에서 순번을 읽어 이어서 사용 */
+uint64_t room_last_logged_seq(FILE *log) {
+    char tail[MAXBUF + 32];
+    if (fseek(log, 0, SEEK_END) < 0) return 0;
+    long end = ftell(log);
+    long start = end > (long)sizeof(tail) - 1 ? end - (long)sizeof(tail) + 1 : 0;
+    fseek(log, start, SEEK_SET);
+    size_t n = fread(tail, 1, end - start, log);
+    tail[n] = '\0';
+
+    // 마지막 개행 앞의 줄 시작 찾기
+    if (n > 0 && tail[n - 1] == '\n') tail[--n] = '\0';
+    char *line = strrchr(tail, '\n');
+    line = line ? line + 1 : tail;
+    fseek(log, 0, SEEK_END);
+    return strtoull(line, NULL, 10);
+}
+
+
+/* 주인 스레드가 처음 메시지를 받을 때 기록 파일을 열고 순번을 이어받음 */
+static void room_load(Room *room) {
+    if (room->loaded) return;
+    room->loaded = 1;
+
+    char path[MAXROOM * 2 + 32];
+    mkdir(HISTORY_DIR, 0755);
+    room_file_path(room->name, ".log", path, sizeof(path));
+    room->log = fopen(path, "a+");
+    room->seq = room->log ? room_last_logged_seq(room->log) : 0;
+    room->hist_from = room->seq + 1;
+    room_file_path(room->name, ".idx", path, sizeof(path));
+    room->idx = room_open_offsets(room, path);
+}
+
+/* 가변 버퍼에 이어 붙이기 */
+static int gap_append(char **buf, size_t *len, size_t *cap, const char *data, size_t n) {
+    if (*len + n > *cap) {
+        size_t ncap = *cap ? *cap * 2 : 16384;
+        while (ncap < *len + n) ncap *= 2;
+        char *nb = realloc(*buf, ncap);
+        if (!nb) return -1;
+        *buf = nb;
+        *cap = ncap;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+/* last_seq 이후 놓친 메시지를 메모리(최근분) 또는 디스크(오래된 분)에서 모아 한 번에 전송 */
+static void room_send_gap(Room *room, RoomMember *m, uint64_t last_seq) {
+    if (last_seq >= room->seq) return;
+
+    uint64_t from = last_seq + 1;
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    char line[MAXBUF + 32];
+
+    if (room->seq - last_seq > RESUME_MAX) {
+        from = room->seq - RESUME_MAX + 1;
+        int n = snprintf(line, sizeof(line), "TRUNCATED %llu\n", (unsigned long long)(from - last_seq - 1));
+        gap_append(&buf, &len, &cap, line, n);
+    }
+
+    uint64_t mem_from = room_mem_from(room);
+
+    if (from < mem_from && room->log) {
+        room_seek_seq(room, from);
+        while (fgets(line, sizeof(line), room->log)) {
+            char *end;
+            uint64_t seq = strtoull(line, &end, 10);
+            if (seq < from || *end != ' ') continue;
+            if (seq >= mem_from) break;
+            char stamped[MAXBUF + 64];
+            int n = snprintf(stamped, sizeof(stamped), "@%llu %s", (unsigned long long)seq, end + 1);
+            gap_append(&buf, &len, &cap, stamped, n < (int)sizeof(stamped) ? n : (int)sizeof(stamped) - 1);
+        }
+        fseek(room->log, 0, SEEK_END);
+    }
+    if (from < mem_from) from = mem_from;
+
+    for (uint64_t seq = from; seq <= room->seq; seq++) {
+        const char *h = room->hist[seq % ROOM_HISTORY];
+        if (!h) continue;
+        int n = snprintf(line, sizeof(line), "@%llu %s", (unsigned long long)seq, h);
+        gap_append(&buf, &len, &cap, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+    }
+
+    // 한 번의 쓰기 요청으로 전송 (못 보낸 나머지는 참여자 대기열로)
+    if (buf) member_send(m, buf, len, 0);
+    free(buf);
+}
+
+/* 연결 번호로 참여자 찾기 (중계가 끝나기를 기다리며 나가는 중인 참여자는 제외) */
+static RoomMember *room_member(Room *room, uint64_t serial) {
+    RoomMember *m = room->members;
+    while (m && (m->serial != serial || m->leaving)) m = m->next;
+    return m;
+}
+
+/* 참여자가 받을 대상인지 */
+static int member_hears(const RoomMember *m, RoomAudience audience) {
+    return audience == AUD_ALL || (audience == AUD_FILEREF) == (m->fileref != 0);
+}
+
+/* 참여자에게 전송 (except 연결 번호는 제외, 0이면 모두) */
+static void room_fanout(Room *room, uint64_t except, const char *data, size_t len) {
+    for (RoomMember *m = room->members; m; m = m->next) {
+        if (m->serial != except) member_send(m, data, len, 0);
+    }
+}
+
+static void room_presence(Room *room, const RoomMember *who, char sign) {
+    char delta[MAXNAME + 16];
+    int n = snprintf(delta, sizeof(delta), "PRESENCE %c %s\n", sign, who->nickname);
+    room_fanout(room, who->serial, delta, n);
+}
+
+/* 입장: 입장 응답 → (재접속 클라이언트면) 토큰/현재 순번 알림과 놓친 메시지 → 참여자 등록 → 입장 알림.
+   방을 옮겨 온 연결이면 앞 방의 남은 출력(HANDOVER)이 올 때까지 보내지 않고 쌓기만 함 */
+static void room_on_join(Room *room, RoomMsg *msg) {
+    RoomMember *m = calloc(1, sizeof(RoomMember));
+    if (!m) { close(msg->fd); return; }
+    m->fd = msg->fd;
+    m->serial = msg->serial;
+    m->want_seq = msg->want_seq;
+    m->credit_mode = msg->credit_mode;
+    m->credit = msg->credit;
+    m->room_mem = &room->mem_queued;
+    m->conn_mem = msg->conn_mem;
+    m->parked = msg->handover;
+    m->in_relay = msg->in_relay;
+    m->fileref = msg->fileref;
+    memcpy(m->nickname, msg->nickname, MAXNAME);
+
+    if (msg->len > 0) member_send(m, msg->data, msg->len, 0);
+    if (msg->token) {
+        char line[128];
+        int n = snprintf(line, sizeof(line), "TOKEN %016llx %llu\n",
+                         (unsigned long long)msg->token, (unsigned long long)room->seq);
+        member_send(m, line, n, 0);
+        if (msg->last_seq > 0) room_send_gap(room, m, msg->last_seq);
+    }
+
+    m->next = room->members;
+    room->members = m;
+    if (!msg->quiet) room_presence(room, m, '+');
+}
+
+/* 방을 옮기는 연결의 못 보낸 출력을 이벤트 루프에 돌려줘 새 방 actor 가 이어 보내게 함
+   (새 방 참여자가 기다리므로 빈 목록이라도 돌려줌) */
+static void room_hand_over(ActorRuntime *rt, int idx, uint64_t serial, OutChunk *rest) {
+    HandoverNote *note = calloc(1, sizeof(HandoverNote));
+    if (!note) {
+        perror("room handover");
+        while (rest) { OutChunk *next = rest->next; chunk_free(rest); rest = next; }
+        return;
+    }
+    note->base.done = handover_done;
+    note->idx = idx;
+    note->serial = serial;
+    note->chunks = rest;
+    pool_post(rt->pool, &note->base);
+}
+
+/* 참여자를 목록에서 빼고 정리. handover 면 남은 출력을 idx 로 돌려줌 */
+static void room_remove_member(ActorRuntime *rt, RoomMember **link, int handover, int idx) {
+    RoomMember *m = *link;
+    OutChunk *rest = NULL;
+    *link = m->next;
+    if (handover && !m->dead) rest = member_take_output(m);
+    member_drop_output(m);
+    close(m->fd);
+    if (handover) room_hand_over(rt, idx, m->serial, rest);
+    free(m);
+}
+
+/* 퇴장. 방을 옮기는데 진행 중인 중계를 받는 중이면 파일이 끊기지 않게 중계가 끝날 때까지 남겨 둠
+   (room_relay_end 에서 마저 정리) */
+static void room_on_leave(ActorRuntime *rt, Room *room, RoomMsg *msg) {
+    RoomMember **link = &room->members;
+    while (*link && ((*link)->serial != msg->serial || (*link)->leaving)) link = &(*link)->next;
+    RoomMember *m = *link;
+    if (!m) {
+        if (msg->handover) room_hand_over(rt, msg->idx, msg->serial, NULL);
+        return;
+    }
+    if (!msg->quiet) room_presence(room, m, '-');
+    if (msg->handover && m->in_relay && !m->dead && room->relay_remain > 0) {
+        m->leaving = 1;
+        m->leave_idx = msg->idx;
+        return;
+    }
+    room_remove_member(rt, link, msg->handover, msg->idx);
+}
+
+/* 중계가 끝남 (다 받았거나 업로더가 나감): 받던 참여자의 미룬 출력을 풀고, 기다리던 퇴장을 마침 */
+static void room_relay_end(ActorRuntime *rt, Room *room) {
+    room->relay_remain = 0;
+    RoomMember **link = &room->members;
+    while (*link) {
+        RoomMember *m = *link;
+        if (m->in_relay) member_relay_done(m);
+        if (m->leaving) room_remove_member(rt, link, 1, m->leave_idx);
+        else link = &m->next;
+    }
+}
+
+/* 앞 방에서 (또는 핸드오프 전 프로세스에서) 넘어온 출력을 지금 대기열 앞에 붙이고 보내기 시작 */
+static void room_on_handover(Room *room, RoomMsg *msg) {
+    RoomMember *m = room_member(room, msg->serial);
+    OutChunk *c = msg->chunks;
+    msg->chunks = NULL;
+    if (!m || m->dead) {
+        while (c) { OutChunk *next = c->next; chunk_free(c); c = next; }
+        return;
+    }
+    // 핸드오프로 넘겨받은 중계 뒤 출력은 그새 이 프로세스에서 미뤄 둔 것보다 앞에
+    OutChunk *held_later = m->held_head;
+    m->held_head = m->held_tail = NULL;
+    for (OutChunk *h = held_later; h; h = h->next) member_charge(m, -chunk_cost(h));
+
+    OutChunk *later = member_take_output(m);
+    while (c) {
+        OutChunk *next = c->next;
+        member_enqueue(m, c);
+        c = next;
+    }
+    for (OutChunk *h = msg->held; h; h = msg->held) {
+        msg->held = h->next;
+        if (m->in_relay) member_hold(m, h);
+        else member_enqueue(m, h);
+    }
+    while (later) {
+        OutChunk *next = later->next;
+        member_enqueue(m, later);
+        later = next;
+    }
+    while (held_later) {
+        OutChunk *next = held_later->next;
+        member_hold(m, held_later);
+        held_later = next;
+    }
+    m->parked = 0;
+    m->out_progress = mono_ms();
+    member_flush(m, m->out_progress);
+}
+
+/* 중계 업로더 바꾸기: 이전 업로더의 확인 대기분은 모두 돌려줌 */
+static void relay_switch(ActorRuntime *rt, Room *room, RoomMsg *msg) {
+    if (room->relay_serial == msg->serial) return;
+    if (room->relay_pending > 0) relay_ack(rt, room, 0);
+    room->relay_serial = msg->serial;
+    room->relay_idx = msg->idx;
+}
+
+/* 순번 없는 전송 (audience 참여자에게). 파일 헤더면 뒤따를 중계 바이트 수를 기억하고, 헤더를 받은 참여자만
+   중계를 받음. 내용 없는 헤더는 핸드오프 뒤 이어지는 중계 (받던 참여자는 JOIN 으로 표시됨).
+   fd 가 있으면 중계가 아니라 헤더 뒤에 그 파일 내용을 이어 보냄 (스풀에 이미 있던 해시 업로드) */
+static void room_on_raw(ActorRuntime *rt, Room *room, RoomMsg *msg) {
+    int header = msg->fd < 0 && msg->relay_size > 0;
+    if (header) {
+        relay_switch(rt, room, msg);
+        room->relay_remain = msg->relay_size;
+    }
+    for (RoomMember *m = room->members; m; m = m->next) {
+        if (m->serial == msg->serial || !member_hears(m, msg->audience)) continue;
+        member_send(m, msg->data, msg->len, 0);
+        if (msg->fd >= 0) {
+            int fd = dup(msg->fd);
+            if (fd < 0) perror("room file dup");
+            else member_send_file(m, fd, msg->relay_size);
+        } else if (header && msg->len > 0 && !m->dead) {
+            m->in_relay = 1;
+        }
+    }
+}
+
+/* 구버전 파일 중계 데이터: 헤더를 받은 참여자에게. 업로더 확인은 room_flush 에서 */
+static void room_on_relay(ActorRuntime *rt, Room *room, RoomMsg *msg) {
+    relay_switch(rt, room, msg);
+    room->relay_pending += msg->len;
+    for (RoomMember *m = room->members; m; m = m->next) {
+        if (m->in_relay) member_send(m, msg->data, msg->len, 1);
+    }
+    room->relay_remain -= msg->len;
+    if (room->relay_remain <= 0) room_relay_end(rt, room);
+}
+
+/* 해시 업로드를 FILEREF 로 받겠다고 알림 */
+static void room_on_fileref(Room *room, RoomMsg *msg) {
+    RoomMember *m = room_member(room, msg->serial);
+    if (m) m->fileref = 1;
+}
+
+/* 크레딧 수신자가 더 받을 수 있다고 알림 */
+static void room_on_credit(Room *room, RoomMsg *msg) {
+    for (RoomMember *m = room->members; m; m = m->next) {
+        if (m->serial != msg->serial) continue;
+        m->credit_mode = 1;
+        m->credit += msg->credit;
+        break;
+    }
+}
+
+/* 방 메시지: 순번을 붙여 기록하고 전송. 재접속 지원 클라이언트에는 "@<순번> " 접두어,
+   구버전에는 그대로, 보낸 사람에게는 순번만 (ACK) */
+static void room_on_post(ActorRuntime *rt, Room *room, RoomMsg *msg) {
+    const char *line = msg->data;
+    uint64_t seq = ++room->seq;
+    char **slot = &room->hist[seq % ROOM_HISTORY];
+    if (*slot) mem_add(&room->mem_hist, &mem_hist, -(long)(strlen(*slot) + 1));
+    free(*slot);
+    *slot = strdup(line);
+    if (*slot) mem_add(&room->mem_hist, &mem_hist, msg->len + 1);
+    if (room->log) {
+        uint64_t off = ftell(room->log);
+        if (room->idx) fwrite(&off, sizeof(off), 1, room->idx);
+        fprintf(room->log, "%llu %s", (unsigned long long)seq, line);
+    }
+
+    char stamped[MAXBUF + 32];
+    int stamped_len = snprintf(stamped, sizeof(stamped), "@%llu %s", (unsigned long long)seq, line);
+    if (stamped_len >= (int)sizeof(stamped)) stamped_len = sizeof(stamped) - 1;
+    TRACE(fanout, -1, msg->msg_id, (long)seq);
+
+    for (RoomMember *m = room->members; m; m = m->next) {
+        if (m->serial == msg->serial) {
+            if (m->want_seq) {
+                char ack[40];
+                int n = snprintf(ack, sizeof(ack), "ACK %llu\n", (unsigned long long)seq);
+                member_send(m, ack, n, 0);
+            }
+        } else if (!member_hears(m, msg->audience)) {
+            continue;
+        } else if (m->want_seq) {
+            member_send(m, stamped, stamped_len, 0);
+            TRACE(send, m->fd, msg->msg_id, (long)m->out_bytes);
+        } else {
+            member_send(m, line, msg->len, 0);
+            TRACE(send, m->fd, msg->msg_id, (long)m->out_bytes);
+        }
+    }
+
+    // 지켜보는 연결에는 방 이름을 붙여 이벤트 루프로 (watch_note_done)
+    if (room->watchers) {
+        char tagged[MAXBUF + MAXROOM + 48];
+        int n = snprintf(tagged, sizeof(tagged), "ROOM %s %s", room->name, stamped);
+        if (n >= (int)sizeof(tagged)) n = sizeof(tagged) - 1;
+        for (RoomWatcher *w = room->watchers; w; w = w->next) {
+            WatchNote *note = calloc(1, sizeof(WatchNote) + n);
+            if (!note) break;
+            note->base.done = watch_note_done;
+            note->idx = w->idx;
+            note->serial = w->serial;
+            note->len = n;
+            memcpy(note->data, tagged, n);
+            pool_post(rt->pool, &note->base);
+        }
+    }
+
+    // 검색 색인은 이벤트 루프 소유이므로 순번과 본문을 돌려보냄
+    if (msg->text_off >= 0) {
+        IndexNote *note = calloc(1, sizeof(IndexNote) + msg->len - msg->text_off + 1);
+        if (!note) return;
+        note->base.done = index_note_done;
+        note->seq = seq;
+        memcpy(note->room, room->name, MAXROOM);
+        memcpy(note->text, msg->data + msg->text_off, msg->len - msg->text_off);
+        pool_post(rt->pool, &note->base);
+    }
+}
+
+/* 검색어가 모두 메시지에 들어 있는지 */
+static int hit_matches(const char *text, char terms[][TERM_MAX], int nterms) {
+    char words[80][TERM_MAX];
+    int nwords = tokenize(text, words, 80);
+    for (int t = 0; t < nterms; t++) {
+        int found = 0;
+        for (int w = 0; w < nwords && !found; w++) found = strcmp(words[w], terms[t]) == 0;
+        if (!found) return 0;
+    }
+    return 1;
+}
+
+/* 색인 후보(오름차순) 중 이 방 메시지에 검색어가 정말 들어 있는 것만 앞으로 모음. 색인의 방 키는
+   32bit 해시라 이름이 다른 방의 포스팅이 섞일 수 있음. 로그 구간은 한 번 찾아가 순서대로 읽음 */
+static int room_verify_hits(Room *room, uint64_t *seqs, int n, char terms[][TERM_MAX], int nterms) {
+    uint64_t mem_from = room_mem_from(room);
+    char line[MAXBUF + 32];
+    int i = 0, kept = 0;
+
+    if (room->log && n > 0 && seqs[0] < mem_from) {
+        room_seek_seq(room, seqs[0]);
+        while (i < n && seqs[i] < mem_from && fgets(line, sizeof(line), room->log)) {
+            char *end;
+            uint64_t s = strtoull(line, &end, 10);
+            if (*end != ' ') continue;
+            while (i < n && seqs[i] < s) i++;     // 로그에 없는 순번
+            if (i < n && seqs[i] == s) {
+                if (hit_matches(end + 1, terms, nterms)) seqs[kept++] = s;
+                i++;
+            }
+        }
+        fseek(room->log, 0, SEEK_END);
+    }
+    while (i < n && seqs[i] < mem_from) i++;
+
+    for (; i < n && seqs[i] <= room->seq; i++) {
+        const char *h = room->hist[seqs[i] % ROOM_HISTORY];
+        if (h && hit_matches(h, terms, nterms)) seqs[kept++] = seqs[i];
+    }
+    return kept;
+}
+
+/* /search 결과: 후보를 확인한 뒤 건수와 최근 것부터 SEARCH_MAX_HITS 개 (data 는 검색어) */
+static void room_on_fetch(Room *room, RoomMsg *msg) {
+    RoomMember *m = room_member(room, msg->serial);
+    if (!m) return;
+
+    char terms[SEARCH_MAX_TERMS][TERM_MAX];
+    int nterms = tokenize(msg->data, terms, SEARCH_MAX_TERMS);
+    int nhits = room_verify_hits(room, msg->seqs, msg->nseqs, terms, nterms);
+
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    char line[MAXBUF + 64], text[MAXBUF + 32];
+
+    int n = snprintf(line, sizeof(line), "SEARCH %d %s\n", nhits, msg->data);
+    gap_append(&buf, &len, &cap, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+    for (int i = nhits - 1; i >= 0 && i >= nhits - SEARCH_MAX_HITS; i--) {
+        if (!room_fetch(room, msg->seqs[i], text, sizeof(text))) continue;
+        n = snprintf(line, sizeof(line), "HIT %llu %s", (unsigned long long)msg->seqs[i], text);
+        gap_append(&buf, &len, &cap, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+    }
+    member_send(m, buf, len, 0);
+    free(buf);
+}
+
+static void room_on_watch(Room *room, RoomMsg *msg) {
+    for (RoomWatcher *w = room->watchers; w; w = w->next) {
+        if (w->serial == msg->serial) return;
+    }
+    RoomWatcher *w = calloc(1, sizeof(RoomWatcher));
+    if (!w) return;
+    w->serial = msg->serial;
+    w->idx = msg->idx;
+    w->next = room->watchers;
+    room->watchers = w;
+}
+
+static void room_on_unwatch(Room *room, RoomMsg *msg) {
+    RoomWatcher **link = &room->watchers;
+    while (*link && (*link)->serial != msg->serial) link = &(*link)->next;
+    RoomWatcher *w = *link;
+    if (!w) return;
+    *link = w->next;
+    free(w);
+}
+
+/* 이벤트 루프의 응답이나 다른 방에서 온 메시지를 이 방 참여자 한 명에게 (다른 출력과 같은 대기열로).
+   fd 가 있으면 (/fetch) 그 파일 내용을 이어서 보냄 */
+static void room_on_deliver(Room *room, RoomMsg *msg) {
+    RoomMember *m = room_member(room, msg->serial);
+    if (m) member_send(m, msg->data, msg->len, 0);
+    if (msg->fd >= 0) {
+        if (m) member_send_file(m, msg->fd, msg->relay_size);
+        else close(msg->fd);
+        msg->fd = -1;
+    }
+}
+
+/* 핸드오프 직전 (actors_sync). 보낼 수 있는 만큼 보내고 기록을 디스크로 내림. 아무도 끊지 않음:
+   남은 출력은 이벤트 루프가 핸드오프에 실어 보내고, 넘길 수 없는 연결은 ACK 를 받은 뒤에야 닫힘 */
+static void room_on_sync(ActorRuntime *rt, Room *room) {
+    room_flush(rt, room);
+    if (room->log) fflush(room->log);
+    if (room->idx) fflush(room->idx);
+    atomic_fetch_sub(&rt->sync_pending, 1);
+}
+
+static void room_handle(ActorRuntime *rt, Room *room, RoomMsg *msg) {
+    room_load(room);
+    switch (msg->type) {
+    case RMSG_JOIN:  room_on_join(room, msg); break;
+    case RMSG_LEAVE:
+        room_on_leave(rt, room, msg);
+        if (msg->serial == room->relay_serial && room->relay_remain > 0) room_relay_end(rt, room);  // 업로더가 나감
+        break;
+    case RMSG_POST:  room_on_post(rt, room, msg); break;
+    case RMSG_RAW:   room_on_raw(rt, room, msg); break;
+    case RMSG_RELAY: room_on_relay(rt, room, msg); break;
+    case RMSG_CREDIT: room_on_credit(room, msg); break;
+    case RMSG_FETCH: room_on_fetch(room, msg); break;
+    case RMSG_SYNC:  room_on_sync(rt, room); break;
+    case RMSG_WATCH:   room_on_watch(room, msg); break;
+    case RMSG_UNWATCH: room_on_unwatch(room, msg); break;
+    case RMSG_DELIVER: room_on_deliver(room, msg); break;
+    case RMSG_HANDOVER: room_on_handover(room, msg); break;
+    case RMSG_CLOSE: break;     // room_dispatch 에서 처리
+    case RMSG_FILEREF: room_on_fileref(room, msg); break;
+    }
+}
+
+static void room_msg_free(RoomMsg *msg) {
+    if (msg->type != RMSG_JOIN && msg->fd >= 0) close(msg->fd);
+    while (msg->chunks) {
+        OutChunk *next = msg->chunks->next;
+        chunk_free(msg->chunks);
+        msg->chunks = next;
+    }
+    while (msg->held) {
+        OutChunk *next = msg->held->next;
+        chunk_free(msg->held);
+        msg->held = next;
+    }
+    free(msg->seqs);
+    free(msg);
+}
+
+static int room_dispatch(ActorRuntime *rt, Room *room, RoomMsg *msg);
+
+/* 미뤄 둔 메시지를 순서대로 다시 처리 (새 업로드가 시작되면 그 뒤는 다시 미뤄짐).
+   all 이면 중계 중이어도 모두 그대로 처리 (방 닫기) */
+static void room_release_held(ActorRuntime *rt, Room *room, int all) {
+    if (!all && room->relay_remain > 0) return;
+    RoomMsg *list = room->held_head;
+    room->held_head = room->held_tail = NULL;
+    while (list) {
+        RoomMsg *msg = list;
+        list = msg->next;
+        mem_add(&room->mem_held, &mem_held, -(long)(sizeof(RoomMsg) + msg->len));
+        if (all) room_handle(rt, room, msg);
+        else if (room_dispatch(rt, room, msg)) continue;
+        room_msg_free(msg);
+    }
+}
+
+/* 입장한 연결도 지켜보는 연결도 없는 방 정리 (CLOSE). 기록은 로그에 있으므로 다시 열면 이어짐 */
+static void room_close(ActorRuntime *rt, Room *room) {
+    room_release_held(rt, room, 1);
+    room_relay_end(rt, room);       // 중계가 끝나기를 기다리던 퇴장도 마침
+    while (room->members) {
+        RoomMember *m = room->members;
+        room->members = m->next;
+        member_drop_output(m);
+        close(m->fd);
+        free(m);
+    }
+    while (room->watchers) {
+        RoomWatcher *w = room->watchers;
+        room->watchers = w->next;
+        free(w);
+    }
+    for (int i = 0; i < ROOM_HISTORY; i++) {
+        if (!room->hist[i]) continue;
+        mem_add(&room->mem_hist, &mem_hist, -(long)(strlen(room->hist[i]) + 1));
+        free(room->hist[i]);
+        room->hist[i] = NULL;
+    }
+    if (room->log) fclose(room->log);
+    if (room->idx) fclose(room->idx);
+    room->log = room->idx = NULL;
+    room->closed = 1;
+}
+
+/* 그 연결이 보낸 메시지가 방 전체로 미뤄져 있는지 (같은 연결의 메시지는 순서를 지킴) */
+static int room_held_from(Room *room, uint64_t serial) {
+    for (RoomMsg *h = room->held_head; h; h = h->next) {
+        if (h->serial == serial) return 1;
+    }
+    return 0;
+}
+
+/* 우편함에서 꺼낸 메시지 하나. 파일 중계 중에 온 다른 업로드(헤더와 데이터)와, 미뤄 둔 메시지가 있는
+   연결의 메시지만 held 뒤에 붙여 순서대로 미룸. 나머지는 바로 처리 (중계를 받는 참여자에게 갈 출력은
+   member_send 가 참여자별로 미룸). 미뤘으면 1 (메시지는 방이 가짐) */
+static int room_dispatch(ActorRuntime *rt, Room *room, RoomMsg *msg) {
+    if (msg->type == RMSG_CLOSE) {
+        room_close(rt, room);
+        return 0;
+    }
+    int other_upload = room->relay_remain > 0 &&
+                       ((msg->type == RMSG_RAW && msg->fd < 0 && msg->relay_size > 0) ||
+                        (msg->type == RMSG_RELAY && msg->serial != room->relay_serial));
+    int passes = msg->type == RMSG_CREDIT || msg->type == RMSG_SYNC;
+    if (!passes && (other_upload || (room->held_head && room_held_from(room, msg->serial)))) {
+        msg->next = NULL;
+        if (room->held_tail) room->held_tail->next = msg;
+        else room->held_head = msg;
+        room->held_tail = msg;
+        mem_add(&room->mem_held, &mem_held, sizeof(RoomMsg) + msg->len);
+        return 1;
+    }
+
+    room_handle(rt, room, msg);
+    if (room->held_head) room_release_held(rt, room, 0);
+    return 0;
+}
+
+/* 밀린 출력이 있는 방이면 쓰기 가능 대기 목록에 올리고, 다 보냈으면 내림 */
+static void room_track_stalled(RoomWorker *w, RoomActor *a) {
+    if (atomic_load(&w->rt->frozen)) return;
+    int stalled = room_flush(w->rt, &a->room);
+    if (stalled && !a->stalled) {
+        a->stalled = 1;
+        w->stalled[w->nstalled++] = a;
+    } else if (!stalled && a->stalled) {
+        a->stalled = 0;
+        for (int i = 0; i < w->nstalled; i++) {
+            if (w->stalled[i] == a) { w->stalled[i] = w->stalled[--w->nstalled]; break; }
+        }
+    }
+}
+
+/* actor 참조 하나를 놓음. 마지막이면 (닫힌 방이라 더 올 메시지도 없음) 해제 */
+static void actor_release(RoomActor *a) {
+    if (atomic_fetch_sub(&a->refs, 1) == 1) free(a);
+}
+
+/* 방 스레드: 깨어나면 예약된 방들의 우편함을 비움. 방 하나의 메시지는 항상 이 스레드만 처리.
+   밀린 출력이 있으면 그 소켓들의 쓰기 가능도 함께 기다림 */
+static void *room_worker(void *arg) {
+    RoomWorker *w = arg;
+    ActorRuntime *rt = w->rt;
+    struct pollfd pfds[1 + MAX_CLIENTS];
+
+    for (;;) {
+        int npfd = 0;
+        pfds[npfd++] = (struct pollfd){ .fd = w->efd, .events = POLLIN };
+        for (int i = 0; i < w->nstalled && !atomic_load(&rt->frozen); i++) {
+            for (RoomMember *m = w->stalled[i]->room.members; m && npfd < 1 + MAX_CLIENTS; m = m->next) {
+                // 크레딧을 기다리는 참여자는 CREDIT 메시지로 깨어나므로 제외 (안 그러면 계속 깨어남)
+                if (!m->out_head || m->parked || (m->out_head->relay && m->credit_mode && m->credit <= 0)) continue;
+                pfds[npfd++] = (struct pollfd){ .fd = m->fd, .events = POLLOUT };
+            }
+        }
+        if (poll(pfds, npfd, w->nstalled ? RELAY_TICK_MS : -1) < 0 && errno != EINTR) {
+            perror("room worker poll");
+        }
+
+        // 쓰기 가능해진 (또는 오래 멈춘) 참여자 처리
+        for (int i = w->nstalled - 1; i >= 0; i--) room_track_stalled(w, w->stalled[i]);
+
+        if (!(pfds[0].revents & POLLIN)) continue;
+        uint64_t count;
+        if (read(w->efd, &count, sizeof(count)) < 0) {
+            if (errno != EINTR) perror("room worker read");
+            continue;
+        }
+
+        // 올라온 순서대로 (닫히는 방과 같은 이름으로 새로 만든 방이 같은 스레드에 있으면 이전 것이 먼저 끝남)
+        RoomActor *stack = atomic_exchange(&w->ready, NULL), *ready = NULL;
+        while (stack) {
+            RoomActor *next = stack->next_ready;
+            stack->next_ready = ready;
+            ready = stack;
+            stack = next;
+        }
+        while (ready) {
+            RoomActor *a = ready;
+            ready = a->next_ready;
+            // 우편함을 비우기 전에 예약을 풀어야, 그 사이 도착한 메시지가 다시 예약됨
+            atomic_store(&a->scheduled, 0);
+
+            RoomMsg *list = atomic_exchange(&a->mailbox, NULL);
+            RoomMsg *ordered = NULL;
+            while (list) {
+                RoomMsg *next = list->next;
+                list->next = ordered;
+                ordered = list;
+                list = next;
+            }
+            while (ordered) {
+                RoomMsg *next = ordered->next;
+                if (!room_dispatch(rt, &a->room, ordered)) room_msg_free(ordered);
+                ordered = next;
+            }
+
+            // 처리한 만큼 한 번에 디스크로
+            if (a->room.log) fflush(a->room.log);
+            if (a->room.idx) fflush(a->room.idx);
+            room_track_stalled(w, a);   // 닫힌 방은 참여자가 없어 대기 목록에서도 빠짐
+            actor_release(a);           // 실행 대기열 몫
+        }
+    }
+    return NULL;
+}
+
+/* 방 스레드 시작 (nworkers <= 0 이면 ROOM_WORKERS_DEFAULT) */
+int actors_start(ActorRuntime *rt, int nworkers, WorkerPool *pool) {
+    if (nworkers <= 0) nworkers = ROOM_WORKERS_DEFAULT;
+    if (nworkers > MAX_ROOM_WORKERS) nworkers = MAX_ROOM_WORKERS;
+    rt->pool = pool;
+    rt->nworkers = 0;
+
+    for (int i = 0; i < nworkers; i++) {
+        RoomWorker *w = &rt->workers[i];
+        w->rt = rt;
+        w->efd = eventfd(0, EFD_CLOEXEC);
+        atomic_store(&w->ready, NULL);
+        if (w->efd < 0 || pthread_create(&w->tid, NULL, room_worker, w) != 0) {
+            perror("room worker");
+            if (w->efd >= 0) close(w->efd);
+            break;
+        }
+        rt->nworkers++;
+    }
+    return rt->nworkers > 0 ? 0 : -1;
+}
+
+/* 우편함에 넣고, 방이 아직 예약 안 됐으면 주인 스레드 실행 대기열에 올린 뒤 깨움 (어느 스레드에서나).
+   넣는 동안과 실행 대기열에 올라가 있는 동안은 참조를 잡아, 주인 스레드가 닫힌 방을 먼저 놓아도 해제되지 않음 */
+void actor_post(ActorRuntime *rt, RoomActor *a, RoomMsg *msg) {
+    atomic_fetch_add(&a->refs, 1);
+    RoomMsg *head = atomic_load(&a->mailbox);
+    do {
+        msg->next = head;
+    } while (!atomic_compare_exchange_weak(&a->mailbox, &head, msg));
+
+    if (atomic_exchange(&a->scheduled, 1) == 0) {
+        atomic_fetch_add(&a->refs, 1);  // 실행 대기열 몫 (주인 스레드가 처리 후 놓음)
+        RoomWorker *w = &rt->workers[a->worker];
+        RoomActor *ready = atomic_load(&w->ready);
+        do {
+            a->next_ready = ready;
+        } while (!atomic_compare_exchange_weak(&w->ready, &ready, a));
+
+        uint64_t one = 1;
+        if (write(w->efd, &one, sizeof(one)) < 0) perror("room worker wake");
+    }
+    actor_release(a);
+}
+
+/* 방 이름 → actor (없으면 NULL). 이벤트 루프 전용 */
+RoomActor *actor_find(ActorRuntime *rt, const char *name) {
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (rt->rooms[i] && strcmp(rt->rooms[i]->room.name, name) == 0) return rt->rooms[i];
+    }
+    return NULL;
+}
+
+/* 방 이름 → actor (없으면 만들고 주인 스레드를 정함). 방 슬롯이 가득 차면 NULL. 이벤트 루프 전용.
+   쓰는 연결이 없는 방은 actor_unuse 에서 닫으므로 슬롯은 동시에 쓰이는 방 수만큼만 참 */
+RoomActor *actor_get(ActorRuntime *rt, const char *name) {
+    RoomActor *a = actor_find(rt, name);
+    if (a) return a;
+    int empty = -1;
+    for (int i = 0; i < MAX_ROOMS && empty < 0; i++) {
+        if (!rt->rooms[i]) empty = i;
+    }
+    if (empty < 0) return NULL;
+
+    a = calloc(1, sizeof(RoomActor));
+    if (!a) return NULL;
+    strncpy(a->room.name, name, MAXROOM - 1);  // 이름은 만든 뒤 바뀌지 않음
+    a->worker = room_key(name) % rt->nworkers;
+    atomic_store(&a->mailbox, NULL);
+    atomic_store(&a->scheduled, 0);
+    atomic_store(&a->refs, 1);                 // 디렉터리 몫
+    rt->rooms[empty] = a;
+    return a;
+}
+
+static RoomMsg *room_msg_new(RoomMsgType type, uint64_t serial, const void *data, size_t len);
+
+/* 입장/지켜보기 하나 늘림 */
+static void actor_use(RoomActor *a) {
+    a->users++;
+}
+
+/* 입장/지켜보기 하나 줄임. 아무도 안 쓰면 디렉터리에서 빼고 CLOSE 를 보냄 (그 뒤로는 아무도 이 actor 에
+   메시지를 넣지 않음: 넣는 쪽은 디렉터리로 찾는 이벤트 루프뿐) */
+static void actor_unuse(ActorRuntime *rt, RoomActor *a) {
+    if (a->users > 0) a->users--;
+    if (a->users > 0) return;
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (rt->rooms[i] == a) rt->rooms[i] = NULL;
+    }
+    RoomMsg *msg = room_msg_new(RMSG_CLOSE, 0, NULL, 0);
+    if (msg) actor_post(rt, a, msg);
+    else perror("room close");     // 방 상태는 남지만 actor 는 디렉터리 참조와 함께 놓음
+    actor_release(a);              // 디렉터리 몫
+}
+
+static RoomMsg *room_msg_new(RoomMsgType type, uint64_t serial, const void *data, size_t len) {
+    RoomMsg *msg = calloc(1, sizeof(RoomMsg) + len + 1);
+    if (!msg) return NULL;
+    msg->type = type;
+    msg->serial = serial;
+    msg->fd = -1;
+    msg->text_off = -1;
+    msg->len = len;
+    if (len) memcpy(msg->data, data, len);
+    return msg;
+}
+
+/* 모든 방의 우편함이 비워지고 기록이 디스크로 내려갈 때까지 대기 (핸드오프 직전) */
+void actors_sync(ActorRuntime *rt) {
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (!rt->rooms[i]) continue;
+        RoomMsg *msg = room_msg_new(RMSG_SYNC, 0, NULL, 0);
+        if (!msg) continue;
+        atomic_fetch_add(&rt->sync_pending, 1);
+        actor_post(rt, rt->rooms[i], msg);
+    }
+    while (atomic_load(&rt->sync_pending) > 0) {
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* 참여자 상태 (핸드오프 때 남은 크레딧, 중계 수신 여부, 못 보낸 출력을 넘김). actors_sync 뒤 방 스레드가 쉬고 있을 때만 호출 */
+RoomMember *actor_member(ActorRuntime *rt, const char *room, uint64_t serial) {
+    RoomActor *a = actor_find(rt, room);
+    return a ? room_member(&a->room, serial) : NULL;
+}
+
+/* 진행 중인 중계 뒤로 미뤄 둔 메시지가 있는 방 (없으면 NULL). 처리 전 명령이라 핸드오프에 실을 수 없음.
+   actors_sync 뒤 방 스레드가 쉬고 있을 때만 호출 */
+const char *actors_held_room(ActorRuntime *rt) {
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        if (rt->rooms[i] && rt->rooms[i]->room.held_head) return rt->rooms[i]->room.name;
+    }
+    return NULL;
+}
+
+/* --- 이벤트 루프 쪽: 클라이언트 상태를 보고 방 actor 에 메시지를 보냄 --- */
+
+/* 다른 방 지켜보기 시작 (on) / 그만 */
+int room_watch(ServerContext *server, int idx, const char *room, int on) {
+    ClientContext *cli = &server->clients[idx];
+    RoomActor *a = on ? actor_get(&server->actors, room) : actor_find(&server->actors, room);
+    RoomMsg *msg = a ? room_msg_new(on ? RMSG_WATCH : RMSG_UNWATCH, cli->serial, NULL, 0) : NULL;
+    if (!msg) {
+        if (a && a->users == 0) actor_unuse(&server->actors, a);
+        return -1;
+    }
+    msg->idx = idx;
+    actor_post(&server->actors, a, msg);
+    if (on) actor_use(a);
+    else actor_unuse(&server->actors, a);
+    return 0;
+}
+
+int watch_find(const ClientContext *cli, const char *room) {
+    for (int i = 0; i < cli->nwatch; i++) {
+        if (strcmp(cli->watch[i], room) == 0) return i;
+    }
+    return -1;
+}
+
+/* 지켜볼 방 추가 (이미 있으면 그대로). 연결당 MAX_WATCH 개나 방 슬롯을 넘으면 -1 */
+int watch_add(ServerContext *server, int idx, const char *room) {
+    ClientContext *cli = &server->clients[idx];
+    if (watch_find(cli, room) >= 0) return 0;
+    if (cli->nwatch >= MAX_WATCH || room_watch(server, idx, room, 1) < 0) return -1;
+    snprintf(cli->watch[cli->nwatch++], MAXROOM, "%s", room);
+    return 0;
+}
+
+/* 지켜보던 방 하나를 뺌 (입장하게 된 방이면 두 번 받지 않도록) */
+void watch_drop(ServerContext *server, int idx, const char *room) {
+    ClientContext *cli = &server->clients[idx];
+    int i = watch_find(cli, room);
+    if (i < 0) return;
+    room_watch(server, idx, cli->watch[i], 0);
+    cli->nwatch--;
+    if (i != cli->nwatch) memcpy(cli->watch[i], cli->watch[cli->nwatch], MAXROOM);
+}
+
+/* 현재 방에 입장. greet 는 actor 가 가장 먼저 보내는 응답 (OK Joined), token 이 0이 아니면 TOKEN 알림과
+   last_seq 이후 재전송, quiet 면 입장 알림 생략. handover 면 앞 방의 남은 출력을 받은 뒤에 보내기 시작 */
+int room_join(ServerContext *server, int idx, const char *greet, uint64_t token, uint64_t last_seq, int quiet,
+              int handover) {
+    ClientContext *cli = &server->clients[idx];
+    watch_drop(server, idx, cli->room);   // 지켜보던 방에 입장하면 두 번 받지 않게
+    RoomActor *a = actor_get(&server->actors, cli->room);
+    RoomMsg *msg = a ? room_msg_new(RMSG_JOIN, cli->serial, greet, greet ? strlen(greet) : 0) : NULL;
+    if (msg && (msg->fd = dup(cli->fd)) < 0) {
+        free(msg);
+        msg = NULL;
+    }
+    if (!msg) {
+        if (a && a->users == 0) actor_unuse(&server->actors, a);
+        return -1;
+    }
+    msg->want_seq = cli->want_seq;
+    msg->credit_mode = cli->credit_rx;
+    msg->credit = cli->credit_carry;
+    cli->credit_carry = 0;
+    msg->in_relay = cli->relay_rx;
+    cli->relay_rx = 0;
+    msg->fileref = cli->fileref_rx;
+    msg->token = token;
+    msg->last_seq = last_seq;
+    msg->quiet = quiet;
+    msg->handover = handover;
+    cli->handover_pending = handover;
+    msg->conn_mem = &cli->mem_queued;
+    memcpy(msg->nickname, cli->nickname, MAXNAME);
+    actor_post(&server->actors, a, msg);
+    actor_use(a);
+    return 0;
+}
+
+/* 방에서 나감. handover 면 (방을 옮길 때) 못 보낸 출력을 버리지 않고 다음 방으로 넘김 */
+int room_leave(ServerContext *server, int idx, int quiet, int handover) {
+    ClientContext *cli = &server->clients[idx];
+    RoomActor *a = actor_find(&server->actors, cli->room);
+    if (!a) return -1;
+    RoomMsg *msg = room_msg_new(RMSG_LEAVE, cli->serial, NULL, 0);
+    if (msg) {
+        msg->quiet = quiet;
+        msg->handover = handover;
+        msg->idx = idx;
+        actor_post(&server->actors, a, msg);
+        if (handover) memcpy(cli->handover_from, cli->room, MAXROOM);
+    }
+    actor_unuse(&server->actors, a);
+    return msg ? 0 : -1;
+}
+
+/* 클라이언트에게 응답. 방에 입장한 연결의 소켓은 그 방 actor 만 쓰므로 (줄이나 파일 데이터 사이에
+   끼지 않게) 참여자 대기열로 보내고, 입장 전이면 쓰는 쪽이 이벤트 루프뿐이라 바로 보냄 */
+void client_send(ServerContext *server, int idx, const char *data, size_t len) {
+    ClientContext *cli = &server->clients[idx];
+    if (!cli->registered) {
+        if (send(cli->fd, data, len, MSG_NOSIGNAL) < 0) perror("send");
+        return;
+    }
+    RoomActor *a = actor_find(&server->actors, cli->room);
+    RoomMsg *msg = a ? room_msg_new(RMSG_DELIVER, cli->serial, data, len) : NULL;
+    if (!msg) { perror("client reply"); return; }
+    actor_post(&server->actors, a, msg);
+}
+
+/* 앞 방이 돌려준 출력을 지금 입장한 방 actor 에 넘김 (그새 나갔으면 버림) */
+static void handover_done(ServerContext *server, Task *task) {
+    HandoverNote *note = (HandoverNote *)task;
+    ClientContext *cli = &server->clients[note->idx];
+    RoomMsg *msg = NULL;
+    if (cli->fd >= 0 && cli->serial == note->serial && cli->registered) {
+        cli->handover_pending = 0;
+        RoomActor *a = actor_find(&server->actors, cli->room);
+        if (a && (msg = room_msg_new(RMSG_HANDOVER, cli->serial, NULL, 0)) != NULL) {
+            msg->chunks = note->chunks;
+            actor_post(&server->actors, a, msg);
+        }
+    }
+    if (!msg) {
+        while (note->chunks) {
+            OutChunk *next = note->chunks->next;
+            chunk_free(note->chunks);
+            note->chunks = next;
+        }
+    }
+    free(note);
+}
+
+/* 순번을 붙일 방 메시지 (개행 포함). text_off >= 0 이면 그 위치부터를 검색 색인에 추가 */
+int room_post_to(ServerContext *server, int idx, const char *room, const char *line, int text_off,
+                 RoomAudience audience) {
+    ClientContext *cli = &server->clients[idx];
+    RoomActor *a = actor_find(&server->actors, room);
+    RoomMsg *msg = a ? room_msg_new(RMSG_POST, cli->serial, line, strlen(line)) : NULL;
+    if (!msg) return -1;
+    msg->text_off = text_off;
+    msg->audience = audience;
+    msg->msg_id = cli->msg_id;
+    actor_post(&server->actors, a, msg);
+    return 0;
+}
+
+int room_post(ServerContext *server, int idx, const char *line, int text_off) {
+    return room_post_to(server, idx, server->clients[idx].room, line, text_off, AUD_ALL);
+}
+
+/* 순번 없이 보낸 사람 외 audience 참여자에게 (파일 헤더: relay_size 는 뒤따를 중계 바이트).
+   file_fd 가 있으면 중계 대신 헤더 뒤에 그 파일 내용 relay_size 바이트를 보냄 (fd 는 actor 가 가짐) */
+void room_post_raw(ServerContext *server, int idx, const void *data, size_t len, long relay_size,
+                   RoomAudience audience, int file_fd) {
+    ClientContext *cli = &server->clients[idx];
+    RoomActor *a = actor_find(&server->actors, cli->room);
+    RoomMsg *msg = a ? room_msg_new(RMSG_RAW, cli->serial, data, len) : NULL;
+    if (!msg) {
+        if (file_fd >= 0) close(file_fd);
+        return;
+    }
+    msg->idx = idx;
+    msg->relay_size = relay_size;
+    msg->audience = audience;
+    msg->fd = file_fd;
+    actor_post(&server->actors, a, msg);
+}
+
+/* 구버전 파일 중계 데이터. 가장 느린 수신자보다 relay_window 이상 앞서면 업로더 읽기를 멈춤
+   (방 스레드의 RelayAck 로 다시 열림). 메모리 예산 1단계에서도 멈춤 (mem_enforce 가 다시 엶) */
+void room_post_relay(ServerContext *server, int idx, const void *data, size_t len) {
+    ClientContext *cli = &server->clients[idx];
+    RoomActor *a = actor_find(&server->actors, cli->room);
+    RoomMsg *msg = a ? room_msg_new(RMSG_RELAY, cli->serial, data, len) : NULL;
+    if (!msg) return;
+    msg->idx = idx;
+    actor_post(&server->actors, a, msg);
+
+    cli->relay_unacked += len;
+    if (!cli->mem_paused && mem_level(server) >= 1) {
+        cli->mem_paused = 1;
+        server->mem_paused++;
+    }
+    if (cli->relay_unacked >= server->relay_window || cli->mem_paused) FD_CLR(cli->fd, &server->all_fds);
+}
+
+/* 크레딧 수신자가 중계 데이터를 credit 바이트 더 받을 수 있음.
+   방을 옮기는 중이면 앞 방이 받던 중계를 마저 보내는 중이므로 그 방으로 */
+void room_credit(ServerContext *server, int idx, long credit) {
+    ClientContext *cli = &server->clients[idx];
+    RoomActor *a = actor_find(&server->actors, cli->handover_pending ? cli->handover_from : cli->room);
+    RoomMsg *msg = a ? room_msg_new(RMSG_CREDIT, cli->serial, NULL, 0) : NULL;
+    if (!msg) return;
+    msg->credit = credit;
+    actor_post(&server->actors, a, msg);
+}
+
+/* 받는 연결이 입장한 방 actor 로 넘김 (연결이 바뀌었거나 나갔으면 버림) */
+static void watch_note_done(ServerContext *server, Task *task) {
+    WatchNote *note = (WatchNote *)task;
+    ClientContext *cli = &server->clients[note->idx];
+    if (cli->fd >= 0 && cli->serial == note->serial && cli->registered) {
+        client_send(server, note->idx, note->data, note->len);
+    }
+    free(note);
+}
+
+/* /watch <room> : 입장한 방은 그대로 두고 다른 방 메시지도 받음 ("ROOM <방> @<순번> <메시지>")
+   /unwatch <room>, /post <room> <message> : 지켜보는 방에 메시지 (보낸 사람도 ROOM 줄로 받음) */
+void handle_watch(ServerContext *server, int idx, const char *line) {
+    ClientContext *cli = &server->clients[idx];
+    char room[MAXROOM], packet[MAXBUF];
+    int off = 0;
+
+    if (!cli->registered) {
+        client_send(server, idx, "ERR Please /join first.\n", 24);
+    } else if (sscanf(line, "/watch %31s", room) == 1) {
+        if (strcmp(room, cli->room) == 0) {
+            client_send(server, idx, "ERR Already in room\n", 20);
+            return;
+        }
+        if (watch_add(server, idx, room) < 0) {
+            client_send(server, idx, "ERR Too many rooms\n", 19);
+            return;
+        }
+        snprintf(packet, sizeof(packet), "OK Watching %s\n", room);
+        client_send(server, idx, packet, strlen(packet));
+    } else if (sscanf(line, "/unwatch %31s", room) == 1) {
+        watch_drop(server, idx, room);
+    } else if (sscanf(line, "/post %31s %n", room, &off) == 1 && off > 0 && line[off] != '\0') {
+        if (watch_find(cli, room) < 0) {
+            client_send(server, idx, "ERR Not watching\n", 17);
+            return;
+        }
+        snprintf(packet, sizeof(packet), "[%s] %s\n", cli->nickname, line + off);
+        room_post_to(server, idx, room, packet, strlen(cli->nickname) + 3, AUD_ALL);
+    } else {
+        client_send(server, idx, "ERR Usage: /watch|/unwatch <room>, /post <room> <message>\n", 58);
+    }
+}
+
+/* /search: 모든 단어가 들어간 현재 방 메시지 중 최근 것부터 SEARCH_MAX_HITS 개 */
+void handle_search(ServerContext *server, int idx, const char *query) {
+    ClientContext *cli = &server->clients[idx];
+    char terms[SEARCH_MAX_TERMS][TERM_MAX];
+    int nterms = tokenize(query, terms, SEARCH_MAX_TERMS);
+    if (nterms == 0) {
+        client_send(server, idx, "ERR Usage: /search <terms>\n", 27);
+        return;
+    }
+
+    uint32_t key = room_key(cli->room);
+    uint64_t *hits = NULL;
+    int nhits = 0;
+    for (int t = 0; t < nterms; t++) {
+        uint64_t *seqs;
+        int n = index_lookup(&server->index, terms[t], key, &seqs);
+        if (t == 0) {
+            hits = seqs;
+            nhits = n;
+        } else {
+            // 정렬된 두 목록의 교집합
+            int a = 0, b = 0, m = 0;
+            while (a < nhits && b < n) {
+                if (hits[a] < seqs[b]) a++;
+                else if (hits[a] > seqs[b]) b++;
+                else { hits[m++] = hits[a]; a++; b++; }
+            }
+            nhits = m;
+            free(seqs);
+        }
+        if (nhits == 0) break;
+    }
+
+    // 본문은 방 기록에 있으므로 방 actor 가 후보를 확인하고 읽어서 보냄 (최근 것부터)
+    RoomActor *a = actor_find(&server->actors, cli->room);
+    RoomMsg *msg = a ? room_msg_new(RMSG_FETCH, cli->serial, query, strlen(query)) : NULL;
+    if (!msg) {
+        free(hits);
+        char head[MAXBUF + 32];
+        int n = snprintf(head, sizeof(head), "SEARCH 0 %s\n", query);
+        client_send(server, idx, head, n < (int)sizeof(head) ? n : (int)sizeof(head) - 1);
+        return;
+    }
+    msg->seqs = hits;
+    msg->nseqs = nhits;
+    actor_post(&server->actors, a, msg);
+}
+
+/* 메모리 예산 확인 (이벤트 루프가 깨어날 때마다). 1단계가 풀리면 멈췄던 업로더를 다시 읽고,
+   2단계면 쌓인 출력이 가장 많은 연결부터 예산 아래로 내려갈 만큼 끊음. 끊긴 연결의 대기열은
+   방 스레드가 전송 실패를 보고 버리며, 정리는 EOF 를 받은 이벤트 루프가 평소처럼 함 */
+void mem_enforce(ServerContext *server) {
+    if (server->mem_budget <= 0) return;
+    int level = mem_level(server);
+    if (level != server->mem_last_level) {
+        evlog(EV_MEM_LEVEL, -1, mem_total(), mem_level_name(level), NULL);
+        server->mem_last_level = level;
+    }
+
+    if (level == 0 && server->mem_paused > 0) {
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            ClientContext *c = &server->clients[i];
+            if (c->fd == -1 || !c->mem_paused) continue;
+            c->mem_paused = 0;
+            if (c->relay_unacked < server->relay_window) FD_SET(c->fd, &server->all_fds);
+        }
+        server->mem_paused = 0;
+    }
+    if (level < 2) return;
+
+    // 끊는 중이거나 이미 나간 (방 스레드가 LEAVE 를 아직 처리 안 한) 연결의 대기열은 곧 빠지므로
+    // 빼고 계산. 안 그러면 방 스레드가 따라잡기 전까지 매번 한 명씩 더 끊음
+    long over = mem_total() - server->mem_budget;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ClientContext *c = &server->clients[i];
+        if (c->fd == -1 || c->mem_shed) over -= atomic_load_explicit(&c->mem_queued, memory_order_relaxed);
+    }
+    while (over > 0) {
+        int worst = -1;
+        long most = MEM_SHED_MIN - 1;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            ClientContext *c = &server->clients[i];
+            if (c->fd == -1 || c->mem_shed) continue;
+            long q = atomic_load_explicit(&c->mem_queued, memory_order_relaxed);
+            if (q > most) { most = q; worst = i; }
+        }
+        if (worst < 0) break;   // 나머지는 기록/미룬 메시지이거나 고르게 조금씩 쌓인 것
+        ClientContext *c = &server->clients[worst];
+        c->mem_shed = 1;
+        shutdown(c->fd, SHUT_RDWR);
+        evlog(EV_SLOW_DETACH, c->fd, most, c->nickname, c->room);
+        over -= most;
+    }
+}
+
+/* 검색 색인의 아직 디스크에 안 내린 포스팅 (예산에는 넣지 않음: SEG_FLUSH_POSTINGS 로 이미 한정) */
+static long index_mem_bytes(const SearchIndex *ix) {
+    long n = ix->active ? ix->active->postings : 0;
+    for (const TermTable *t = ix->frozen; t; t = t->next) n += t->postings;
+    return n * (long)sizeof(Posting);
+}
+
+/* /stats mem : 전체 합계와 단계, 방별 사용량, 많이 쌓인 연결 순 MEM_STATS_TOP 개 (한 번에 모아 응답) */
+void send_mem_stats(ServerContext *server, int idx) {
+    char line[MAXBUF];
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    int level = mem_level(server);
+    int n = snprintf(line, sizeof(line), "MEM total %ld budget %ld level %s\n",
+                     mem_total(), server->mem_budget, mem_level_name(level));
+    gap_append(&buf, &len, &cap, line, n);
+    n = snprintf(line, sizeof(line), "MEM queued %ld held %ld history %ld index %ld paused %d\n",
+                 atomic_load(&mem_queued), atomic_load(&mem_held), atomic_load(&mem_hist),
+                 index_mem_bytes(&server->index), server->mem_paused);
+    gap_append(&buf, &len, &cap, line, n);
+
+    for (int i = 0; i < MAX_ROOMS; i++) {
+        RoomActor *a = server->actors.rooms[i];
+        if (!a) continue;
+        n = snprintf(line, sizeof(line), "MEM room %s queued %ld held %ld history %ld\n", a->room.name,
+                     atomic_load(&a->room.mem_queued), atomic_load(&a->room.mem_held),
+                     atomic_load(&a->room.mem_hist));
+        gap_append(&buf, &len, &cap, line, n);
+    }
+
+    // 많이 쌓인 순으로 고르기 (이미 보여 준 것보다 작은 것 중 가장 큰 것)
+    long bound = LONG_MAX;
+    int last = -1;
+    for (int shown = 0; shown < MEM_STATS_TOP; shown++) {
+        int pick = -1;
+        long best = -1;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            ClientContext *c = &server->clients[i];
+            if (c->fd == -1) continue;
+            long q = atomic_load_explicit(&c->mem_queued, memory_order_relaxed);
+            if (q == 0 && c->relay_unacked == 0) continue;
+            if (q > bound || (q == bound && i <= last) || q <= best) continue;
+            best = q;
+            pick = i;
+        }
+        if (pick < 0) break;
+        ClientContext *c = &server->clients[pick];
+        n = snprintf(line, sizeof(line), "MEM conn %s fd %d queued %ld relay %ld%s\n",
+                     c->registered ? c->nickname : "-", c->fd, best, c->relay_unacked,
+                     c->mem_paused ? " paused" : c->mem_shed ? " shed" : "");
+        gap_append(&buf, &len, &cap, line, n);
+        bound = best;
+        last = pick;
+    }
+    gap_append(&buf, &len, &cap, "MEM end\n", 8);
+    if (buf) client_send(server, idx, buf, len);
+    free(buf);
+}
+
+/* 연결 종료 및 정리 */
+void disconnect_client(ServerContext *server, int idx) {
+    int fd = server->clients[idx].fd;
+    if (server->clients[idx].mem_paused) server->mem_paused--;
+    if (fd >= 0) {
+        if (server->clients[idx].registered) {
+            room_leave(server, idx, 0, 0);
+            nick_index_remove(server, idx);
+        }
+        for (int i = 0; i < server->clients[idx].nwatch; i++) {
+            room_watch(server, idx, server->clients[idx].watch[i], 0);
+        }
+        spool_abort(&server->clients[idx]);
+        close(fd);
+        FD_CLR(fd, &server->all_fds);
+        evlog(EV_DISCONNECT, fd, 0, server->clients[idx].nickname, server->clients[idx].room);
+        server->nclients--;
+    }
+    init_client(&server->clients[idx]);
+}
+
+/* 명령어 처리 로직 (/join, /msg, /file) */
+void process_command(ServerContext *server, int idx, char *line) {
+    ClientContext *cli = &server->clients[idx];
+    int fd = cli->fd;
+    char response[MAXBUF];
+
+    cli->msg_id = ++server->next_msg_id;
+    TRACE(parse, fd, cli->msg_id, (long)strlen(line));
+
+    // 1. /join <name> <room>
+    if (strncmp(line, "/join", 5) == 0) {
+        char name[MAXNAME], room[MAXROOM];
+        unsigned long long last_seq = 0;
+        int nf = sscanf(line, "/join %31s %31s %llu", name, room, &last_seq);
+        if (nf < 2) {
+            snprintf(response, sizeof(response), "ERR Usage: /join <name> <room>\n");
+            client_send(server, idx, response, strlen(response));
+            return;
+        }
+        int owner = nick_lookup(server, name);
+        if (owner != -1 && owner != idx) {
+            client_send(server, idx, "ERR Nickname in use\n", 20);
+            return;
+        }
 
-    // 1. /join <name> <room>
-    if (strncmp(line, "/join", 5) == 0) {
-        char name[MAXNAME], room[MAXROOM];
-        if (sscanf(line, "/join %31s %31s", name, room) != 2) {
-            snprintf(response, sizeof(response), "ERR Usage: /join <name> <room>\n");
-            send(fd, response, strlen(response), 0);
+        if (cli->handover_pending) {
+            client_send(server, idx, "ERR Room change in progress\n", 28);
             return;
         }
+        if (!actor_get(&server->actors, room)) {
+            client_send(server, idx, "ERR Too many rooms\n", 19);
+            return;
+        }
+
+        // 다시 /join 하면 이전 방에서 나간 것으로 처리 (못 보낸 출력은 새 방 actor 가 이어 보냄)
+        int moving = cli->registered && room_leave(server, idx, 0, 1) == 0;
+        if (cli->registered) nick_index_remove(server, idx);
+
         strncpy(cli->nickname, name, MAXNAME - 1);
         strncpy(cli->room, room, MAXROOM - 1);
         cli->registered = 1;
+        cli->want_seq = (nf == 3);  // 세 번째 인자(마지막 본 순번)가 있으면 재접속 지원 클라이언트
+        nick_index_add(server, idx);
 
-        printf("SERVER: fd=%d joined. Nick=%s, Room=%s\n", fd, cli->nickname, cli->room);
+        evlog(EV_JOIN, fd, 0, cli->nickname, cli->room);
         snprintf(response, sizeof(response), "OK Joined as %s in room %s\n", cli->nickname, cli->room);
-        send(fd, response, strlen(response), 0);
+        uint64_t token = cli->want_seq ? session_create(server, cli->nickname, cli->room) : 0;
+        room_join(server, idx, response, token, last_seq, 0, moving);
+    }
+    // /resume <token> <last_seq> : 토큰으로 이전 닉네임/방 복원 후 놓친 메시지만 받음
+    else if (strncmp(line, "/resume", 7) == 0) {
+        unsigned long long token = 0, last_seq = 0;
+        Session *sess = NULL;
+        if (sscanf(line, "/resume %llx %llu", &token, &last_seq) != 2 ||
+            (sess = session_find(server, token)) == NULL) {
+            client_send(server, idx, "ERR Unknown session\n", 20);
+            return;
+        }
+        int owner = nick_lookup(server, sess->nickname);
+        if (owner != -1 && owner != idx) {
+            client_send(server, idx, "ERR Nickname in use\n", 20);
+            return;
+        }
+        if (cli->handover_pending) {
+            client_send(server, idx, "ERR Room change in progress\n", 28);
+            return;
+        }
+        if (!actor_get(&server->actors, sess->room)) {
+            client_send(server, idx, "ERR Too many rooms\n", 19);
+            return;
+        }
+        int moving = cli->registered && room_leave(server, idx, 0, 1) == 0;
+        if (cli->registered) nick_index_remove(server, idx);
+
+        strncpy(cli->nickname, sess->nickname, MAXNAME - 1);
+        strncpy(cli->room, sess->room, MAXROOM - 1);
+        cli->registered = 1;
+        cli->want_seq = 1;
+        nick_index_add(server, idx);
+
+        evlog(EV_JOIN, fd, (int64_t)last_seq, cli->nickname, cli->room);
+        snprintf(response, sizeof(response), "OK Resumed as %s in room %s\n", cli->nickname, cli->room);
+        room_join(server, idx, response, session_create(server, cli->nickname, cli->room), last_seq, 0, moving);
+    }
+    // /dm <nick> <message> : 한 사람에게만 전송
+    else if (strncmp(line, "/dm", 3) == 0) {
+        if (!cli->registered) {
+            client_send(server, idx, "ERR Please /join first.\n", 24);
+            return;
+        }
+        char target[MAXNAME];
+        int off = 0;
+        if (sscanf(line, "/dm %31s %n", target, &off) != 1 || off == 0 || line[off] == '\0') {
+            client_send(server, idx, "ERR Usage: /dm <nick> <message>\n", 32);
+            return;
+        }
+        int t = nick_lookup(server, target);
+        if (t == -1) {
+            client_send(server, idx, "ERR No such user\n", 17);
+            return;
+        }
+        char packet[MAXBUF];
+        snprintf(packet, sizeof(packet), "DM %s %s\n", cli->nickname, line + off);
+        client_send(server, t, packet, strlen(packet));
+    }
+    // /who : 같은 방 접속자 명단 (길면 여러 줄로 나눠 전송)
+    else if (strncmp(line, "/who", 4) == 0) {
+        if (!cli->registered) {
+            client_send(server, idx, "ERR Please /join first.\n", 24);
+            return;
+        }
+        int len = snprintf(response, sizeof(response), "WHO %s", cli->room);
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            ClientContext *c = &server->clients[i];
+            if (c->fd == -1 || !c->registered || strcmp(c->room, cli->room) != 0) continue;
+            if (len + MAXNAME + 2 >= (int)sizeof(response)) {
+                response[len++] = '\n';
+                client_send(server, idx, response, len);
+                len = snprintf(response, sizeof(response), "WHO %s", cli->room);
+            }
+            len += snprintf(response + len, sizeof(response) - len, " %s", c->nickname);
+        }
+        response[len++] = '\n';
+        client_send(server, idx, response, len);
     }
     // 2. /msg <message>
+    // (순번을 받는 클라이언트에게는 ACK 아니면 "ERR Message not sent" 가 꼭 하나 돌아가 보낸 순서로 짝이 맞음)
     else if (strncmp(line, "/msg", 4) == 0) {
         if (!cli->registered) {
-            send(fd, "ERR Please /join first.\n", 24, 0);
+            const char *err = "ERR Message not sent: please /join first.\n";
+            client_send(server, idx, err, strlen(err));
             return;
         }
         char *msg = line + 4;
@@ -114,34 +3526,257 @@ void process_command(ServerContext *server, int idx, char *line) {
 
         char packet[MAXBUF];
         snprintf(packet, sizeof(packet), "[%s] %s\n", cli->nickname, msg);
-        broadcast_to_room(server, idx, packet, strlen(packet));
+        if (room_post(server, idx, packet, strlen(cli->nickname) + 3) < 0) {  // "[닉네임] " 뒤 본문만 색인
+            client_send(server, idx, "ERR Message not sent\n", 21);
+        }
     }
-    // 3. /file <filename> <size>
-    else if (strncmp(line, "/file", 5) == 0) {
+    // /credit <bytes> : 파일 중계를 이만큼 더 받을 수 있음 (처음 보내면 허락한 만큼만 받는 수신자가 됨)
+    else if (strncmp(line, "/credit", 7) == 0) {
+        if (!cli->registered) {
+            client_send(server, idx, "ERR Please /join first.\n", 24);
+            return;
+        }
+        long credit = -1;
+        if (sscanf(line, "/credit %ld", &credit) != 1 || credit < 0) {
+            client_send(server, idx, "ERR Usage: /credit <bytes>\n", 27);
+            return;
+        }
+        cli->credit_rx = 1;
+        room_credit(server, idx, credit);
+    }
+    // /fileref : 해시 업로드를 실시간 중계 대신 FILEREF 알림으로 받음 (받을지는 수신측이 /fetch 로 결정)
+    else if (strcmp(line, "/fileref") == 0) {
+        if (!cli->registered) {
+            client_send(server, idx, "ERR Please /join first.\n", 24);
+            return;
+        }
+        cli->fileref_rx = 1;
+        RoomActor *a = actor_find(&server->actors, cli->room);
+        RoomMsg *msg = a ? room_msg_new(RMSG_FILEREF, cli->serial, NULL, 0) : NULL;
+        if (msg) actor_post(&server->actors, a, msg);
+    }
+    // /stats mem : 메모리 사용량 (전체, 방별, 많이 쌓인 연결)
+    else if (strncmp(line, "/stats", 6) == 0) {
         if (!cli->registered) {
-            send(fd, "ERR Please /join first.\n", 24, 0);
+            client_send(server, idx, "ERR Please /join first.\n", 24);
             return;
         }
-        char fname[256];
+        char what[16] = "";
+        if (sscanf(line, "/stats %15s", what) != 1 || strcmp(what, "mem") != 0) {
+            client_send(server, idx, "ERR Usage: /stats mem\n", 22);
+            return;
+        }
+        send_mem_stats(server, idx);
+    }
+    // /search <terms> : 현재 방 기록 검색
+    else if (strncmp(line, "/search", 7) == 0) {
+        if (!cli->registered) {
+            client_send(server, idx, "ERR Please /join first.\n", 24);
+            return;
+        }
+        const char *query = line + 7;
+        while (*query == ' ') query++;
+        handle_search(server, idx, query);
+    }
+    // 3. /file <filename> <size> [hash]
+    // (거절은 "ERR File not sent" 로 시작: SEND/SKIP 을 기다리던 클라이언트가 업로드를 접을 수 있게)
+    else if (strncmp(line, "/file", 5) == 0) {
+        const char *err = NULL;
+        char fname[256], hex[HASHLEN + 2] = "";
         long fsize = 0;
-        if (sscanf(line, "/file %255s %ld", fname, &fsize) != 2 || fsize <= 0) {
-            send(fd, "ERR Usage: /file <name> <size>\n", 31, 0);
+        int nf = sscanf(line, "/file %255s %ld %65s", fname, &fsize, hex);
+        if (!cli->registered) err = "ERR File not sent: please /join first.\n";
+        else if (nf < 2 || fsize <= 0 || (nf == 3 && !valid_hash(hex))) err = "ERR File not sent: usage /file <name> <size> [hash]\n";
+        if (err) {
+            client_send(server, idx, err, strlen(err));
             return;
         }
 
+        // 해시를 알린 클라이언트: 스풀에 이미 있으면 업로드 자체를 생략
+        // (FILEREF 를 모르는 참여자에게는 스풀 파일을 구버전 헤더 뒤에 이어 보냄)
+        if (nf == 3 && spool_has(hex, fsize)) {
+            snprintf(response, sizeof(response), "SKIP %s\n", hex);
+            client_send(server, idx, response, strlen(response));
+
+            char ref[MAXBUF], path[HASHLEN + 16];
+            snprintf(ref, sizeof(ref), "FILEREF %s %s %ld %s\n", cli->nickname, fname, fsize, hex);
+            room_post_to(server, idx, cli->room, ref, -1, AUD_FILEREF);
+            snprintf(path, sizeof(path), SPOOL_DIR "/%s", hex);
+            int sfd = open(path, O_RDONLY);
+            if (sfd >= 0) {
+                snprintf(ref, sizeof(ref), "FILE %s %s %ld\n", cli->nickname, fname, fsize);
+                room_post_raw(server, idx, ref, strlen(ref), fsize, AUD_LEGACY, sfd);
+            }
+            evlog(EV_DEDUP_HIT, fd, fsize, fname, hex);
+            return;
+        }
+
+        // 스풀 임시 파일에 기록하고, 다 받으면 작업 스레드가 해시를 검증
+        // (검증 중인 이전 업로드와 겹치지 않도록 업로드마다 다른 이름)
+        // (프로세스 ID 를 넣어 업그레이드 전후 프로세스끼리도 겹치지 않게 하고, 남은 파일이 있으면 다음 번호로)
+        static unsigned upload_no = 0;
+        mkdir(SPOOL_DIR, 0755);
+        for (int tries = 0; tries < 16; tries++) {
+            snprintf(cli->spool_part, sizeof(cli->spool_part), SPOOL_DIR "/.part.%d.%d.%u", (int)getpid(), fd, upload_no++);
+            cli->spool_fd = open(cli->spool_part, O_RDWR | O_CREAT | O_EXCL, 0644);  // 검증 작업이 다시 읽음
+            if (cli->spool_fd >= 0 || errno != EEXIST) break;
+        }
+        if (cli->spool_fd < 0) perror("spool open");
+
         // 상태 전환: 파일 데이터 수신 모드
         cli->file_remain = fsize;
+        cli->file_size = fsize;
+        snprintf(cli->file_name, sizeof(cli->file_name), "%s", fname);
+        cli->file_relay = (nf == 2);
+        strcpy(cli->file_claimed, nf == 3 ? hex : "");
 
-        // 같은 방 사람들에게 파일 수신 알림 (헤더 전송)
+        // 같은 방 사람들에게 파일 수신 알림 (헤더 전송) 후 실시간 중계. 해시 업로드면 FILEREF 를 모르는
+        // 참여자에게만 중계하고, 업로더에게 업로드를 허가한 뒤 완료되면 나머지에게 FILEREF 로 알림
+        // (수신측이 필요할 때만 받게 함)
         char header[MAXBUF];
         snprintf(header, sizeof(header), "FILE %s %s %ld\n", cli->nickname, fname, fsize);
-        broadcast_to_room(server, idx, header, strlen(header));
+        room_post_raw(server, idx, header, strlen(header), fsize, cli->file_relay ? AUD_ALL : AUD_LEGACY, -1);
+        if (!cli->file_relay) {
+            snprintf(response, sizeof(response), "SEND %s\n", hex);
+            client_send(server, idx, response, strlen(response));
+        }
 
-        printf("SERVER: fd=%d started file transfer '%s' (%ld bytes)\n", fd, fname, fsize);
+        evlog(EV_FILE_START, fd, fsize, fname, cli->file_claimed);
+    }
+    // 4. /fetch <hash> <filename> : 스풀에 있는 파일 내려받기
+    else if (strncmp(line, "/fetch", 6) == 0) {
+        // 파일은 방 actor 가 논블로킹으로 나눠 보내므로 입장한 연결만 (이벤트 루프가 직접 보내면 멈춘 상대에 묶임)
+        if (!cli->registered) {
+            client_send(server, idx, "ERR Please /join first.\n", 24);
+            return;
+        }
+        char hex[HASHLEN + 2], fname[256];
+        if (sscanf(line, "/fetch %65s %255s", hex, fname) != 2 || !valid_hash(hex)) {
+            client_send(server, idx, "ERR Usage: /fetch <hash> <name>\n", 32);
+            return;
+        }
+        char path[HASHLEN + 16];
+        snprintf(path, sizeof(path), SPOOL_DIR "/%s", hex);
+        int sfd = open(path, O_RDONLY);
+        struct stat st;
+        if (sfd < 0 || fstat(sfd, &st) < 0) {
+            if (sfd >= 0) close(sfd);
+            client_send(server, idx, "ERR No such file\n", 17);
+            return;
+        }
+
+        snprintf(response, sizeof(response), "FILE server %s %ld %s\n", fname, (long)st.st_size, hex);
+
+        // 머리줄과 파일을 방 actor 가 참여자 대기열로 (다른 출력 사이에 끼지 않게)
+        RoomActor *a = actor_find(&server->actors, cli->room);
+        RoomMsg *msg = a ? room_msg_new(RMSG_DELIVER, cli->serial, response, strlen(response)) : NULL;
+        if (!msg) {
+            close(sfd);
+            client_send(server, idx, "ERR No such file\n", 17);
+            return;
+        }
+        msg->fd = sfd;
+        msg->relay_size = st.st_size;
+        actor_post(&server->actors, a, msg);
+    }
+    // /watch, /unwatch, /post : 입장한 방 외에 다른 방도 받기
+    else if (strncmp(line, "/watch", 6) == 0 || strncmp(line, "/unwatch", 8) == 0 || strncmp(line, "/post", 5) == 0) {
+        handle_watch(server, idx, line);
     }
     else {
-        send(fd, "ERR Unknown command\n", 20, 0);
+        client_send(server, idx, "ERR Unknown command\n", 20);
+    }
+}
+
+/* 업로드 검증 작업: 스풀 임시 파일 해시 계산 → 알린 해시와 비교 → 스풀에 확정 */
+typedef enum { VERIFY_STORED = 0, VERIFY_MISMATCH, VERIFY_FAILED } VerifyResult;
+
+typedef struct {
+    Task base;
+    int idx;                    // 업로드한 클라이언트 슬롯
+    uint64_t serial;            // 그 슬롯의 연결 번호 (완료 전에 끊겼는지 확인)
+    int spool_fd;               // 작업이 넘겨받은 임시 파일
+    char spool_part[64];
+    long size;
+    char claimed[HASHLEN + 1];
+    char hex[HASHLEN + 1];      // 계산된 해시
+    VerifyResult result;
+} VerifyTask;
+
+static void verify_run(Task *task) {
+    VerifyTask *vt = (VerifyTask *)task;
+    unsigned char buf[65536];
+    Sha256 h;
+    off_t off = 0;
+    ssize_t n;
+
+    vt->result = VERIFY_FAILED;
+    sha256_init(&h);
+    while ((n = pread(vt->spool_fd, buf, sizeof(buf), off)) > 0) {
+        sha256_update(&h, buf, n);
+        off += n;
+    }
+    close(vt->spool_fd);
+    sha256_hex(&h, vt->hex);
+
+    if (n < 0 || off != vt->size) {
+        perror("spool verify");
+    } else if (vt->claimed[0] && strcmp(vt->hex, vt->claimed) != 0) {
+        vt->result = VERIFY_MISMATCH;
+    } else {
+        char path[HASHLEN + 16];
+        snprintf(path, sizeof(path), SPOOL_DIR "/%s", vt->hex);
+        if (rename(vt->spool_part, path) == 0) {
+            vt->result = VERIFY_STORED;
+            return;
+        }
+        perror("spool rename");
+    }
+    unlink(vt->spool_part);
+}
+
+/* 검증 결과 알림 (업로더가 그새 나갔으면 파일만 스풀에 남음) */
+static void verify_done(ServerContext *server, Task *task) {
+    VerifyTask *vt = (VerifyTask *)task;
+    ClientContext *cli = &server->clients[vt->idx];
+    int alive = cli->fd >= 0 && cli->serial == vt->serial;
+    evlog(EV_FILE_DONE, alive ? cli->fd : -1, vt->size, alive ? cli->file_name : NULL, vt->hex);
+
+    if (alive && !cli->file_relay) {
+        if (vt->result == VERIFY_MISMATCH) {
+            client_send(server, vt->idx, "ERR Hash mismatch\n", 18);
+        } else if (vt->result == VERIFY_FAILED) {
+            client_send(server, vt->idx, "ERR Spool failed\n", 17);
+        } else {
+            char ref[MAXBUF];
+            snprintf(ref, sizeof(ref), "FILEREF %s %s %ld %s\n", cli->nickname, cli->file_name, vt->size, vt->hex);
+            room_post_to(server, vt->idx, cli->room, ref, -1, AUD_FILEREF);
+        }
+    }
+    free(vt);
+}
+
+/* 파일 업로드 완료: 해시 검증과 스풀 확정은 작업 스레드에 맡기고, 결과는 verify_done 에서 */
+void finish_file_upload(ServerContext *server, int idx) {
+    ClientContext *cli = &server->clients[idx];
+    VerifyTask *vt = (cli->spool_fd >= 0) ? calloc(1, sizeof(VerifyTask)) : NULL;
+    if (!vt) {
+        spool_abort(cli);
+        evlog(EV_FILE_DONE, cli->fd, cli->file_size, cli->file_name, NULL);
+        if (!cli->file_relay) client_send(server, idx, "ERR Spool failed\n", 17);
+        return;
     }
+
+    vt->base.run = verify_run;
+    vt->base.done = verify_done;
+    vt->idx = idx;
+    vt->serial = cli->serial;
+    vt->spool_fd = cli->spool_fd;
+    vt->size = cli->file_size;
+    memcpy(vt->spool_part, cli->spool_part, sizeof(vt->spool_part));
+    memcpy(vt->claimed, cli->file_claimed, sizeof(vt->claimed));
+    cli->spool_fd = -1;  // 임시 파일은 이제 작업 소유 (연결이 끊겨도 지우지 않음)
+    pool_submit(&server->pool, &vt->base);
 }
 
 /* 수신된 데이터 처리 (버퍼링 및 파싱) */
@@ -155,153 +3790,825 @@ void handle_client_data(ServerContext *server, int idx) {
         disconnect_client(server, idx);
         return;
     }
+    TRACE(recv, cli->fd, server->next_msg_id + 1, (long)nbytes);   // 이 데이터에서 나올 첫 명령 번호
+
+    // 파일 데이터와 명령 줄이 한 번의 recv 에 섞여 올 수 있음 (업로드 중 미뤄 둔 명령이 마지막 데이터 바로 뒤에,
+    // 또는 /file 줄 바로 뒤에 데이터가). 명령은 한 줄씩 처리해 /file 로 모드가 바뀌면 남은 바이트를 파일로 읽음
+    const char *p = buf;
+    long left = nbytes;
+    while (left > 0 && cli->fd != -1) {
+        // 2. 파일 데이터 모드인 경우: 스풀 기록, 구버전이면 즉시 브로드캐스트 (해시는 완료 후 작업 스레드에서)
+        if (cli->file_remain > 0) {
+            long to_send = (left > cli->file_remain) ? cli->file_remain : left;
+
+            if (cli->spool_fd >= 0 && write(cli->spool_fd, p, to_send) != to_send) {
+                perror("spool write");
+                spool_abort(cli);
+            }
+
+            // 같은 방 인원에게 바이너리 데이터 전송 (받는 쪽이 밀리면 업로더 읽기를 멈춤).
+            // 해시 업로드도 FILEREF 를 모르는 참여자에게는 실시간으로 (방 actor 가 헤더를 받은 참여자에게만 보냄)
+            room_post_relay(server, idx, p, to_send);
+
+            cli->file_remain -= to_send;
+            if (cli->file_remain <= 0) {
+                finish_file_upload(server, idx);
+            }
+            p += to_send;
+            left -= to_send;
+            continue;
+        }
 
-    // 2. 파일 데이터 모드인 경우: 버퍼링 없이 즉시 브로드캐스트
-    if (cli->file_remain > 0) {
-        long to_send = (nbytes > cli->file_remain) ? cli->file_remain : nbytes;
-        
-        // 같은 방 인원에게 바이너리 데이터 전송
-        broadcast_to_room(server, idx, buf, to_send);
-        
-        cli->file_remain -= to_send;
-        if (cli->file_remain <= 0) {
-            printf("SERVER: fd=%d file transfer complete\n", cli->fd);
+        // 3. 일반 텍스트 모드: 다음 개행까지 버퍼에 쌓고 줄이 끝나면 처리
+        const char *nl = memchr(p, '\n', left);
+        long take = nl ? (nl - p) + 1 : left;
+        if (cli->cmd_len + take >= MAXBUF) cli->cmd_len = 0;    // 너무 긴 줄: 쌓인 것은 버림
+        long keep = (take < MAXBUF - 1) ? take : MAXBUF - 1;
+        memcpy(cli->cmd_buf + cli->cmd_len, p, keep);
+        cli->cmd_len += keep;
+        cli->cmd_buf[cli->cmd_len] = '\0'; // 안전장치
+        p += take;
+        left -= take;
+        if (!nl) break;
+
+        // 개행과 캐리지 리턴(\r) 제거 후 처리
+        if (cli->cmd_buf[cli->cmd_len - 1] == '\n') cli->cmd_buf[--cli->cmd_len] = '\0';
+        if (cli->cmd_len > 0 && cli->cmd_buf[cli->cmd_len - 1] == '\r') cli->cmd_buf[--cli->cmd_len] = '\0';
+        cli->cmd_len = 0;
+        if (cli->cmd_buf[0] != '\0') {
+            process_command(server, idx, cli->cmd_buf);
         }
-        
-        // 파일 데이터 뒤에 붙어온 텍스트 명령어가 있다면? (복잡한 경우)
-        // 이 예제에서는 파일 데이터와 명령어가 정확히 분리된다고 가정하거나
-        // 남은 데이터를 버립니다. 실무에선 링버퍼가 필요합니다.
-        return; 
     }
+}
+
+/* 현재 프로세스의 상주 메모리(RSS) 크기 (KB) */
+long current_rss_kb(void) {
+    long pages_total = 0, pages_resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp) return 0;
+    if (fscanf(fp, "%ld %ld", &pages_total, &pages_resident) != 2) pages_resident = 0;
+    fclose(fp);
+    return pages_resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* 입장 거절: 재시도 시각을 알려주고 즉시 끊음 (절대 블록하지 않음) */
+void reject_connection(int fd, const char *peer, int reason) {
+    char busy[64];
+    snprintf(busy, sizeof(busy), "BUSY retry-after %d\n", RETRY_AFTER_BASE + rand() % (RETRY_AFTER_JITTER + 1));
+    send(fd, busy, strlen(busy), MSG_DONTWAIT | MSG_NOSIGNAL);
+    evlog(EV_REJECT, fd, reason, peer, NULL);
+    close(fd);
+}
+
+/* ---------------------------------------------------------------------------
+ * 리슨 소켓: TCP 외에 같은 머신의 봇/브리지용 UNIX 도메인 소켓(파일 경로, abstract)
+ *
+ * 로컬 연결은 TCP/IP 스택(체크섬, 혼잡 제어, loopback 경유)을 거치지 않아 지연과 복사가 적다.
+ * 모두 SOCK_STREAM 이라 accept 이후는 TCP 연결과 똑같이 다룬다.
+ * ------------------------------------------------------------------------- */
+int open_tcp_listener(int port, int backlog) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) { perror("socket"); return -1; }
+
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0 || listen(fd, backlog) < 0) {
+        perror("bind tcp");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* abstract 이면 sun_path 첫 바이트를 0으로 (파일 없이 이름만 커널에 있음, 프로세스가 끝나면 사라짐) */
+int open_unix_listener(const char *name, int abstract, int backlog) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
 
-    // 3. 일반 텍스트 모드: 버퍼에 쌓고 개행 문자 단위로 처리
-    // 버퍼 오버플로우 방지
-    if (cli->cmd_len + nbytes >= MAXBUF) {
-        // 버퍼가 꽉 찼다면 비우거나 에러 처리 (여기선 초기화)
-        cli->cmd_len = 0; 
+    // 잘린 이름으로 엉뚱한 경로에 bind 하지 않도록 sun_path 에 다 안 들어가면 거절
+    size_t max = abstract ? sizeof(addr.sun_path) - 1 : sizeof(addr.sun_path);
+    if (strlen(name) == 0 || strlen(name) >= max) {
+        fprintf(stderr, "SERVER: unix socket name too long (max %zu bytes): %s\n", max - 1, name);
+        return -1;
     }
-    
-    memcpy(cli->cmd_buf + cli->cmd_len, buf, nbytes);
-    cli->cmd_len += nbytes;
-    cli->cmd_buf[cli->cmd_len] = '\0'; // 안전장치
-
-    // 개행 문자(\n)가 있는지 확인하며 처리
-    char *p;
-    while ((p = strchr(cli->cmd_buf, '\n')) != NULL) {
-        *p = '\0'; // 개행을 null로 변경하여 문자열 분리
-        
-        // 캐리지 리턴(\r) 처리
-        if (p > cli->cmd_buf && *(p-1) == '\r') *(p-1) = '\0';
-
-        if (strlen(cli->cmd_buf) > 0) {
-            process_command(server, idx, cli->cmd_buf);
+
+    socklen_t len;
+    if (abstract) {
+        memcpy(addr.sun_path + 1, name, strlen(name));
+        len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name);
+    } else {
+        memcpy(addr.sun_path, name, strlen(name));
+        len = sizeof(addr);
+
+        // 이전 실행이 남긴 소켓 파일만 지움. 소켓이 아닌 파일이거나 아직 받는 서버가 있으면 건드리지 않음
+        struct stat st;
+        if (lstat(name, &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                fprintf(stderr, "SERVER: %s exists and is not a socket\n", name);
+                return -1;
+            }
+            int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            int live = probe >= 0 && connect(probe, (struct sockaddr *)&addr, len) == 0;
+            if (probe >= 0) close(probe);
+            if (live) {
+                fprintf(stderr, "SERVER: another server is listening on %s\n", name);
+                return -1;
+            }
+            unlink(name);
         }
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) { perror("unix socket"); return -1; }
 
-        // 처리한 부분 제거하고 버퍼 앞으로 당기기 (memmove)
-        int processed_len = (p - cli->cmd_buf) + 1;
-        int remaining = cli->cmd_len - processed_len;
-        
-        memmove(cli->cmd_buf, cli->cmd_buf + processed_len, remaining);
-        cli->cmd_len = remaining;
-        cli->cmd_buf[cli->cmd_len] = '\0';
+    if (bind(fd, (struct sockaddr *)&addr, len) < 0 || listen(fd, backlog) < 0) {
+        perror(abstract ? "bind abstract" : "bind unix");
+        close(fd);
+        return -1;
     }
+    return fd;
 }
 
-/* 새 연결 수락 */
-void handle_new_connection(ServerContext *server) {
-    struct sockaddr_in cli_addr;
-    socklen_t addrlen = sizeof(cli_addr);
-    int newfd = accept(server->listenfd, (struct sockaddr *)&cli_addr, &addrlen);
-    
-    if (newfd < 0) {
-        perror("accept");
+/* 리슨 소켓 주소를 "tcp:3490", "unix:/path", "abstract:name" 형태로 (넘겨받은 소켓에도 사용) */
+void listener_describe(int fd, char *out, size_t size) {
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    snprintf(out, size, "fd:%d", fd);
+    if (getsockname(fd, (struct sockaddr *)&ss, &len) < 0) return;
+
+    if (ss.ss_family == AF_INET) {
+        snprintf(out, size, "tcp:%d", ntohs(((struct sockaddr_in *)&ss)->sin_port));
+    } else if (ss.ss_family == AF_UNIX) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&ss;
+        int n = len - offsetof(struct sockaddr_un, sun_path);
+        if (n > 0 && un->sun_path[0] == '\0') snprintf(out, size, "abstract:%.*s", n - 1, un->sun_path + 1);
+        else snprintf(out, size, "unix:%s", un->sun_path);
+    }
+}
+
+/* 정상 종료 때 파일 경로 UNIX 리슨 소켓을 지움 (핸드오프로 넘길 때는 새 프로세스가 계속 쓰므로 호출 안 함) */
+void listener_unlink(int fd) {
+    struct sockaddr_un un;
+    socklen_t len = sizeof(un);
+    if (getsockname(fd, (struct sockaddr *)&un, &len) < 0 || un.sun_family != AF_UNIX) return;
+    if (len <= offsetof(struct sockaddr_un, sun_path) || un.sun_path[0] == '\0') return;  // abstract: 파일 없음
+
+    struct stat st;
+    if (lstat(un.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(un.sun_path);
+}
+
+/* 접속한 상대 표시: TCP 는 주소, UNIX 소켓은 상대 프로세스 번호 */
+static void peer_describe(int fd, const struct sockaddr_storage *ss, char *out, size_t size) {
+    if (ss->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)ss)->sin_addr, out, size);
         return;
     }
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) snprintf(out, size, "unix:%d", (int)cred.pid);
+    else snprintf(out, size, "unix");
+}
 
-    // 빈 슬롯 찾기
-    int idx = -1;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (server->clients[i].fd == -1) {
-            idx = i;
-            break;
+/* 새 연결 수락: 대기열이 빌 때까지(EAGAIN) 최대 accept_budget 개를 한 번에 처리 */
+void handle_new_connection(ServerContext *server, int listenfd) {
+    // 메모리 사용량은 연결마다가 아니라 한 번 깨어날 때 한 번만 확인
+    int over_memory = server->max_rss_kb > 0 && current_rss_kb() > server->max_rss_kb;
+
+    for (int n = 0; n < server->accept_budget; n++) {
+        struct sockaddr_storage cli_addr;
+        socklen_t addrlen = sizeof(cli_addr);
+        int newfd = accept4(listenfd, (struct sockaddr *)&cli_addr, &addrlen, SOCK_CLOEXEC);
+
+        if (newfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return; // 대기열 비움
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            return;
+        }
+
+        char peer[64];
+        peer_describe(newfd, &cli_addr, peer, sizeof(peer));
+        if (over_memory) { reject_connection(newfd, peer, REJECT_MEMORY); continue; }
+        if (server->nclients >= server->max_clients) { reject_connection(newfd, peer, REJECT_CLIENTS); continue; }
+
+        // 빈 슬롯 찾기 (이전 연결의 출력이 아직 방에서 안 빠진 슬롯은 가능하면 피함)
+        int idx = -1;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (server->clients[i].fd != -1) continue;
+            if (idx == -1) idx = i;
+            if (atomic_load_explicit(&server->clients[i].mem_queued, memory_order_relaxed) == 0) {
+                idx = i;
+                break;
+            }
+        }
+
+        if (idx == -1) {
+            reject_connection(newfd, peer, REJECT_CLIENTS);
+            continue;
+        }
+
+        // 등록
+        init_client(&server->clients[idx]);
+        server->clients[idx].fd = newfd;
+        server->nclients++;
+
+        FD_SET(newfd, &server->all_fds);
+        if (newfd > server->max_fd) server->max_fd = newfd;
+
+        evlog(EV_CONNECT, newfd, 0, peer, NULL);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * 무중단 업그레이드 (hot restart)
+ *
+ * 실행 중인 서버는 UPGRADE_SOCK 에서 대기한다. 새 바이너리를 --upgrade 로 실행하면
+ * 그 소켓에 접속하고, 기존 서버는 리슨 소켓과 각 클라이언트 소켓(SCM_RIGHTS)을
+ * ClientContext 상태, 방 actor 가 아직 못 보낸 출력, 재접속 토큰 표와 함께 넘긴다.
+ * 새 프로세스가 ACK를 보내면 기존 서버는 소켓을 닫지 않고(연결은 새 프로세스가
+ * 그대로 이어받음) 종료한다. ACK가 오지 않으면 기존 서버가 그대로 계속 서비스한다.
+ * ------------------------------------------------------------------------- */
+typedef enum { HANDOFF_LISTENER = 1, HANDOFF_CLIENT, HANDOFF_OUTPUT, HANDOFF_SESSION, HANDOFF_END } HandoffKind;
+
+/* 바이너리 간 구조체 배치가 달라도 되도록 명시적인 직렬화 형식을 사용 */
+typedef struct {
+    uint32_t magic;
+    uint32_t kind;
+    int32_t  registered;
+    int32_t  cmd_len;
+    int32_t  file_relay;
+    int32_t  has_spool;             // 1이면 두 번째 fd가 스풀 임시 파일
+    int32_t  want_seq;
+    int32_t  credit_rx;
+    int32_t  relay_rx;              // 방에서 진행 중인 중계를 받던 수신자
+    int32_t  fileref_rx;
+    int64_t  credit;                // 크레딧 수신자의 남은 크레딧
+    int64_t  file_remain;
+    int64_t  file_size;
+    int32_t  nwatch;
+    char nickname[MAXNAME];
+    char room[MAXROOM];
+    char file_name[256];
+    char file_claimed[HASHLEN + 1];
+    char spool_part[64];
+    char cmd_buf[MAXBUF];
+    char watch[MAX_WATCH][MAXROOM];
+
+    /* OUTPUT: 바로 앞 CLIENT 의 못 보낸 출력 한 조각 (fd 가 함께 오면 그 파일의 [out_off, out_len)) */
+    int32_t  out_held;              // 1이면 받던 중계가 끝난 뒤에 보낼 출력
+    int32_t  out_relay;
+    int64_t  out_off, out_len;
+    char out_data[HANDOFF_OUT_MAX];
+
+    /* SESSION: 재접속 토큰 (nickname/room 과 함께), END: 명령 추적 번호 */
+    uint64_t token;
+    int64_t  last_used;
+    uint64_t next_msg_id;
+} HandoffRecord;
+
+const char *upgrade_sock_path(void) {
+    const char *path = getenv("CHAT_UPGRADE_SOCK");
+    return path ? path : UPGRADE_SOCK;
+}
+
+/* 레코드 하나와 fd 최대 2개를 한 메시지로 전송 */
+int send_handoff(int sock, HandoffRecord *rec, int *fds, int nfds) {
+    struct iovec iov = { rec, sizeof(*rec) };
+    char ctrl[CMSG_SPACE(sizeof(int) * 2)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(ctrl, 0, sizeof(ctrl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nfds > 0) {
+        msg.msg_control = ctrl;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    }
+    return sendmsg(sock, &msg, 0) == (ssize_t)sizeof(*rec) ? 0 : -1;
+}
+
+/* 레코드 하나와 함께 온 fd들을 수신. 받은 fd 개수 반환 (-1: 오류) */
+int recv_handoff(int sock, HandoffRecord *rec, int *fds) {
+    struct iovec iov = { rec, sizeof(*rec) };
+    char ctrl[CMSG_SPACE(sizeof(int) * 2)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(*rec) || rec->magic != HANDOFF_MAGIC) return -1;
+
+    int nfds = 0;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cm), sizeof(int) * nfds);
         }
     }
+    return nfds;
+}
+
+/* 업그레이드 요청 대기 소켓 생성 (같은 사용자만 접속 가능하도록 0600) */
+int open_upgrade_listener(void) {
+    const char *path = upgrade_sock_path();
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0) { perror("upgrade socket"); return -1; }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    unlink(path);
+    mode_t old_mask = umask(077);
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (rc < 0 || listen(fd, 1) < 0) {
+        perror("upgrade bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* 참여자의 못 보낸 출력 목록을 OUTPUT 레코드로 (메모리 조각은 잘라서 싣고, 파일 조각은 fd 를 함께).
+   기존 서버가 계속 서비스할 수도 있으므로 목록은 건드리지 않음 */
+static int send_handoff_output(int sock, HandoffRecord *rec, const OutChunk *c, int held) {
+    for (; c; c = c->next) {
+        memset(rec, 0, sizeof(*rec));
+        rec->magic = HANDOFF_MAGIC;
+        rec->kind = HANDOFF_OUTPUT;
+        rec->out_held = held;
+        rec->out_relay = c->relay;
+        if (c->file_fd >= 0) {
+            rec->out_off = c->off;
+            rec->out_len = c->len;
+            int fd = c->file_fd;
+            if (send_handoff(sock, rec, &fd, 1) < 0) return -1;
+            continue;
+        }
+        for (size_t off = c->off; off < c->len; off += rec->out_len) {
+            rec->out_len = (c->len - off < HANDOFF_OUT_MAX) ? c->len - off : HANDOFF_OUT_MAX;
+            memcpy(rec->out_data, c->data + off, rec->out_len);
+            if (send_handoff(sock, rec, NULL, 0) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/* 기존 서버 측: 새 프로세스에 모든 소켓과 상태를 넘기고, 성공하면 종료 */
+void handle_upgrade_request(ServerContext *server) {
+    int sock = accept(server->upgradefd, NULL, NULL);
+    if (sock < 0) { perror("upgrade accept"); return; }
 
-    if (idx == -1) {
-        printf("SERVER: Too many clients. Rejected.\n");
-        close(newfd);
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid()) {
+        close(sock);
         return;
     }
+    // 새 프로세스가 멈추거나 ACK 를 안 보내도 기존 서버가 묶여 있지 않도록 송수신에 시간 제한
+    struct timeval tv = { UPGRADE_TIMEOUT_SEC, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 
-    // 등록
-    init_client(&server->clients[idx]);
-    server->clients[idx].fd = newfd;
-    
-    FD_SET(newfd, &server->all_fds);
-    if (newfd > server->max_fd) server->max_fd = newfd;
+    // 새 프로세스는 기록/색인/스풀을 디스크에서 읽으므로 진행 중인 작업을 모두 끝내고 넘김
+    actors_sync(&server->actors);
+    pool_complete(server);          // 방 actor 가 보낸 색인 요청과 방을 옮기는 연결의 남은 출력 반영
+    index_flush(&server->index);
+    pool_wait_idle(server);
+    pool_complete(server);
+    // 마지막으로 한 번 더 비우고 방 스레드의 출력을 멈춤: 이제부터 참여자 대기열은 이벤트 루프가 읽어 넘김
+    atomic_store(&server->actors.frozen, 1);
+    actors_sync(&server->actors);
 
-    printf("SERVER: New connection from %s, assigned fd=%d\n", 
-           inet_ntoa(cli_addr.sin_addr), newfd);
+    // 진행 중인 중계 뒤로 미뤄 둔 명령은 아직 처리 전이라 넘길 수 없음: 중계가 끝난 뒤 다시 시도하게 함
+    const char *busy = actors_held_room(&server->actors);
+    HandoffRecord *rec = busy ? NULL : calloc(1, sizeof(HandoffRecord));
+    if (!rec) {
+        if (busy) fprintf(stderr, "SERVER: upgrade postponed, room %s has commands queued behind an upload\n", busy);
+        atomic_store(&server->actors.frozen, 0);
+        close(sock);
+        return;
+    }
+    int ok = 1, nclients = 0, ncut = 0;
+
+    rec->magic = HANDOFF_MAGIC;
+    rec->kind = HANDOFF_LISTENER;
+    for (int i = 0; ok && i < server->nlisteners; i++) {
+        ok = send_handoff(sock, rec, &server->listenfds[i], 1) == 0;
+    }
+
+    for (int i = 0; ok && i < MAX_CLIENTS; i++) {
+        ClientContext *c = &server->clients[i];
+        if (c->fd == -1) continue;
+        // 앞 방의 중계를 마저 받으며 방을 옮기는 중인 연결은 넘기지 않음: ACK 뒤 이 프로세스가 끝날 때
+        // 소켓이 닫히고, 클라이언트는 /resume 으로 놓친 메시지를 받음 (ACK 가 안 오면 그대로 서비스)
+        if (c->handover_pending) { ncut++; continue; }
+
+        memset(rec, 0, sizeof(*rec));
+        rec->magic = HANDOFF_MAGIC;
+        rec->kind = HANDOFF_CLIENT;
+        rec->registered = c->registered;
+        rec->cmd_len = c->cmd_len;
+        rec->file_relay = c->file_relay;
+        rec->has_spool = (c->spool_fd >= 0);
+        rec->want_seq = c->want_seq;
+        rec->credit_rx = c->credit_rx;
+        rec->fileref_rx = c->fileref_rx;
+        RoomMember *m = c->registered ? actor_member(&server->actors, c->room, c->serial) : NULL;
+        rec->credit = m ? m->credit : 0;
+        rec->relay_rx = m && m->in_relay;
+        rec->file_remain = c->file_remain;
+        rec->file_size = c->file_size;
+        memcpy(rec->nickname, c->nickname, MAXNAME);
+        memcpy(rec->room, c->room, MAXROOM);
+        memcpy(rec->file_name, c->file_name, sizeof(rec->file_name));
+        memcpy(rec->file_claimed, c->file_claimed, sizeof(rec->file_claimed));
+        memcpy(rec->spool_part, c->spool_part, sizeof(rec->spool_part));
+        memcpy(rec->cmd_buf, c->cmd_buf, MAXBUF);
+        rec->nwatch = c->nwatch;
+        memcpy(rec->watch, c->watch, sizeof(rec->watch));
+
+        int fds[2] = { c->fd, c->spool_fd };
+        ok = send_handoff(sock, rec, fds, rec->has_spool ? 2 : 1) == 0;
+        if (ok && m && !m->dead) {
+            ok = send_handoff_output(sock, rec, m->out_head, 0) == 0 &&
+                 send_handoff_output(sock, rec, m->held_head, 1) == 0;
+        }
+        nclients++;
+    }
+
+    for (int i = 0; ok && i < MAX_SESSIONS; i++) {
+        Session *sess = &server->sessions[i];
+        if (!sess->token) continue;
+        memset(rec, 0, sizeof(*rec));
+        rec->magic = HANDOFF_MAGIC;
+        rec->kind = HANDOFF_SESSION;
+        rec->token = sess->token;
+        rec->last_used = sess->last_used;
+        memcpy(rec->nickname, sess->nickname, MAXNAME);
+        memcpy(rec->room, sess->room, MAXROOM);
+        ok = send_handoff(sock, rec, NULL, 0) == 0;
+    }
+
+    if (ok) {
+        memset(rec, 0, sizeof(*rec));
+        rec->magic = HANDOFF_MAGIC;
+        rec->kind = HANDOFF_END;
+        rec->next_msg_id = server->next_msg_id;
+        ok = send_handoff(sock, rec, NULL, 0) == 0;
+    }
+    free(rec);
+
+    // 새 프로세스가 모두 받았다는 ACK를 보내야만 종료. 시간 안에 ACK 가 오면 'G' 로 서비스 시작을
+    // 알리고, 시간이 지나 계속 서비스하기로 했으면 'G' 없이 닫아 새 프로세스가 포기하게 함 (두 프로세스가 같은 소켓을 읽지 않도록)
+    char ack = 0;
+    if (ok && recv(sock, &ack, 1, 0) == 1 && ack == 'A' && send(sock, "G", 1, MSG_NOSIGNAL) == 1) {
+        evlog(EV_UPGRADE, server->listenfds[0], nclients, "handoff", NULL);
+        evlog_stop();
+        printf("SERVER: Handed off %d clients to new process, exiting (%d closed mid-handover)\n", nclients, ncut);
+        exit(0);
+    }
+
+    fprintf(stderr, "SERVER: upgrade handoff failed, continuing\n");
+    atomic_store(&server->actors.frozen, 0);     // 방 스레드는 RELAY_TICK_MS 안에 다시 보내기 시작
+    close(sock);
+}
+
+/* 새 프로세스 측: 기존 서버로부터 소켓과 상태를 넘겨받음 */
+int receive_handoff(ServerContext *server) {
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0) { perror("upgrade socket"); return -1; }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, upgrade_sock_path(), sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("upgrade connect");
+        close(sock);
+        return -1;
+    }
+
+    HandoffRecord *rec = calloc(1, sizeof(HandoffRecord));
+    if (!rec) { close(sock); return -1; }
+    int idx = 0, nsess = 0, done = 0;
+
+    while (!done) {
+        int fds[2];
+        int nfds = recv_handoff(sock, rec, fds);
+        if (nfds < 0) break;
+
+        if (rec->kind == HANDOFF_LISTENER && nfds == 1 && server->nlisteners < MAX_LISTENERS) {
+            server->listenfds[server->nlisteners++] = fds[0];
+        } else if (rec->kind == HANDOFF_CLIENT && nfds >= 1 && idx < MAX_CLIENTS) {
+            ClientContext *c = &server->clients[idx++];
+            init_client(c);
+            c->fd = fds[0];
+            c->spool_fd = (rec->has_spool && nfds == 2) ? fds[1] : -1;
+            c->registered = rec->registered;
+            c->want_seq = rec->want_seq;
+            c->credit_rx = rec->credit_rx;
+            c->fileref_rx = rec->fileref_rx;
+            c->credit_carry = rec->credit;
+            c->relay_rx = rec->relay_rx;
+            c->cmd_len = (rec->cmd_len >= 0 && rec->cmd_len < MAXBUF) ? rec->cmd_len : 0;
+            c->file_relay = rec->file_relay;
+            c->file_remain = rec->file_remain;
+            c->file_size = rec->file_size;
+            memcpy(c->nickname, rec->nickname, MAXNAME - 1);
+            memcpy(c->room, rec->room, MAXROOM - 1);
+            memcpy(c->file_name, rec->file_name, sizeof(c->file_name) - 1);
+            memcpy(c->file_claimed, rec->file_claimed, HASHLEN);
+            memcpy(c->spool_part, rec->spool_part, sizeof(c->spool_part) - 1);
+            memcpy(c->cmd_buf, rec->cmd_buf, c->cmd_len);
+            c->nwatch = (rec->nwatch >= 0 && rec->nwatch <= MAX_WATCH) ? rec->nwatch : 0;
+            for (int w = 0; w < c->nwatch; w++) memcpy(c->watch[w], rec->watch[w], MAXROOM - 1);
+        } else if (rec->kind == HANDOFF_OUTPUT && idx > 0 && nfds <= 1 && rec->out_len >= 0 &&
+                   (nfds == 1 ? rec->out_off <= rec->out_len : rec->out_len <= HANDOFF_OUT_MAX)) {
+            ClientContext *c = &server->clients[idx - 1];
+            OutChunk *chunk = malloc(sizeof(OutChunk) + (nfds ? 0 : rec->out_len));
+            if (!chunk) {
+                perror("handoff output");
+                if (nfds) close(fds[0]);
+                continue;
+            }
+            chunk->next = NULL;
+            chunk->relay = rec->out_relay;
+            chunk->file_fd = nfds ? fds[0] : -1;
+            chunk->off = nfds ? rec->out_off : 0;
+            chunk->len = rec->out_len;
+            if (!nfds) memcpy(chunk->data, rec->out_data, rec->out_len);
+            OutChunk **tail = rec->out_held ? &c->carry_held : &c->carry_out;
+            while (*tail) tail = &(*tail)->next;
+            *tail = chunk;
+        } else if (rec->kind == HANDOFF_SESSION && nsess < MAX_SESSIONS) {
+            Session *sess = &server->sessions[nsess++];
+            sess->token = rec->token;
+            sess->last_used = rec->last_used;
+            memcpy(sess->nickname, rec->nickname, MAXNAME - 1);
+            memcpy(sess->room, rec->room, MAXROOM - 1);
+        } else if (rec->kind == HANDOFF_END) {
+            server->next_msg_id = rec->next_msg_id;
+            done = 1;
+        } else {
+            for (int i = 0; i < nfds; i++) close(fds[i]);
+        }
+    }
+    free(rec);
+
+    if (!done || server->nlisteners == 0) {
+        fprintf(stderr, "SERVER: incomplete handoff\n");
+        close(sock);
+        return -1;
+    }
+
+    // 기존 서버가 시간 제한 안에 ACK 를 받고 'G' 를 보내야 넘겨받은 소켓으로 서비스 시작
+    struct timeval tv = { 2 * UPGRADE_TIMEOUT_SEC, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char go = 0;
+    if (send(sock, "A", 1, MSG_NOSIGNAL) != 1 || recv(sock, &go, 1, 0) != 1 || go != 'G') {
+        fprintf(stderr, "SERVER: handoff not confirmed, old server keeps running\n");
+        close(sock);
+        return -1;
+    }
+    close(sock);
+    return idx;
+}
+
+/* 새 프로세스 측: 넘겨받은 못 보낸 출력을 입장한 방 actor 에 넘김 (room_join 에서 handover 로 입장한 뒤) */
+void carry_post(ServerContext *server, int idx) {
+    ClientContext *cli = &server->clients[idx];
+    RoomActor *a = actor_find(&server->actors, cli->room);
+    RoomMsg *msg = a ? room_msg_new(RMSG_HANDOVER, cli->serial, NULL, 0) : NULL;
+    cli->handover_pending = 0;
+    if (msg) {
+        msg->chunks = cli->carry_out;
+        msg->held = cli->carry_held;
+        cli->carry_out = cli->carry_held = NULL;
+        actor_post(&server->actors, a, msg);
+        return;
+    }
+    for (OutChunk *c = cli->carry_out; c; c = cli->carry_out) { cli->carry_out = c->next; chunk_free(c); }
+    for (OutChunk *c = cli->carry_held; c; c = cli->carry_held) { cli->carry_held = c->next; chunk_free(c); }
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
     setlocale(LC_ALL, "");
     ServerContext server;
     
     // 초기화
     memset(&server, 0, sizeof(server));
     for (int i = 0; i < MAX_CLIENTS; i++) init_client(&server.clients[i]);
+    nick_index_init(&server);
     
-    // 소켓 생성
-    server.listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server.listenfd < 0) { perror("socket"); exit(1); }
-
-    int yes = 1;
-    setsockopt(server.listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    int upgrade = 0, workers = 0, room_workers = 0;
+    const char *unix_path = NULL, *abstract_name = NULL;
+    server.backlog = DEFAULT_BACKLOG;
+    server.accept_budget = DEFAULT_ACCEPT_BUDGET;
+    server.max_clients = MAX_CLIENTS;
+    server.max_rss_kb = DEFAULT_MAX_RSS_MB * 1024L;
+    server.relay_window = RELAY_WINDOW_DEFAULT;
+    server.mem_budget = MEM_BUDGET_MB_DEFAULT * 1024L * 1024L;
+    server.actors.relay_lag_ms = RELAY_LAG_MS_DEFAULT;
 
-    struct sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
-    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    // SIGUSR2 (프로파일러 전환)와 종료 신호는 이벤트 루프의 pselect 안에서만 받도록 다른 스레드를 만들기 전에 막아 둠
+    sigset_t loop_sigs;
+    sigemptyset(&loop_sigs);
+    sigaddset(&loop_sigs, SIGUSR2);
+    sigaddset(&loop_sigs, SIGINT);
+    sigaddset(&loop_sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &loop_sigs, NULL);
+    prof_init();
+    struct sigaction stop_sa;
+    memset(&stop_sa, 0, sizeof(stop_sa));
+    stop_sa.sa_handler = on_shutdown_signal;
+    sigaction(SIGINT, &stop_sa, NULL);
+    sigaction(SIGTERM, &stop_sa, NULL);
 
-    if (bind(server.listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("bind"); exit(1);
+    // 실행 옵션: --upgrade --backlog N --accept-budget N --max-clients N --max-rss-mb N --workers N --room-workers N
+    //           --relay-window BYTES --relay-lag-ms MS --mem-budget-mb N --unix PATH --abstract NAME
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--upgrade") == 0) upgrade = 1;
+        else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) server.backlog = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--accept-budget") == 0 && i + 1 < argc) server.accept_budget = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc) server.max_clients = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-rss-mb") == 0 && i + 1 < argc) server.max_rss_kb = atol(argv[++i]) * 1024L;
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--room-workers") == 0 && i + 1 < argc) room_workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--relay-window") == 0 && i + 1 < argc) server.relay_window = atol(argv[++i]);
+        else if (strcmp(argv[i], "--relay-lag-ms") == 0 && i + 1 < argc) server.actors.relay_lag_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--mem-budget-mb") == 0 && i + 1 < argc) server.mem_budget = atol(argv[++i]) * 1024L * 1024L;
+        else if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) unix_path = argv[++i];
+        else if (strcmp(argv[i], "--abstract") == 0 && i + 1 < argc) abstract_name = argv[++i];
+        else {
+            fprintf(stderr, "Usage: %s [--upgrade] [--backlog N] [--accept-budget N] [--max-clients N] [--max-rss-mb N] [--workers N] [--room-workers N] [--relay-window BYTES] [--relay-lag-ms MS] [--mem-budget-mb N] [--unix PATH] [--abstract NAME]\n", argv[0]);
+            exit(1);
+        }
     }
+    if (server.backlog <= 0) server.backlog = DEFAULT_BACKLOG;
+    if (server.accept_budget <= 0) server.accept_budget = DEFAULT_ACCEPT_BUDGET;
+    if (server.max_clients <= 0 || server.max_clients > MAX_CLIENTS) server.max_clients = MAX_CLIENTS;
+    if (server.relay_window < MAXBUF) server.relay_window = MAXBUF;
+    if (server.actors.relay_lag_ms < 0) server.actors.relay_lag_ms = 0;
+    if (server.mem_budget < 0) server.mem_budget = 0;
+    srand(time(NULL) ^ getpid());
+
+    const char *evlog_path = getenv("CHAT_EVLOG");
+    evlog_start(evlog_path ? evlog_path : EVLOG_DEFAULT);
+    if (pool_start(&server.pool, workers) < 0) exit(1);
+    if (actors_start(&server.actors, room_workers, &server.pool) < 0) exit(1);
+
+    if (upgrade) {
+        // 기존 서버로부터 리슨 소켓과 클라이언트들을 넘겨받음
+        int n = receive_handoff(&server);
+        if (n < 0) { evlog_stop(); exit(1); }
+        server.nclients = n;
+        for (int i = 0; i < n; i++) {
+            if (!server.clients[i].registered) continue;
+            nick_index_add(&server, i);
+            // 이미 방에 있던 사람: 알림 없이 참여자로만 등록. 기존 서버가 못 보낸 출력이 있으면 그것부터
+            int carry = server.clients[i].carry_out || server.clients[i].carry_held;
+            if (room_join(&server, i, NULL, 0, 0, 1, carry) < 0 || carry) carry_post(&server, i);  // 입장 못 했으면 버림
+            for (int w = 0; w < server.clients[i].nwatch; w++) room_watch(&server, i, server.clients[i].watch[w], 1);
+        }
+        // 진행 중이던 구버전 중계는 내용 없는 헤더로 남은 바이트를 알려 이어 감 (받던 참여자는 JOIN 에 표시)
+        for (int i = 0; i < n; i++) {
+            ClientContext *c = &server.clients[i];
+            if (c->registered && c->file_remain > 0) room_post_raw(&server, i, NULL, 0, c->file_remain, AUD_ALL, -1);
+        }
+        evlog(EV_UPGRADE, server.listenfds[0], n, "takeover", NULL);
+        printf("SERVER: Took over %d clients\n", n);
+    } else {
+        // 소켓 생성 (업그레이드 때는 기존 서버의 리슨 소켓을 그대로 넘겨받으므로 옵션 무시)
+        int fd = open_tcp_listener(PORT, server.backlog);
+        if (fd < 0) exit(1);
+        server.listenfds[server.nlisteners++] = fd;
 
-    if (listen(server.listenfd, 10) < 0) {
-        perror("listen"); exit(1);
+        if (unix_path) {
+            if ((fd = open_unix_listener(unix_path, 0, server.backlog)) < 0) exit(1);
+            server.listenfds[server.nlisteners++] = fd;
+        }
+        if (abstract_name) {
+            if ((fd = open_unix_listener(abstract_name, 1, server.backlog)) < 0) exit(1);
+            server.listenfds[server.nlisteners++] = fd;
+        }
     }
 
+    index_init(&server.index, &server.pool);
+
     FD_ZERO(&server.all_fds);
-    FD_SET(server.listenfd, &server.all_fds);
-    server.max_fd = server.listenfd;
+    server.max_fd = -1;
+    for (int i = 0; i < server.nlisteners; i++) {
+        int fd = server.listenfds[i];
+        // 넘겨받은 소켓이어도 대기열 길이는 이번 실행의 설정을 따름
+        if (upgrade) listen(fd, server.backlog);
+
+        // accept 를 EAGAIN 까지 반복하기 위해 리슨 소켓은 논블로킹
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        FD_SET(fd, &server.all_fds);
+        if (fd > server.max_fd) server.max_fd = fd;
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        int fd = server.clients[i].fd;
+        if (fd == -1) continue;
+        FD_SET(fd, &server.all_fds);
+        if (fd > server.max_fd) server.max_fd = fd;
+    }
+
+    // 다음 업그레이드 요청 대기
+    server.upgradefd = open_upgrade_listener();
+    if (server.upgradefd >= 0) {
+        FD_SET(server.upgradefd, &server.all_fds);
+        if (server.upgradefd > server.max_fd) server.max_fd = server.upgradefd;
+    }
+
+    // 작업 스레드 완료 알림
+    FD_SET(server.pool.efd, &server.all_fds);
+    if (server.pool.efd > server.max_fd) server.max_fd = server.pool.efd;
 
-    printf("SERVER: Running on port %d...\n", PORT);
+    // 막아 둔 채로 두고 pselect 가 대기하는 동안만 풂: 요청 검사와 대기 사이에 온 신호는 보류되었다가
+    // 다음 pselect 를 바로 깨움 (select 전에 오면 다음 연결이 올 때까지 묻히던 문제)
+    sigset_t wait_mask;
+    pthread_sigmask(SIG_BLOCK, NULL, &wait_mask);
+    sigdelset(&wait_mask, SIGUSR2);
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGTERM);
+
+    for (int i = 0; i < server.nlisteners; i++) {
+        char where[128];
+        listener_describe(server.listenfds[i], where, sizeof(where));
+        evlog(EV_SERVER_START, server.listenfds[i], PORT, where, NULL);
+        printf("SERVER: Running on %s...\n", where);
+    }
 
     while (1) {
         fd_set read_fds = server.all_fds;
-        
-        if (select(server.max_fd + 1, &read_fds, NULL, NULL, NULL) < 0) {
+
+        // 메모리 예산에 걸려 있는 동안에는 방 스레드가 대기열을 줄였는지 주기적으로 확인
+        struct timespec tick = { 0, RELAY_TICK_MS * 1000000L };
+        int pressured = server.mem_paused > 0 || mem_level(&server) > 0;
+        int nready = pselect(server.max_fd + 1, &read_fds, NULL, NULL, pressured ? &tick : NULL, &wait_mask);
+        prof_poll();    // SIGUSR2 는 pselect 를 EINTR 로 깨움
+        if (shutdown_req) break;
+        mem_enforce(&server);
+        if (nready < 0) {
             if (errno == EINTR) continue;
-            perror("select");
+            perror("pselect");
             break;
         }
 
-        // 1. 새 연결 확인
-        if (FD_ISSET(server.listenfd, &read_fds)) {
-            handle_new_connection(&server);
+        // 0. 무중단 업그레이드 요청 (성공하면 여기서 프로세스 종료)
+        if (server.upgradefd >= 0 && FD_ISSET(server.upgradefd, &read_fds)) {
+            handle_upgrade_request(&server);
+        }
+
+        // 작업 스레드가 끝낸 일의 결과 반영 (응답 전송 등)
+        if (FD_ISSET(server.pool.efd, &read_fds)) {
+            pool_complete(&server);
+        }
+
+        // 1. 새 연결 확인 (TCP, UNIX 소켓 모두 같은 클라이언트 표에 등록)
+        for (int i = 0; i < server.nlisteners; i++) {
+            if (FD_ISSET(server.listenfds[i], &read_fds)) handle_new_connection(&server, server.listenfds[i]);
         }
 
         // 2. 기존 클라이언트 데이터 확인
         for (int i = 0; i < MAX_CLIENTS; i++) {
             int fd = server.clients[i].fd;
-            if (fd != -1 && fd != server.listenfd && FD_ISSET(fd, &read_fds)) {
+            if (fd != -1 && FD_ISSET(fd, &read_fds)) {
                 handle_client_data(&server, i);
             }
         }
     }
 
-    close(server.listenfd);
+    // 정상 종료: 기록/색인을 디스크에 남기고 UNIX 소켓 파일 정리
+    printf("SERVER: Shutting down\n");
+    actors_sync(&server.actors);
+    pool_complete(&server);
+    index_flush(&server.index);
+    pool_wait_idle(&server);
+    evlog_stop();
+    for (int i = 0; i < server.nlisteners; i++) {
+        listener_unlink(server.listenfds[i]);
+        close(server.listenfds[i]);
+    }
     return 0;
 }
\ No newline at end of file
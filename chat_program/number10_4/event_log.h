@@ -0,0 +1,59 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <stdint.h>
+
+/* chat_server 이벤트 로그 파일 형식 (chat_server.c 와 evlog_dump.c 가 공유)
+ *
+ * 파일 = EventLogHeader 1개 + EventRecord 고정 크기 레코드의 나열.
+ * 레코드는 호스트 바이트 순서로 그대로 기록한다. */
+
+#define EVLOG_MAGIC     "CHEVLOG1"
+#define EVLOG_DEFAULT   "chat_server.evlog"
+#define EVLOG_STRLEN    32
+
+typedef struct {
+    char     magic[8];          // EVLOG_MAGIC
+    uint32_t record_size;       // sizeof(EventRecord), 형식 확인용
+    uint32_t reserved;
+} EventLogHeader;
+
+typedef struct {
+    uint64_t ts_ns;             // 발생 시각 (CLOCK_REALTIME, ns)
+    uint16_t type;              // EventType
+    uint16_t ring;              // 기록한 스레드의 링 번호
+    int32_t  fd;                // 관련 소켓 (-1이면 없음)
+    int64_t  val;               // 숫자 인자 (파일 크기, 누락 건수 등)
+    char     a[EVLOG_STRLEN];   // 문자열 인자 1 (닉네임, 주소, 파일명)
+    char     b[EVLOG_STRLEN];   // 문자열 인자 2 (방 이름, 해시)
+} EventRecord;
+
+typedef enum {
+    EV_SERVER_START = 0,        // val=port
+    EV_CONNECT,                 // a=peer address
+    EV_REJECT,                  // a=peer address, val=RejectReason
+    EV_DISCONNECT,
+    EV_JOIN,                    // a=nickname, b=room
+    EV_FILE_START,              // a=file name, b=hash, val=size
+    EV_FILE_DONE,               // a=file name, b=hash, val=size
+    EV_DEDUP_HIT,               // a=file name, b=hash, val=size
+    EV_DROPPED,                 // val=링이 가득 차서 버려진 레코드 수
+    EV_UPGRADE,                 // a="handoff"/"takeover", val=넘긴/받은 클라이언트 수
+    EV_SLOW_DETACH,             // a=nickname, b=room, val=못 보내고 쌓인 바이트
+    EV_TRACE,                   // a=probe (recv/parse/fanout/send), b=인자, val=명령 추적 번호
+    EV_MEM_LEVEL,               // a=메모리 예산 단계 (ok/pause/shed), val=사용 중인 바이트
+    EV_TYPE_COUNT
+} EventType;
+
+typedef enum {
+    REJECT_CLIENTS = 1,         // 접속자 수 한도 초과
+    REJECT_MEMORY,              // 메모리 사용량 한도 초과
+} RejectReason;
+
+static const char *const event_type_names[EV_TYPE_COUNT] = {
+    "SERVER_START", "CONNECT", "REJECT", "DISCONNECT", "JOIN",
+    "FILE_START", "FILE_DONE", "DEDUP_HIT", "DROPPED", "UPGRADE",
+    "SLOW_DETACH", "TRACE", "MEM_LEVEL",
+};
+
+#endif
@@ -0,0 +1,51 @@
+/* chat_server 이진 이벤트 로그를 사람이 읽는 텍스트로 변환
+ *
+ * 빌드: gcc -o evlog_dump evlog_dump.c
+ * 사용: ./evlog_dump [chat_server.evlog] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "event_log.h"
+
+int main(int argc, char *argv[]) {
+    const char *path = (argc >= 2) ? argv[1] : EVLOG_DEFAULT;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) { perror(path); return 1; }
+
+    EventLogHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, EVLOG_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.record_size != sizeof(EventRecord)) {
+        fprintf(stderr, "%s: not an event log (or different record format)\n", path);
+        fclose(fp);
+        return 1;
+    }
+
+    EventRecord batch[256];
+    size_t n;
+    while ((n = fread(batch, sizeof(EventRecord), 256, fp)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            EventRecord *r = &batch[i];
+            time_t sec = (time_t)(r->ts_ns / 1000000000ULL);
+            struct tm tm;
+            char when[32];
+            localtime_r(&sec, &tm);
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+
+            const char *name = (r->type < EV_TYPE_COUNT) ? event_type_names[r->type] : "UNKNOWN";
+            printf("%s.%06llu [t%u] %-12s fd=%d",
+                   when, (unsigned long long)(r->ts_ns % 1000000000ULL) / 1000,
+                   r->ring, name, r->fd);
+            if (r->a[0]) printf(" %.*s", EVLOG_STRLEN, r->a);
+            if (r->b[0]) printf(" %.*s", EVLOG_STRLEN, r->b);
+            if (r->val) printf(" %lld", (long long)r->val);
+            printf("\n");
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}